@@ -0,0 +1,318 @@
+// Micro-benchmarks for brandy's analyses and passes over synthetic programs.
+//
+// Every benchmark times one stage of the pipeline on programs of growing size
+// and reports the time per iteration, per basic block and per instruction.
+// The last column of each family estimates the exponent k of O(n^k) between
+// the smallest and the largest program, which makes superlinear behaviour
+// stand out.
+//
+//   $ brandy-bench [--filter <substring>] [--min-time <seconds>]
+//   $ brandy-bench --emit <loops|branches|straight> <size> [num_vars]
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "basic_block.h"
+#include "cfg.h"
+#include "context.h"
+#include "dom.h"
+#include "function.h"
+#include "generator.h"
+#include "ssa.h"
+#include "transform.h"
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+// The stages are ordered: benchmarking one of them runs every earlier stage
+// untimed first, just like the driver does.
+enum class Stage {
+  Create,
+  BuildCFG,
+  ComputeDomInfo,
+  ToSSA,
+  sccp,
+  die,
+  rotate,
+  peel,
+  licm,
+  unswitch,
+  lsr,
+  unroll,
+  cse,
+  lvn,
+  gvn,
+  CopyProp,
+};
+
+const char *StageName(Stage stage) {
+  switch (stage) {
+    case Stage::Create:
+      return "Function::Create";
+    case Stage::BuildCFG:
+      return "BuildCFG";
+    case Stage::ComputeDomInfo:
+      return "ComputeDomInfo";
+    case Stage::ToSSA:
+      return "ToSSA";
+    case Stage::sccp:
+      return "sccp";
+    case Stage::die:
+      return "die";
+    case Stage::rotate:
+      return "rotate";
+    case Stage::peel:
+      return "peel";
+    case Stage::licm:
+      return "licm";
+    case Stage::unswitch:
+      return "unswitch";
+    case Stage::lsr:
+      return "lsr";
+    case Stage::unroll:
+      return "unroll";
+    case Stage::cse:
+      return "cse";
+    case Stage::lvn:
+      return "lvn";
+    case Stage::gvn:
+      return "gvn";
+    case Stage::CopyProp:
+      return "CopyProp";
+  }
+  return "unknown";
+}
+
+struct Family {
+  std::string name;
+  Shape shape;
+  std::vector<int> sizes;
+  // Scale the variable pool with the size instead of the instruction count.
+  bool scale_vars = false;
+};
+
+struct Result {
+  double ns_per_iter = 0;
+  long iterations = 0;
+  int blocks = 0;
+  int instrs = 0;
+};
+
+GenOptions optionsFor(const Family &family, int size) {
+  GenOptions options;
+  options.shape = family.shape;
+  if (family.scale_vars) {
+    options.size = 1024;
+    options.num_vars = size;
+  } else {
+    options.size = size;
+  }
+  return options;
+}
+
+// Run the pipeline up to `stage` on a fresh copy of the program and return
+// the nanoseconds spent in `stage` alone.
+double runOnce(const nl::json &program, Stage stage, int &blocks,
+               int &instrs) {
+  Context ctx;
+  double elapsed = 0;
+  blocks = instrs = 0;
+  for (const nl::json &input : program["functions"]) {
+    auto time = [&elapsed](const std::function<void()> &fn) {
+      auto start = Clock::now();
+      fn();
+      elapsed +=
+          std::chrono::duration<double, std::nano>(Clock::now() - start)
+              .count();
+    };
+
+    Function *function = nullptr;
+    auto create = [&] { function = Function::Create(&ctx, input); };
+    if (stage == Stage::Create) {
+      time(create);
+      continue;
+    }
+    create();
+
+    blocks += function->basic_blocks.size();
+    for (BasicBlock *bb : function->basic_blocks) instrs += bb->instrs.size();
+
+    CFG cfg;
+    DomInfo dom;
+    std::vector<std::pair<Stage, std::function<void()>>> pipeline = {
+        {Stage::BuildCFG, [&] { cfg = BuildCFG(*function); }},
+        {Stage::ComputeDomInfo, [&] { dom = ComputeDomInfo(cfg); }},
+        {Stage::ToSSA, [&] { ToSSA(&ctx, *function, cfg, dom); }},
+        {Stage::sccp, [&] { sccp(*function); }},
+        {Stage::die, [&] { die(*function, /*remove_branches=*/true); }},
+        {Stage::rotate, [&] { rotate(&ctx, *function); }},
+        {Stage::peel, [&] { peel(&ctx, *function); }},
+        {Stage::licm, [&] { licm(&ctx, *function); }},
+        {Stage::unswitch, [&] { unswitch(&ctx, *function); }},
+        {Stage::lsr, [&] { lsr(&ctx, *function); }},
+        {Stage::unroll, [&] { unroll(&ctx, *function); }},
+        {Stage::cse, [&] { cse(*function); }},
+        {Stage::lvn, [&] { lvn(*function); }},
+        {Stage::gvn, [&] { gvn(*function); }},
+        {Stage::CopyProp, [&] { CopyProp(*function); }},
+    };
+    for (auto &[s, fn] : pipeline) {
+      if (s == stage) {
+        time(fn);
+        break;
+      }
+      // gvn replaced cse in Optimize, and lvn is -O1's pass; both are still
+      // measured at the same point for comparison but don't run otherwise.
+      if (s != Stage::cse && s != Stage::lvn) fn();
+    }
+  }
+  if (stage == Stage::Create) {
+    // Count the shape of the program for the per-block columns.
+    Context counting;
+    for (const nl::json &input : program["functions"]) {
+      Function *function = Function::Create(&counting, input);
+      blocks += function->basic_blocks.size();
+      for (BasicBlock *bb : function->basic_blocks) {
+        instrs += bb->instrs.size();
+      }
+    }
+  }
+  return elapsed;
+}
+
+Result run(const nl::json &program, Stage stage, double min_time) {
+  Result result;
+  double total = 0;
+  // At least a few iterations, then keep going until we measured long enough.
+  // The untimed setup can dwarf a cheap stage, so also bound the wall time.
+  auto start = Clock::now();
+  auto wall = [&start] {
+    return std::chrono::duration<double>(Clock::now() - start).count();
+  };
+  while (result.iterations < 3 ||
+         (total < min_time * 1e9 && wall() < min_time * 10)) {
+    total += runOnce(program, stage, result.blocks, result.instrs);
+    ++result.iterations;
+  }
+  result.ns_per_iter = total / result.iterations;
+  return result;
+}
+
+std::string formatTime(double ns) {
+  char buf[32];
+  if (ns < 1e3) {
+    std::snprintf(buf, sizeof(buf), "%.1f ns", ns);
+  } else if (ns < 1e6) {
+    std::snprintf(buf, sizeof(buf), "%.2f us", ns / 1e3);
+  } else if (ns < 1e9) {
+    std::snprintf(buf, sizeof(buf), "%.2f ms", ns / 1e6);
+  } else {
+    std::snprintf(buf, sizeof(buf), "%.2f s", ns / 1e9);
+  }
+  return buf;
+}
+
+void usage() {
+  std::cout << "Usage:\n";
+  std::cout << "$ brandy-bench [--filter <substring>] "
+               "[--min-time <seconds>]\n";
+  std::cout << "$ brandy-bench --emit <loops|branches|straight> <size> "
+               "[num_vars]\n";
+  exit(-1);
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  std::string filter;
+  double min_time = 0.1;
+
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "--filter" && i + 1 < argc) {
+      filter = argv[++i];
+    } else if (arg == "--min-time" && i + 1 < argc) {
+      min_time = std::atof(argv[++i]);
+    } else if (arg == "--emit" && i + 2 < argc) {
+      std::optional<Shape> shape = ParseShape(argv[++i]);
+      if (!shape) usage();
+      GenOptions options;
+      options.shape = *shape;
+      options.size = std::atoi(argv[++i]);
+      if (i + 1 < argc) options.num_vars = std::atoi(argv[++i]);
+      std::cout << GenerateProgram(options) << "\n";
+      return 0;
+    } else {
+      usage();
+    }
+  }
+
+  std::vector<Family> families = {
+      {"straight", Shape::StraightLine, {256, 1024, 4096}},
+      {"vars", Shape::StraightLine, {16, 128, 1024}, /*scale_vars=*/true},
+      {"loops", Shape::LoopNest, {4, 16, 64}},
+      {"branches", Shape::BranchChain, {16, 64, 256}},
+  };
+  std::vector<Stage> stages = {Stage::Create,         Stage::BuildCFG,
+                               Stage::ComputeDomInfo, Stage::ToSSA,
+                               Stage::sccp,           Stage::die,
+                               Stage::rotate,         Stage::peel,
+                               Stage::licm,           Stage::unswitch,
+                               Stage::lsr,            Stage::unroll,
+                               Stage::cse,            Stage::lvn,
+                               Stage::gvn,            Stage::CopyProp};
+
+#ifndef __OPTIMIZE__
+  std::printf("***WARNING*** brandy-bench was built without optimizations, "
+              "configure with -DCMAKE_BUILD_TYPE=Release.\n");
+#endif
+
+  std::printf("%-36s %12s %10s %12s %12s %8s\n", "Benchmark", "Time",
+              "Iterations", "Time/block", "Time/instr", "O(n^k)");
+  for (Stage stage : stages) {
+    for (const Family &family : families) {
+      std::string prefix =
+          std::string(StageName(stage)) + "/" + family.name + "/";
+      if (!filter.empty() &&
+          (prefix + std::to_string(family.sizes.back())).find(filter) ==
+              std::string::npos) {
+        continue;
+      }
+
+      std::vector<Result> results;
+      for (int size : family.sizes) {
+        nl::json program = GenerateProgram(optionsFor(family, size));
+        Result r = run(program, stage, min_time);
+        results.push_back(r);
+
+        std::string growth;
+        if (results.size() > 1 && results.front().instrs > 0 &&
+            results.front().ns_per_iter > 0) {
+          // With a fixed instruction count ("vars"), scale by the size knob.
+          double n0 = family.scale_vars ? family.sizes.front()
+                                        : results.front().instrs;
+          double n1 = family.scale_vars ? size : r.instrs;
+          char buf[16];
+          std::snprintf(buf, sizeof(buf), "%.2f",
+                        std::log(r.ns_per_iter / results.front().ns_per_iter) /
+                            std::log(n1 / n0));
+          growth = buf;
+        }
+        std::printf("%-36s %12s %10ld %12s %12s %8s\n",
+                    (prefix + std::to_string(size)).c_str(),
+                    formatTime(r.ns_per_iter).c_str(), r.iterations,
+                    formatTime(r.ns_per_iter / r.blocks).c_str(),
+                    formatTime(r.ns_per_iter / r.instrs).c_str(),
+                    growth.c_str());
+        std::fflush(stdout);
+      }
+    }
+  }
+}
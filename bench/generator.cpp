@@ -0,0 +1,176 @@
+#include "generator.h"
+
+#include <random>
+#include <string>
+#include <vector>
+
+namespace {
+
+struct Generator {
+  const GenOptions &options;
+  std::mt19937_64 rng;
+  nl::json instrs = nl::json::array();
+  int labels = 0;
+
+  Generator(const GenOptions &options, uint64_t seed)
+      : options(options), rng(seed) {}
+
+  std::string var(int i) { return "v" + std::to_string(i); }
+
+  std::string randomVar() {
+    return var(std::uniform_int_distribution<int>(0, options.num_vars - 1)(
+        rng));
+  }
+
+  std::string freshLabel(const std::string &prefix) {
+    return prefix + "." + std::to_string(labels++);
+  }
+
+  void label(const std::string &name) { instrs.push_back({{"label", name}}); }
+
+  void constant(const std::string &dest, nl::json value,
+                const std::string &type = "int") {
+    instrs.push_back(
+        {{"op", "const"}, {"dest", dest}, {"type", type}, {"value", value}});
+  }
+
+  void op(const std::string &op, const std::string &dest,
+          std::vector<std::string> args, const std::string &type = "int") {
+    instrs.push_back(
+        {{"op", op}, {"dest", dest}, {"type", type}, {"args", args}});
+  }
+
+  void jmp(const std::string &target) {
+    instrs.push_back({{"op", "jmp"}, {"labels", {target}}});
+  }
+
+  void br(const std::string &cond, const std::string &then,
+          const std::string &otherwise) {
+    instrs.push_back(
+        {{"op", "br"}, {"args", {cond}}, {"labels", {then, otherwise}}});
+  }
+
+  // Random arithmetic over the variable pool. Some instructions repeat the
+  // previous expression or copy a variable so that cse and CopyProp have
+  // something to find.
+  void arithmetic(int count) {
+    static const char *kOps[] = {"add", "sub", "mul"};
+    std::string last_op = "add";
+    std::vector<std::string> last_args = {var(0), var(0)};
+    for (int i = 0; i < count; ++i) {
+      int kind = std::uniform_int_distribution<int>(0, 99)(rng);
+      std::string dest = randomVar();
+      if (kind < 15) {
+        op(last_op, dest, last_args);
+      } else if (kind < 30) {
+        op("id", dest, {randomVar()});
+      } else {
+        last_op = kOps[std::uniform_int_distribution<int>(0, 2)(rng)];
+        last_args = {randomVar(), randomVar()};
+        op(last_op, dest, last_args);
+      }
+    }
+  }
+
+  void loopNest(int depth) {
+    if (depth == options.size) {
+      arithmetic(options.body_len);
+      return;
+    }
+    std::string i = "i" + std::to_string(depth);
+    std::string cond = "cond" + std::to_string(depth);
+    std::string header = freshLabel("header");
+    std::string body = freshLabel("body");
+    std::string exit = freshLabel("exit");
+
+    constant(i, 0);
+    label(header);
+    op("lt", cond, {i, "trip"}, "bool");
+    br(cond, body, exit);
+    label(body);
+    arithmetic(options.body_len);
+    loopNest(depth + 1);
+    op("add", i, {i, "one"});
+    jmp(header);
+    label(exit);
+  }
+
+  void branchChain() {
+    std::string join = freshLabel("join");
+    for (int c = 0; c < options.size; ++c) {
+      std::string k = "k" + std::to_string(c);
+      std::string cond = "case_cond" + std::to_string(c);
+      std::string body = freshLabel("case");
+      std::string next = freshLabel("next");
+      constant(k, c);
+      op("eq", cond, {"sel", k}, "bool");
+      br(cond, body, next);
+      label(body);
+      arithmetic(options.body_len);
+      jmp(join);
+      label(next);
+    }
+    arithmetic(options.body_len);
+    label(join);
+  }
+
+  nl::json function(const std::string &name) {
+    instrs = nl::json::array();
+    for (int i = 0; i < options.num_vars; ++i) {
+      constant(var(i), static_cast<int>(rng() % 100));
+    }
+    constant("one", 1);
+    constant("trip", 4);
+    constant("sel", static_cast<int>(rng() % (options.size + 1)));
+
+    switch (options.shape) {
+      case Shape::LoopNest:
+        loopNest(0);
+        break;
+      case Shape::BranchChain:
+        branchChain();
+        break;
+      case Shape::StraightLine:
+        arithmetic(options.size);
+        break;
+    }
+
+    std::vector<std::string> all;
+    for (int i = 0; i < options.num_vars; ++i) all.push_back(var(i));
+    instrs.push_back({{"op", "print"}, {"args", all}});
+
+    return {{"name", name}, {"instrs", std::move(instrs)}};
+  }
+};
+
+}  // namespace
+
+nl::json GenerateProgram(const GenOptions &options) {
+  Generator gen(options, options.seed);
+  nl::json program;
+  program["functions"] = nl::json::array();
+  for (int f = 0; f < options.num_functions; ++f) {
+    std::string name = f == 0 ? "main" : "f" + std::to_string(f);
+    program["functions"].push_back(gen.function(name));
+  }
+  return program;
+}
+
+std::optional<Shape> ParseShape(std::string_view name) {
+  if (name == "loops") return Shape::LoopNest;
+  if (name == "branches") return Shape::BranchChain;
+  if (name == "straight") return Shape::StraightLine;
+  return std::nullopt;
+}
+
+const char *ShapeName(Shape shape) {
+  switch (shape) {
+    case Shape::LoopNest:
+      return "loops";
+    case Shape::BranchChain:
+      return "branches";
+    case Shape::StraightLine:
+      return "straight";
+  }
+  return "unknown";
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <string_view>
+
+#include "common.h"
+
+// Shapes of synthetic Bril programs, each stressing a different dimension of
+// the analyses.
+enum class Shape {
+  // `size` counted loops nested inside each other.
+  LoopNest,
+  // A switch-like chain of `size` compare-and-branch cases joining at the end.
+  BranchChain,
+  // A single block of `size` instructions.
+  StraightLine,
+};
+
+struct GenOptions {
+  Shape shape = Shape::StraightLine;
+  int size = 64;
+  // Distinct variables the generated code reads and writes.
+  int num_vars = 8;
+  // Arithmetic instructions in every loop body or case block.
+  int body_len = 4;
+  // Number of independent functions in the program, the first being @main.
+  int num_functions = 1;
+  uint64_t seed = 1;
+};
+
+// Build a program in Bril's canonical JSON form. Every variable is defined in
+// the entry block before it is used, and all of them are printed at the end,
+// so the output is a valid input for the whole brandy pipeline.
+nl::json GenerateProgram(const GenOptions &options);
+
+std::optional<Shape> ParseShape(std::string_view name);
+
+const char *ShapeName(Shape shape);
@@ -0,0 +1,195 @@
+// End-to-end throughput of the brandy pipeline with regression gating.
+//
+// Parses, compiles and serializes a corpus of large programs through
+// CompileProgram(), the same code path as the brandy binary, and reports the
+// throughput in MB of input JSON per second, functions per second and the
+// peak RSS. The numbers are compared against a checked-in baseline and the
+// run fails when throughput drops by more than the tolerance.
+//
+//   $ brandy-throughput [--baseline <file>] [--tolerance <fraction>]
+//                       [--repeat <n>] [--update-baseline] [corpus.json...]
+//
+// Without corpus files a synthetic MB-scale corpus is generated.
+
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "driver.h"
+#include "generator.h"
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct Measurement {
+  double mb_per_s = 0;
+  double functions_per_s = 0;
+  long peak_rss_kb = 0;
+};
+
+std::vector<std::string> generateCorpus() {
+  std::vector<std::string> corpus;
+  GenOptions straight;
+  straight.shape = Shape::StraightLine;
+  straight.size = 512;
+  straight.num_vars = 32;
+  straight.num_functions = 64;
+
+  GenOptions loops;
+  loops.shape = Shape::LoopNest;
+  loops.size = 6;
+  loops.body_len = 16;
+  loops.num_functions = 128;
+
+  GenOptions branches;
+  branches.shape = Shape::BranchChain;
+  branches.size = 24;
+  branches.body_len = 8;
+  branches.num_functions = 64;
+
+  for (const GenOptions &options : {straight, loops, branches}) {
+    corpus.push_back(GenerateProgram(options).dump());
+  }
+  return corpus;
+}
+
+long peakRSS() {
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+  // Kilobytes on Linux.
+  return usage.ru_maxrss;
+}
+
+Measurement measure(const std::vector<std::string> &corpus, int repeat) {
+  size_t bytes = 0;
+  for (const std::string &program : corpus) bytes += program.size();
+
+  // Keep the best run, the others mostly measure noise.
+  double best = 0;
+  int functions = 0;
+  for (int i = 0; i < repeat; ++i) {
+    functions = 0;
+    auto start = Clock::now();
+    for (const std::string &program : corpus) {
+      std::ostringstream out;
+      functions += CompileProgram(nl::json::parse(program), out);
+    }
+    double elapsed =
+        std::chrono::duration<double>(Clock::now() - start).count();
+    if (i == 0 || elapsed < best) best = elapsed;
+  }
+
+  Measurement m;
+  m.mb_per_s = bytes / 1e6 / best;
+  m.functions_per_s = functions / best;
+  m.peak_rss_kb = peakRSS();
+  return m;
+}
+
+void usage() {
+  std::cout << "Usage:\n";
+  std::cout << "$ brandy-throughput [--baseline <file>] [--tolerance "
+               "<fraction>] [--repeat <n>] [--update-baseline] "
+               "[corpus.json...]\n";
+  exit(-1);
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  std::string baseline_file;
+  double tolerance = -1;
+  int repeat = 3;
+  bool update = false;
+  std::vector<std::string> files;
+
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "--baseline" && i + 1 < argc) {
+      baseline_file = argv[++i];
+    } else if (arg == "--tolerance" && i + 1 < argc) {
+      tolerance = std::atof(argv[++i]);
+    } else if (arg == "--repeat" && i + 1 < argc) {
+      repeat = std::max(1, std::atoi(argv[++i]));
+    } else if (arg == "--update-baseline") {
+      update = true;
+    } else if (arg.starts_with("--")) {
+      usage();
+    } else {
+      files.push_back(arg);
+    }
+  }
+
+#ifndef __OPTIMIZE__
+  std::cout << "***WARNING*** brandy-throughput was built without "
+               "optimizations, configure with -DCMAKE_BUILD_TYPE=Release.\n";
+#endif
+
+  std::vector<std::string> corpus;
+  if (files.empty()) {
+    corpus = generateCorpus();
+  } else {
+    for (const std::string &file : files) {
+      std::ifstream f(file);
+      if (!f) {
+        std::cout << "Error: cannot read " << file << "\n";
+        return 1;
+      }
+      std::stringstream buffer;
+      buffer << f.rdbuf();
+      corpus.push_back(buffer.str());
+    }
+  }
+
+  Measurement m = measure(corpus, repeat);
+  std::printf("%-16s %12.2f\n", "MB/s", m.mb_per_s);
+  std::printf("%-16s %12.1f\n", "functions/s", m.functions_per_s);
+  std::printf("%-16s %12ld\n", "peak RSS (KB)", m.peak_rss_kb);
+
+  if (baseline_file.empty()) return 0;
+
+  if (update) {
+    nl::json baseline;
+    {
+      std::ifstream f(baseline_file);
+      if (f) baseline = nl::json::parse(f);
+    }
+    baseline["mb_per_s"] = m.mb_per_s;
+    baseline["functions_per_s"] = m.functions_per_s;
+    baseline["peak_rss_kb"] = m.peak_rss_kb;
+    if (!baseline.contains("tolerance")) baseline["tolerance"] = 0.25;
+    std::ofstream(baseline_file) << baseline.dump(2) << "\n";
+    std::cout << "Updated " << baseline_file << "\n";
+    return 0;
+  }
+
+  std::ifstream f(baseline_file);
+  if (!f) {
+    std::cout << "Error: cannot read " << baseline_file << "\n";
+    return 1;
+  }
+  nl::json baseline = nl::json::parse(f);
+  if (tolerance < 0) tolerance = baseline.value("tolerance", 0.25);
+
+  bool failed = false;
+  auto check = [&](const char *name, double current, double expected) {
+    double floor = expected * (1 - tolerance);
+    bool ok = current >= floor;
+    std::printf("%-16s %12.2f vs baseline %12.2f (min %.2f): %s\n", name,
+                current, expected, floor, ok ? "ok" : "REGRESSION");
+    failed |= !ok;
+  };
+  check("MB/s", m.mb_per_s, baseline["mb_per_s"].get<double>());
+  check("functions/s", m.functions_per_s,
+        baseline["functions_per_s"].get<double>());
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "common.h"
+
+class Function;
+
+// The bytecode shared by the VM and the JIT: functions lowered to flat arrays
+// of three-address instructions over numbered frame slots. Blocks become jump
+// targets and phis are resolved into moves on the incoming edges, so slots
+// are SSA values plus a few scratch slots for parallel copies.
+
+union Slot {
+  int64_t i;
+  double f;
+  Slot *p;
+};
+
+#define VM_OPS(X)                                                          \
+  X(Const) X(Mov) X(Add) X(Sub) X(Mul) X(Div) X(Eq) X(Lt) X(Gt) X(Le)      \
+  X(Ge) X(Not) X(And) X(Or) X(Fadd) X(Fsub) X(Fmul) X(Fdiv) X(Feq) X(Flt)  \
+  X(Fgt) X(Fle) X(Fge) X(Alloc) X(Free) X(Store) X(Load) X(PtrAdd) X(Jmp)  \
+  X(Br) X(Call) X(Ret) X(Print) X(Nop)
+
+// The base opcodes come first, followed by the superinstructions, each of
+// which executes two adjacent base instructions with a single dispatch.
+enum class VMOp : uint8_t {
+#define X(op) op,
+  VM_OPS(X)
+#undef X
+#define SUPERINSTR(first, second) first##_##second,
+#include "vm_superinstrs.def"
+#undef SUPERINSTR
+};
+
+constexpr int kNumBaseOps = static_cast<int>(VMOp::Nop) + 1;
+
+// How to print a slot.
+enum class Tag : int32_t { Int, Bool, Float, Char, Ptr };
+
+// A three-address instruction over frame slots.
+//   Jmp: b is the target pc.
+//   Br: a is the condition, b and c the pcs of the true and false targets.
+//   Call: a is the callee index, b the argument count and c the offset of
+//         the argument slots in the pool.
+//   Print: b is the argument count and c the offset of (slot, Tag) pairs in
+//          the pool.
+struct VMInstr {
+  const void *handler = nullptr;
+  VMOp op;
+  int32_t dst = -1;
+  int32_t a = -1;
+  int32_t b = -1;
+  int32_t c = -1;
+  Slot imm = {0};
+};
+
+struct VMFunction {
+  std::string name;
+  int num_params = 0;
+  int num_slots = 0;
+  std::vector<VMInstr> code;
+  std::vector<int32_t> pool;
+  std::vector<nl::json> param_types;
+  // The handler table `code` is currently threaded with.
+  const void *threaded = nullptr;
+};
+
+
+// Lower `function` into `out`. Calls refer to callees by their index in
+// `function_index`. With `fuse`, adjacent pairs from vm_superinstrs.def are
+// replaced by superinstructions.
+void LowerFunction(const Function &function,
+                   const std::map<std::string, int> &function_index,
+                   VMFunction &out, bool fuse);
+
+// The lowest address the native stack of the calling thread may grow to
+// before running out, less `reserve` bytes. Executors that recurse natively
+// check against it to report "stack overflow" instead of crashing.
+uintptr_t NativeStackLimit(uintptr_t reserve);
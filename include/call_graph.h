@@ -0,0 +1,25 @@
+#pragma once
+
+#include <map>
+#include <vector>
+
+class Function;
+
+// Which functions of a program call which, from their call instructions.
+// Calls to functions the program doesn't define are left out. Components
+// are found with Tarjan's algorithm.
+struct CallGraph {
+  // In input order.
+  std::vector<Function *> functions;
+  // Every function called, once, in the order of the first call.
+  std::map<Function *, std::vector<Function *>> callees;
+  std::map<Function *, std::vector<Function *>> callers;
+  // The strongly connected components: functions that call each other,
+  // directly or not, share one. Every component comes after the components
+  // it calls, and in one, the functions are deepest in the search first.
+  std::vector<std::vector<Function *>> sccs;
+  // The index of the component of every function in `sccs`.
+  std::map<Function *, int> scc_of;
+};
+
+CallGraph BuildCallGraph(const std::vector<Function *> &functions);
@@ -17,3 +17,11 @@ struct CFG {
 };
 
 CFG BuildCFG(const Function &function);
+
+// Drop the blocks that can't be reached from the entry, and the phi
+// arguments of edges that no longer exist.
+void RemoveUnreachableBlocks(Function &function);
+
+// Append every block that is the only successor of its only predecessor,
+// which jumps to it, to that predecessor.
+void MergeBlocks(Function &function);
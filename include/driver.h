@@ -0,0 +1,55 @@
+#pragma once
+
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "common.h"
+
+struct DriverOptions {
+  enum class Action {
+    // Print the optimized program as JSON, one program per function.
+    EmitJson,
+    // Run @main with the built-in interpreter.
+    Interpret,
+    // Run @main on the bytecode VM.
+    RunVM,
+    // Run @main as native code, or on the VM if the JIT can't compile it.
+    RunJIT,
+    // Interpret @main right away and optimize hot functions in the
+    // background, see Tiering.
+    RunTiered,
+    // Print the optimized program as a C translation unit.
+    EmitC,
+    // Print the loop nest of every function, see LoopInfo.
+    PrintLoops,
+    // Print the trip counts and recurrences of every loop, see
+    // ScalarEvolution.
+    PrintScev,
+  };
+  Action action = Action::EmitJson;
+  // 0 leaves the input alone, 1 runs lvn on each block, 2 runs ToSSA and
+  // Optimize.
+  int opt_level = 2;
+  // Threads optimizing functions that don't call each other at once, one per
+  // core if 0.
+  int jobs = 0;
+  // Copies of the body per trip of a partially unrolled loop at -O2, see
+  // unroll. 1 turns partial unrolling off.
+  int unroll_factor = 4;
+  // Print dynamic instruction counts to stderr after interpreting, or the
+  // opcode pair profile after running on the VM.
+  bool profile = false;
+  // Calls plus loop back-edges after which RunTiered optimizes a function.
+  uint64_t tier_threshold = 100;
+  // Command-line arguments of @main.
+  std::vector<std::string> args;
+};
+
+// Run brandy's pipeline on every function of `ir` and act on the result as
+// requested by `options`, writing to `out`. Returns the number of functions
+// compiled. Errors of an interpreted program are thrown as
+// std::runtime_error.
+int CompileProgram(const nl::json &ir, std::ostream &out,
+                   const DriverOptions &options = {});
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <ostream>
+#include <vector>
+
+class Function;
+
+// Translate a program into a self-contained C translation unit.
+//
+// Every Bril function becomes a C function and every block a label. Phis are
+// lowered through a shadow variable per phi: each incoming edge assigns the
+// shadow and the block copies it into the phi's destination on entry, which
+// keeps parallel-copy semantics without sequentializing moves. Memory ops map
+// to a small runtime at the top of the file that also checks for leaks, and
+// the generated `main` parses @main's arguments from argv. Runtime errors are
+// printed to stderr and exit with status 2, like brandy itself.
+//
+// Throws std::runtime_error for ops the backend doesn't know.
+void EmitC(const std::vector<Function *> &functions, std::ostream &out);
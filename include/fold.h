@@ -0,0 +1,13 @@
+#pragma once
+
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "common.h"
+
+// Evaluate `op` on int, bool or float constants the way the interpreter
+// does. Returns nothing if `op` can't be folded, if it would trap, or if the
+// result isn't representable in JSON.
+std::optional<nl::json> FoldConstant(const std::string &op,
+                                     const std::vector<nl::json> &args);
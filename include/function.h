@@ -14,6 +14,9 @@ class Instruction;
 struct Function {
   std::string name;
   std::vector<std::string> args;
+  // Bril types of the arguments and of the return value (null if none).
+  std::vector<nl::json> arg_types;
+  nl::json type;
   std::deque<BasicBlock*> basic_blocks;
   std::map<std::string, BasicBlock*> block_map;
   std::map<std::string, Instruction*> all_instrs;
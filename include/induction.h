@@ -0,0 +1,40 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+class Function;
+class Instruction;
+struct Loop;
+
+// A basic induction variable: a phi in the header of a loop that starts as
+// `init` on entry and moves by the loop-invariant `step` on every trip
+// around the loop.
+struct InductionVariable {
+  Instruction *phi = nullptr;
+  // The add or sub of `step` that flows back into the phi from the latch.
+  Instruction *next = nullptr;
+  std::string init;
+  std::string step;
+  bool decrement = false;
+};
+
+// An instruction in the loop whose value is a basic induction variable
+// scaled or offset by a loop-invariant `factor`: `mul iv factor` or
+// `ptradd factor iv`.
+struct DerivedInductionVariable {
+  Instruction *instr = nullptr;
+  const InductionVariable *basis = nullptr;
+  // Whether it uses the value after the step, basis->next, instead of the
+  // phi.
+  bool of_next = false;
+  std::string factor;
+};
+
+struct InductionInfo {
+  std::vector<InductionVariable> basic;
+  std::vector<DerivedInductionVariable> derived;
+};
+
+// Needs SSA form, a preheader and a single latch; finds nothing otherwise.
+InductionInfo FindInductionVariables(Function &function, const Loop &loop);
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "common.h"
+
+class Function;
+
+// A Bril runtime value. Pointers are an allocation id plus an offset, like the
+// reference interpreter, so that out-of-bounds accesses can be diagnosed.
+struct Value {
+  enum class Kind : uint8_t { Undef, Int, Bool, Float, Char, Ptr };
+  Kind kind = Kind::Undef;
+  union {
+    int64_t i;
+    bool b;
+    double f;
+    char32_t c;
+    struct {
+      int64_t alloc;
+      int64_t offset;
+    } ptr;
+  };
+
+  Value() : i(0) {}
+  static Value Int(int64_t v);
+  static Value Bool(bool v);
+  static Value Float(double v);
+  static Value Char(char32_t v);
+  static Value Ptr(int64_t alloc, int64_t offset);
+
+  // Parse a command-line argument of the given Bril type.
+  static Value Parse(const std::string &text, const nl::json &type);
+
+  // Format like brili does.
+  std::string ToString() const;
+};
+
+struct FunctionCode;
+
+// Lets a tiering policy watch how hot functions get and swap in other
+// versions of them. The callbacks run on the interpreter's thread.
+class TierPolicy {
+ public:
+  virtual ~TierPolicy() = default;
+
+  // `function` jumped back to an earlier block, `count` times so far.
+  virtual void OnBackEdge(Function *function, uint64_t count) {}
+
+  // `function` is about to be called for the `count`th time. Returns the
+  // version to run, which also replaces `function` for later calls.
+  virtual Function *OnCall(Function *function, uint64_t count) {
+    return function;
+  }
+};
+
+// A tree-walking interpreter over brandy's IR. It runs functions both before
+// and after ToSSA, evaluating the phis at the top of a block in parallel based
+// on the block control came from, and counts every executed instruction per
+// function and opcode. Errors in the interpreted program are reported by
+// throwing std::runtime_error.
+class Interpreter {
+ public:
+  Interpreter(const std::vector<Function *> &functions, std::ostream &out);
+  ~Interpreter();
+
+  // Run @main with the given command-line arguments.
+  void Run(const std::vector<std::string> &args);
+
+  Value Call(const std::string &name, const std::vector<Value> &args);
+
+  uint64_t TotalCount() const;
+
+  // Dynamic instruction counts per function and opcode.
+  std::map<std::string, std::map<std::string, uint64_t>> Counts() const;
+
+  void DumpProfile(std::ostream &os) const;
+
+  void SetTierPolicy(TierPolicy *policy) { tier_policy = policy; }
+
+ private:
+  FunctionCode &code(Function *function);
+
+  std::map<std::string, Function *> functions;
+  std::unordered_map<Function *, std::unique_ptr<FunctionCode>> decoded;
+  std::ostream &out;
+
+  std::map<int64_t, std::vector<Value>> heap;
+  int64_t next_alloc = 1;
+
+  TierPolicy *tier_policy = nullptr;
+};
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <csetjmp>
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+
+class Function;
+struct VMFunction;
+
+// A JIT that translates the VM's bytecode into x86-64 machine code.
+//
+// Every function is compiled up front into one mmap'd executable buffer and
+// called directly. Slots are SSA values, so a simple allocator suffices: the
+// slots with the most uses, weighted by loop depth, live in callee-saved
+// registers and everything else in the native stack frame. Integer, bool,
+// char and pointer code is supported; functions doing floating-point
+// arithmetic are not, and neither is anything but x86-64 Linux. Check
+// Compiled() and fall back to the VM otherwise.
+//
+// Runtime errors leave the generated code through longjmp and are thrown as
+// std::runtime_error from Run, like in the VM.
+class JIT {
+ public:
+  JIT(const std::vector<Function *> &functions, std::ostream &out);
+  ~JIT();
+
+  // Whether every function could be compiled.
+  bool Compiled() const { return code != nullptr; }
+
+  // Run @main with the given command-line arguments.
+  void Run(const std::vector<std::string> &args);
+
+ private:
+  // The helpers the generated code calls into, and the code generator.
+  struct Runtime;
+  struct CodeGen;
+
+  std::vector<std::unique_ptr<VMFunction>> functions;
+  std::ostream &out;
+
+  uint8_t *code = nullptr;
+  size_t code_size = 0;
+  std::vector<size_t> entries;
+
+  // Read by the generated code.
+  uintptr_t stack_limit = 0;
+  int64_t live_allocs = 0;
+  std::string error;
+  std::jmp_buf on_error;
+};
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <map>
+#include <memory>
+#include <optional>
+#include <ostream>
+#include <set>
+#include <vector>
+
+#include "cfg.h"
+#include "dom.h"
+
+class BasicBlock;
+class Function;
+class ScalarEvolution;
+
+// A natural loop: the header plus every block that reaches a latch without
+// going through the header. Back edges to the same header form one loop.
+struct Loop {
+  BasicBlock *header = nullptr;
+  // Blocks with a back edge to the header.
+  std::vector<BasicBlock *> latches;
+  // In function layout order, header first.
+  std::vector<BasicBlock *> blocks;
+  std::set<BasicBlock *> block_set;
+  // Blocks outside the loop with a predecessor inside, in layout order.
+  std::vector<BasicBlock *> exits;
+  // The only predecessor of the header outside the loop, if it has no
+  // other successor.
+  BasicBlock *preheader = nullptr;
+
+  Loop *parent = nullptr;
+  std::vector<Loop *> children;
+  // 1 for outermost loops.
+  int depth = 1;
+
+  bool Contains(BasicBlock *bb) const { return block_set.contains(bb); }
+  bool Contains(const Loop *loop) const {
+    return Contains(loop->header);
+  }
+};
+
+struct LoopInfo {
+  // Innermost loops come after the loops containing them.
+  std::vector<std::unique_ptr<Loop>> loops;
+  std::vector<Loop *> top_level;
+  // The innermost loop of every block in a loop.
+  std::map<BasicBlock *, Loop *> loop_of;
+  // Blocks on cycles that can be entered other than through a single
+  // dominating header. None of them belong to a natural loop of their own.
+  std::set<BasicBlock *> irreducible;
+
+  Loop *GetLoop(BasicBlock *bb) const;
+  // 0 outside of loops.
+  int Depth(BasicBlock *bb) const;
+  bool IsReducible() const { return irreducible.empty(); }
+
+  void dump(const Function &function, std::ostream &os) const;
+};
+
+LoopInfo ComputeLoopInfo(CFG &cfg, DomInfo &dom);
+
+// Analyses of one function, computed on first use. A pass that changes the
+// CFG calls Invalidate; one that only rewrites instructions needn't.
+class AnalysisCache {
+ public:
+  explicit AnalysisCache(Function &function);
+  ~AnalysisCache();
+
+  CFG &GetCFG();
+  DomInfo &GetDomInfo();
+  LoopInfo &GetLoopInfo();
+  ScalarEvolution &GetScalarEvolution();
+
+  void Invalidate();
+
+ private:
+  Function &function;
+  std::optional<CFG> cfg;
+  std::optional<DomInfo> dom;
+  std::optional<LoopInfo> loops;
+  std::unique_ptr<ScalarEvolution> scev;
+};
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <deque>
+#include <string>
+
+class BasicBlock;
+class Context;
+class Function;
+class Instruction;
+struct CFG;
+struct Loop;
+
+// Helpers for the loop passes to reshape the CFG around a loop. They keep
+// the function in SSA form but leave the analyses stale: invalidate the
+// AnalysisCache after using them.
+
+// A name for a new SSA value or block that `function` doesn't use yet.
+std::string FreshName(const Function &function, const std::string &base);
+
+// Whether `bb` goes on to the next block in the layout: it doesn't end in
+// a jmp, br or ret.
+bool FallsThrough(BasicBlock *bb);
+
+// Where to add instructions to the end of `bb`: before its jump, if any.
+std::deque<Instruction *>::iterator BeforeTerminator(BasicBlock *bb);
+
+// Give `loop` a preheader if it has none: a new block that the header's
+// outside predecessors branch to instead, which falls into the header. Phi
+// arguments from those predecessors move into phis of the preheader.
+// Returns the preheader.
+BasicBlock *EnsurePreheader(Context *ctx, Function &function, const CFG &cfg,
+                            Loop &loop);
@@ -0,0 +1,34 @@
+#pragma once
+
+// Per-phase allocation accounting.
+//
+// When brandy is configured with -DBRANDY_MEM_STATS=ON, the global operator
+// new/delete are replaced by counting versions that attribute every
+// allocation to the innermost MemScope alive on the allocating thread. A table
+// of allocations, bytes allocated, live and peak live bytes per phase, plus
+// the peak RSS of the process, is printed to stderr at exit.
+//
+// Memory is charged to the phase that allocated it, even if it is freed later
+// by someone else, so the "live" column shows what a phase left behind.
+
+#ifdef BRANDY_MEM_STATS
+
+class MemScope {
+  int prev;
+
+ public:
+  explicit MemScope(const char* phase);
+  ~MemScope();
+
+  MemScope(const MemScope&) = delete;
+  MemScope& operator=(const MemScope&) = delete;
+};
+
+#else
+
+class MemScope {
+ public:
+  explicit MemScope(const char*) {}
+};
+
+#endif
@@ -0,0 +1,114 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <optional>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "cfg.h"
+#include "dom.h"
+
+class BasicBlock;
+class Function;
+class Instruction;
+struct Loop;
+struct LoopInfo;
+
+// An int value as a function of the loop iterations it's computed in.
+// Expressions are uniqued, so equal ones are the same pointer.
+struct SCEV {
+  enum Kind {
+    kConstant,
+    // An SSA value we can't see through. It's loop-invariant in every loop
+    // that doesn't contain its definition.
+    kUnknown,
+    kAdd,
+    kMul,
+    kSMax,
+    // {start,+,step}<loop>: start on the first iteration of `loop`, and
+    // step more on every iteration after. The step is invariant in `loop`.
+    kAddRec,
+    kCouldNotCompute,
+  };
+  Kind kind;
+  int64_t value = 0;
+  std::string name;
+  std::vector<const SCEV *> operands;
+  const Loop *loop = nullptr;
+
+  bool IsConstant() const { return kind == kConstant; }
+  const SCEV *GetStart() const { return operands[0]; }
+  const SCEV *GetStep() const { return operands[1]; }
+};
+
+// The test a loop's one exiting branch makes to stay in the loop:
+// `rec <op> bound`, where `rec` is an add recurrence of the loop with a
+// constant step and `bound` is invariant in it. `op` is a Bril comparison
+// or "ne".
+struct LoopExitTest {
+  BasicBlock *exiting = nullptr;
+  std::string op;
+  const SCEV *rec = nullptr;
+  const SCEV *bound = nullptr;
+  // The SSA values compared.
+  std::string rec_var;
+  std::string bound_var;
+};
+
+// Scalar evolution of the int SSA values of a function. Needs SSA form.
+class ScalarEvolution {
+ public:
+  ScalarEvolution(CFG &cfg, DomInfo &dom, LoopInfo &loops);
+
+  const SCEV *Get(const std::string &var);
+
+  // How often the back edges of `loop` are taken before it exits, which is
+  // one less than the number of times its header runs. Computed from the
+  // one branch that can leave the loop, which must compare an add
+  // recurrence of the loop with an invariant bound. Symbolic counts are
+  // only given where they are exact, like `i < n` with a step of 1.
+  const SCEV *GetBackedgeTakenCount(const Loop *loop);
+  std::optional<int64_t> GetConstantTripCount(const Loop *loop);
+  // The exiting branch the counts are computed from. The exiting block runs
+  // on every iteration, before the latch.
+  std::optional<LoopExitTest> GetExitTest(const Loop *loop);
+
+  // The value of an add recurrence of `loop` on iteration `iteration`,
+  // counting from 0.
+  const SCEV *EvaluateAtIteration(const SCEV *rec, const SCEV *iteration);
+  bool IsInvariant(const SCEV *scev, const Loop *loop);
+
+  const SCEV *GetConstant(int64_t value);
+  const SCEV *GetUnknown(const std::string &name);
+  const SCEV *GetAdd(const SCEV *a, const SCEV *b);
+  const SCEV *GetMul(const SCEV *a, const SCEV *b);
+  const SCEV *GetSMax(const SCEV *a, const SCEV *b);
+  const SCEV *GetAddRec(const SCEV *start, const SCEV *step, const Loop *loop);
+  const SCEV *GetCouldNotCompute();
+
+  static std::string ToString(const SCEV *scev);
+  // The trip counts and recurrences of every loop.
+  void dump(std::ostream &os);
+
+ private:
+  const SCEV *unique(SCEV scev);
+  const SCEV *compute(const std::string &var);
+  const SCEV *computeBackedgeTakenCount(const Loop *loop);
+  const SCEV *withoutTerm(const SCEV *sum, const SCEV *term);
+
+  Function &function;
+  CFG &cfg;
+  DomInfo &dom;
+  LoopInfo &loops;
+  std::unordered_map<std::string, Instruction *> defs;
+  std::map<std::string, std::unique_ptr<SCEV>> uniqued;
+  std::unordered_map<std::string, const SCEV *> values;
+  // The order `values` were added in, to forget the ones computed from a
+  // phi that turned out to be a recurrence.
+  std::vector<std::string> computed;
+  std::unordered_map<const Loop *, const SCEV *> backedge_taken;
+};
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A work-stealing pool. Every worker has a queue of its own, runs the task it
+// queued last first, and when it runs out steals the oldest task queued by
+// another. Tasks may submit more tasks, which go to the queue of the worker
+// running them.
+class ThreadPool {
+ public:
+  // Starts `threads` workers. The thread calling Wait works too, so with 0
+  // every task runs there.
+  explicit ThreadPool(int threads);
+  ~ThreadPool();
+
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  void Submit(std::function<void()> task);
+  // Runs tasks until every one submitted, including the ones they submit, is
+  // done. Rethrows the first exception a task threw; the tasks it would have
+  // submitted never run.
+  void Wait();
+
+ private:
+  struct Queue {
+    std::mutex mutex;
+    std::deque<std::function<void()>> tasks;
+  };
+
+  bool take(int self, std::function<void()> &task);
+  // Runs tasks on queue `self` until the pool stops or, when `waiting`, until
+  // nothing is pending.
+  void work(int self, bool waiting);
+
+  // Queue 0 is the one of the thread calling Wait.
+  std::vector<Queue> queues;
+  std::vector<std::thread> threads;
+  // Where tasks submitted from outside the pool go next.
+  std::atomic<uint32_t> next{0};
+
+  std::mutex mutex;
+  std::condition_variable wake;
+  // Tasks in the queues, and tasks submitted that haven't finished.
+  int64_t queued = 0;
+  int64_t pending = 0;
+  std::exception_ptr error;
+  bool stop = false;
+};
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+#include "common.h"
+#include "context.h"
+#include "interp.h"
+
+// Tiered execution for the interpreter. Functions start out as parsed, and
+// once the calls plus loop back-edges of one cross `threshold`, a background
+// thread rebuilds it from `ir` in a Context of its own and puts it through
+// ToSSA and Optimize. The optimized version replaces the original at its next
+// call; a running activation finishes in the version it started in.
+class Tiering : public TierPolicy {
+ public:
+  Tiering(const nl::json &ir, uint64_t threshold);
+  // Waits for the compilation in progress, if any, and drops the rest.
+  ~Tiering() override;
+
+  void OnBackEdge(Function *function, uint64_t count) override;
+  Function *OnCall(Function *function, uint64_t count) override;
+
+  // When each function was requested, compiled and swapped in.
+  void DumpLog(std::ostream &os);
+
+ private:
+  struct State {
+    uint64_t calls = 0;
+    uint64_t back_edges = 0;
+    bool requested = false;
+    bool optimized = false;
+  };
+
+  struct Entry {
+    uint64_t requested_at = 0;
+    double compile_ms = -1;
+    uint64_t swapped_at = 0;
+    bool failed = false;
+  };
+
+  void update(Function *function, State &state);
+  void work();
+
+  const uint64_t threshold;
+  std::map<std::string, const nl::json *> sources;
+  // Only touched on the interpreter's thread.
+  std::unordered_map<Function *, State> states;
+
+  // Everything below is shared with the compiler thread.
+  std::mutex mutex;
+  std::condition_variable wake;
+  std::deque<std::string> queue;
+  std::map<std::string, Function *> ready;
+  std::map<std::string, Entry> log;
+  bool stop = false;
+
+  // Owned by the compiler thread while it runs.
+  Context ctx;
+  std::thread compiler;
+};
@@ -1,15 +1,103 @@
 #pragma once
 
+#include <map>
+#include <string>
+
+#include "cfg.h"
+
+class Context;
 class Function;
 
-void die(Function &func);
+// Mark-and-sweep dead code elimination: instructions with effects are live,
+// and so is everything they use. With `remove_branches`, branches are only
+// live if live code is control dependent on them, and dead ones jump
+// straight to the nearest live post-dominator instead.
+void die(Function &func, bool remove_branches = false);
 
 void cse(Function &func);
 
+// Local value numbering with constant folding and algebraic identities, one
+// block at a time. Doesn't need SSA form.
+void lvn(Function &func);
+
+// Sparse conditional constant propagation. Needs SSA form. Turns values
+// that are constant on every executable path into consts and decided
+// branches into jumps, and drops the blocks that become unreachable.
+void sccp(Function &func);
+
+// Global value numbering over the dominator tree. Needs SSA form.
+void gvn(Function &func);
+
+// Tail recursion elimination. Needs SSA form. Calls of a function to
+// itself whose result it returns right away become jumps back to its entry,
+// where phis take the call's arguments. Results combined with a value by an
+// associative, commutative op on their way out, like `n * fact(n - 1)`, are
+// combined into an accumulator instead, and returns combine it with what
+// they return.
+void tre(Context *ctx, Function &func);
+
+// Loop rotation. Needs SSA form. A loop whose header tests whether to run
+// the body gets a copy of the test in front of it, as a guard, and tests
+// again at the bottom: one branch per iteration instead of a test and a
+// jump back, and a preheader that only runs if the loop does.
+void rotate(Context *ctx, Function &func);
+
+// Loop peeling. Needs SSA form and preheaders. A loop that branches on a
+// flag of its header which stops changing after the first iteration or two
+// gets those iterations copied in front of it, and the flag is folded in
+// what is left. Only small loops are copied, within a budget for the whole
+// function.
+void peel(Context *ctx, Function &func);
+
+// Loop-invariant code motion. Needs SSA form. Gives every loop a preheader
+// and moves into it the instructions whose operands don't change in the
+// loop and that can't trap, plus loads when the loop doesn't write memory.
+void licm(Context *ctx, Function &func);
+
+// Loop strength reduction. Needs SSA form and preheaders. Multiplies and
+// ptradds of induction variables become recurrences that add a step every
+// iteration. Induction variables that move in lockstep are merged, and
+// those only used to compute themselves are removed.
+void lsr(Context *ctx, Function &func);
+
+// Loop unswitching. Needs SSA form and preheaders. A loop that branches on
+// a condition it doesn't change is copied, the branch moves in front of the
+// two versions, and each version always goes the same way. Only small loops
+// are copied, within a budget for the whole function.
+void unswitch(Context *ctx, Function &func);
+
+// Loop unrolling. Needs SSA form and preheaders. Innermost loops with a
+// small constant trip count are replaced by that many copies of their body.
+// Others whose exit test compares an induction variable with an invariant
+// bound run `factor` copies per trip while the test can't fail, fewer if
+// the body is big, and finish in the original loop.
+void unroll(Context *ctx, Function &func, int factor = 4);
+
 void CopyProp(Function &func);
 
-inline void Optimize(Function &func) {
-  die(func);
-  cse(func);
+// Function inlining. Needs SSA form in `caller` and in `callees`, which are
+// final. Calls to them are replaced by a copy of their body when it's
+// small, with more room for calls in loops, up to a size for the caller.
+// Functions that call themselves aren't inlined.
+void Inline(Context *ctx, Function &caller,
+            const std::map<std::string, Function *> &callees);
+
+inline void Optimize(Context *ctx, Function &func, int unroll_factor = 4) {
+  sccp(func);
+  die(func, /*remove_branches=*/true);
+  // Before the loop passes, which also see the loops this makes.
+  tre(ctx, func);
+  rotate(ctx, func);
+  peel(ctx, func);
+  licm(ctx, func);
+  unswitch(ctx, func);
+  lsr(ctx, func);
+  unroll(ctx, func, unroll_factor);
+  // Fully unrolled loops fold to constants.
+  sccp(func);
+  gvn(func);
   CopyProp(func);
+  die(func);
+  // Rotation and unrolling leave chains of jumps behind.
+  MergeBlocks(func);
 }
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+
+class Function;
+struct VMFunction;
+struct VMInstr;
+union Slot;
+
+// A register-based bytecode VM.
+//
+// Every function is lowered once to a flat array of three-address
+// instructions whose operands are numbered frame slots instead of variable
+// names. Blocks become jump targets, and phis are resolved into moves on the
+// incoming edges, so the VM itself never sees them. With GCC and Clang the
+// dispatch loop is direct-threaded through computed gotos, elsewhere it falls
+// back to a switch.
+//
+// Pairs of instructions that commonly execute back to back are fused into
+// superinstructions that run both with a single dispatch. The pairs are listed
+// in include/vm_superinstrs.def, which is refreshed from the dynamic pair
+// profile of representative programs (see DumpPairProfile).
+//
+// Values are untyped 64-bit slots and memory accesses are not bounds-checked:
+// the VM trusts its input the way native code would. Errors that the reference
+// interpreter reports at runtime, like division by zero or leaked memory, are
+// thrown as std::runtime_error.
+class VM {
+ public:
+  // With `profile_pairs`, nothing is fused and every pair of consecutively
+  // executed opcodes is counted instead.
+  VM(const std::vector<Function *> &functions, std::ostream &out,
+     bool profile_pairs = false);
+  ~VM();
+
+  // Run @main with the given command-line arguments.
+  void Run(const std::vector<std::string> &args);
+
+  // Print the hottest opcode pairs as entries for vm_superinstrs.def.
+  void DumpPairProfile(std::ostream &os) const;
+
+ private:
+  template <bool kProfile>
+  Slot execute(VMFunction &function, Slot *frame);
+
+  std::string format(const VMFunction &function, const Slot *frame,
+                     const VMInstr *print);
+
+  std::vector<std::unique_ptr<VMFunction>> functions;
+  std::ostream &out;
+
+  // Frames are carved out of one preallocated stack.
+  std::unique_ptr<Slot[]> stack;
+  Slot *stack_top;
+  Slot *stack_end;
+  uintptr_t native_limit = 0;
+
+  int64_t live_allocs = 0;
+
+  bool profile_pairs;
+  std::vector<uint64_t> pair_counts;
+};
@@ -0,0 +1,314 @@
+#include "bytecode.h"
+
+#include <sys/resource.h>
+
+#include <iterator>
+#include <stdexcept>
+#include <unordered_map>
+
+#include "basic_block.h"
+#include "function.h"
+#include "instruction.h"
+#include "interp.h"
+
+// The pairs that may be fused, in the order of the table.
+static constexpr std::pair<VMOp, VMOp> kSuperinstrs[] = {
+#define SUPERINSTR(first, second) {VMOp::first, VMOp::second},
+#include "vm_superinstrs.def"
+#undef SUPERINSTR
+};
+
+namespace {
+
+Tag tagOf(const nl::json &type) {
+  if (type == "bool") return Tag::Bool;
+  if (type == "float") return Tag::Float;
+  if (type == "char") return Tag::Char;
+  if (type.is_object()) return Tag::Ptr;
+  return Tag::Int;
+}
+
+struct Lowering {
+  const Function &function;
+  const std::map<std::string, int> &function_index;
+  VMFunction &out;
+
+  std::unordered_map<std::string, int> slots;
+  std::unordered_map<std::string, Tag> tags;
+  std::map<std::string, int> block_index;
+  std::vector<int> block_pc;
+
+  // Jump operands to patch once every block has a pc: (pc, field, block).
+  struct Fixup {
+    int pc;
+    int32_t VMInstr::*field;
+    int block;
+  };
+  std::vector<Fixup> fixups;
+
+  Lowering(const Function &function,
+           const std::map<std::string, int> &function_index, VMFunction &out)
+      : function(function), function_index(function_index), out(out) {}
+
+  int slot(const std::string &var) {
+    auto [it, inserted] = slots.emplace(var, out.num_slots);
+    if (inserted) ++out.num_slots;
+    return it->second;
+  }
+
+  int emit(VMInstr instr) {
+    out.code.push_back(instr);
+    return out.code.size() - 1;
+  }
+
+  void jumpTo(int pc, int32_t VMInstr::*field, int block) {
+    fixups.push_back({pc, field, block});
+  }
+
+  // The parallel copy that resolves the phis of `succ` on the edge from
+  // `pred`.
+  std::vector<std::pair<int, int>> edgeMoves(BasicBlock *pred,
+                                             BasicBlock *succ) {
+    std::vector<std::pair<int, int>> moves;
+    for (Instruction *instr : succ->instrs) {
+      if (!instr->hasOp() || instr->getOp() != "phi") continue;
+      std::vector<std::string> labels = instr->GetLabels();
+      std::vector<std::string> args = instr->GetArgs();
+      for (int i = 0; i < labels.size(); ++i) {
+        if (labels[i] != pred->name) continue;
+        // Undefined along this edge, nothing to move.
+        if (args[i] == "__undef") break;
+        int dst = slot(instr->GetDest());
+        int src = slot(args[i]);
+        if (dst != src) moves.emplace_back(dst, src);
+        break;
+      }
+    }
+    return moves;
+  }
+
+  void emitMoves(const std::vector<std::pair<int, int>> &moves) {
+    bool overlap = false;
+    for (const auto &[dst, _] : moves) {
+      for (const auto &[_, src] : moves) overlap |= dst == src;
+    }
+    if (!overlap) {
+      for (const auto &[dst, src] : moves) {
+        emit({.op = VMOp::Mov, .dst = dst, .a = src});
+      }
+      return;
+    }
+    // Go through scratch slots so that no move clobbers another's source.
+    std::vector<int> temps;
+    for (const auto &[_, src] : moves) {
+      int temp = out.num_slots++;
+      emit({.op = VMOp::Mov, .dst = temp, .a = src});
+      temps.push_back(temp);
+    }
+    for (int i = 0; i < moves.size(); ++i) {
+      emit({.op = VMOp::Mov, .dst = moves[i].first, .a = temps[i]});
+    }
+  }
+
+  void lowerInstr(Instruction *instr) {
+    static const std::unordered_map<std::string, VMOp> kBinary = {
+        {"add", VMOp::Add},   {"sub", VMOp::Sub},   {"mul", VMOp::Mul},
+        {"div", VMOp::Div},   {"eq", VMOp::Eq},     {"lt", VMOp::Lt},
+        {"gt", VMOp::Gt},     {"le", VMOp::Le},     {"ge", VMOp::Ge},
+        {"and", VMOp::And},   {"or", VMOp::Or},     {"fadd", VMOp::Fadd},
+        {"fsub", VMOp::Fsub}, {"fmul", VMOp::Fmul}, {"fdiv", VMOp::Fdiv},
+        {"feq", VMOp::Feq},   {"flt", VMOp::Flt},   {"fgt", VMOp::Fgt},
+        {"fle", VMOp::Fle},   {"fge", VMOp::Fge},   {"ceq", VMOp::Eq},
+        {"clt", VMOp::Lt},    {"cgt", VMOp::Gt},    {"cle", VMOp::Le},
+        {"cge", VMOp::Ge},    {"ptradd", VMOp::PtrAdd}};
+    static const std::unordered_map<std::string, VMOp> kUnary = {
+        {"id", VMOp::Mov},       {"not", VMOp::Not},
+        {"char2int", VMOp::Mov}, {"int2char", VMOp::Mov},
+        {"alloc", VMOp::Alloc},  {"load", VMOp::Load}};
+
+    std::string op = instr->getOp();
+    std::vector<std::string> args;
+    if (instr->hasArgs()) args = instr->GetArgs();
+    int dst = instr->hasDest() ? slot(instr->GetDest()) : -1;
+
+    if (op == "const") {
+      VMInstr c = {.op = VMOp::Const, .dst = dst};
+      const nl::json &value = instr->instr["value"];
+      if (tags[instr->GetDest()] == Tag::Float) {
+        c.imm.f = value.get<double>();
+      } else if (value.is_boolean()) {
+        c.imm.i = value.get<bool>();
+      } else if (value.is_string()) {
+        c.imm.i = Value::Parse(value.get<std::string>(), "char").c;
+      } else {
+        c.imm.i = value.get<int64_t>();
+      }
+      emit(c);
+    } else if (auto it = kBinary.find(op); it != kBinary.end()) {
+      emit({.op = it->second, .dst = dst, .a = slot(args[0]),
+            .b = slot(args[1])});
+    } else if (auto it = kUnary.find(op); it != kUnary.end()) {
+      emit({.op = it->second, .dst = dst, .a = slot(args[0])});
+    } else if (op == "free") {
+      emit({.op = VMOp::Free, .a = slot(args[0])});
+    } else if (op == "store") {
+      emit({.op = VMOp::Store, .a = slot(args[0]), .b = slot(args[1])});
+    } else if (op == "nop") {
+      emit({.op = VMOp::Nop});
+    } else if (op == "print") {
+      VMInstr print = {.op = VMOp::Print, .b = static_cast<int>(args.size()),
+                       .c = static_cast<int>(out.pool.size())};
+      for (const std::string &arg : args) {
+        out.pool.push_back(slot(arg));
+        out.pool.push_back(static_cast<int32_t>(tags[arg]));
+      }
+      emit(print);
+    } else if (op == "call") {
+      std::string callee = instr->instr["funcs"][0].get<std::string>();
+      auto it = function_index.find(callee);
+      if (it == function_index.end()) {
+        throw std::runtime_error("unknown function @" + callee);
+      }
+      VMInstr call = {.op = VMOp::Call, .dst = dst, .a = it->second,
+                      .b = static_cast<int>(args.size()),
+                      .c = static_cast<int>(out.pool.size())};
+      for (const std::string &arg : args) out.pool.push_back(slot(arg));
+      emit(call);
+    } else if (op == "ret") {
+      emit({.op = VMOp::Ret, .a = args.empty() ? -1 : slot(args[0])});
+    } else {
+      throw std::runtime_error("the VM doesn't support " + op);
+    }
+  }
+
+  void lower() {
+    out.name = function.name;
+    out.num_params = function.args.size();
+    out.param_types = function.arg_types;
+    for (int i = 0; i < function.args.size(); ++i) {
+      slot(function.args[i]);
+      tags[function.args[i]] = tagOf(function.arg_types[i]);
+    }
+    for (BasicBlock *bb : function.basic_blocks) {
+      for (Instruction *instr : bb->instrs) {
+        if (instr->hasDest() && instr->instr.contains("type")) {
+          tags[instr->GetDest()] = tagOf(instr->instr["type"]);
+        }
+      }
+    }
+
+    const auto &blocks = function.basic_blocks;
+    for (int i = 0; i < blocks.size(); ++i) block_index[blocks[i]->name] = i;
+
+    // Edges of conditional branches that need moves get a stub of their own.
+    struct Stub {
+      int pc;
+      int32_t VMInstr::*field;
+      std::vector<std::pair<int, int>> moves;
+      int block;
+    };
+    std::vector<Stub> stubs;
+
+    for (int i = 0; i < blocks.size(); ++i) {
+      BasicBlock *bb = blocks[i];
+      block_pc.push_back(out.code.size());
+      bool terminated = false;
+      for (Instruction *instr : bb->instrs) {
+        if (!instr->hasOp()) continue;
+        std::string op = instr->getOp();
+        if (op == "phi") continue;
+        if (op == "jmp") {
+          int target = block_index.at(instr->GetLabels()[0]);
+          emitMoves(edgeMoves(bb, blocks[target]));
+          jumpTo(emit({.op = VMOp::Jmp}), &VMInstr::b, target);
+          terminated = true;
+          break;
+        }
+        if (op == "br") {
+          std::vector<std::string> labels = instr->GetLabels();
+          int pc = emit(
+              {.op = VMOp::Br, .a = slot(instr->GetArgs()[0])});
+          int32_t VMInstr::*fields[] = {&VMInstr::b, &VMInstr::c};
+          for (int t = 0; t < 2; ++t) {
+            int target = block_index.at(labels[t]);
+            auto moves = edgeMoves(bb, blocks[target]);
+            if (moves.empty()) {
+              jumpTo(pc, fields[t], target);
+            } else {
+              stubs.push_back({pc, fields[t], std::move(moves), target});
+            }
+          }
+          terminated = true;
+          break;
+        }
+        lowerInstr(instr);
+        if (op == "ret") {
+          terminated = true;
+          break;
+        }
+      }
+      if (terminated) continue;
+      if (i + 1 < blocks.size()) {
+        // Fall through into the next block.
+        emitMoves(edgeMoves(bb, blocks[i + 1]));
+      } else {
+        emit({.op = VMOp::Ret});
+      }
+    }
+
+    for (Stub &stub : stubs) {
+      out.code[stub.pc].*stub.field = out.code.size();
+      emitMoves(stub.moves);
+      jumpTo(emit({.op = VMOp::Jmp}), &VMInstr::b, stub.block);
+    }
+    for (const Fixup &fixup : fixups) {
+      out.code[fixup.pc].*fixup.field = block_pc[fixup.block];
+    }
+    if (out.code.empty()) emit({.op = VMOp::Ret});
+  }
+
+  // Replace adjacent pairs from the superinstruction table by their fused
+  // opcode. The second instruction stays in place as the operands of the
+  // second half, so no pc changes; it just won't be dispatched to anymore.
+  // Pairs can't straddle a jump target since that would skip the first half.
+  void fuse() {
+    std::vector<bool> target(out.code.size() + 1);
+    for (const VMInstr &instr : out.code) {
+      if (instr.op == VMOp::Jmp) target[instr.b] = true;
+      if (instr.op == VMOp::Br) target[instr.b] = target[instr.c] = true;
+    }
+    for (int pc = 0; pc + 1 < out.code.size(); ++pc) {
+      if (target[pc + 1]) continue;
+      VMOp first = out.code[pc].op;
+      VMOp second = out.code[pc + 1].op;
+      for (int i = 0; i < std::size(kSuperinstrs); ++i) {
+        if (kSuperinstrs[i] != std::make_pair(first, second)) continue;
+        out.code[pc].op = static_cast<VMOp>(kNumBaseOps + i);
+        // The second half is never dispatched, so it can't start a pair.
+        ++pc;
+        break;
+      }
+    }
+  }
+};
+
+}  // namespace
+
+void LowerFunction(const Function &function,
+                   const std::map<std::string, int> &function_index,
+                   VMFunction &out, bool fuse) {
+  Lowering lowering(function, function_index, out);
+  lowering.lower();
+  if (fuse) lowering.fuse();
+}
+
+uintptr_t NativeStackLimit(uintptr_t reserve) {
+  uintptr_t size = 8 << 20;
+  rlimit limit;
+  if (getrlimit(RLIMIT_STACK, &limit) == 0 &&
+      limit.rlim_cur != RLIM_INFINITY) {
+    size = limit.rlim_cur;
+  }
+  char here;
+  return reinterpret_cast<uintptr_t>(&here) - size + reserve;
+}
@@ -0,0 +1,69 @@
+#include "call_graph.h"
+
+#include <algorithm>
+#include <string>
+
+#include "basic_block.h"
+#include "function.h"
+#include "instruction.h"
+
+// Tarjan's algorithm: a function roots a component when nothing the search
+// reached from it reaches back above it. A component is complete when its
+// root is done, so the ones it calls are found first.
+static void findSCCs(CallGraph &graph) {
+  std::map<Function *, int> index, low;
+  std::vector<Function *> stack;
+  auto visit = [&](auto &self, Function *function) -> void {
+    int order = index.size();
+    index[function] = low[function] = order;
+    stack.push_back(function);
+    for (Function *callee : graph.callees.at(function)) {
+      if (!index.contains(callee)) {
+        self(self, callee);
+        low[function] = std::min(low[function], low[callee]);
+      } else if (!graph.scc_of.contains(callee)) {
+        // Still on the stack.
+        low[function] = std::min(low[function], index[callee]);
+      }
+    }
+    if (low[function] != index[function]) return;
+    std::vector<Function *> &scc = graph.sccs.emplace_back();
+    Function *member;
+    do {
+      member = stack.back();
+      stack.pop_back();
+      graph.scc_of[member] = graph.sccs.size() - 1;
+      scc.push_back(member);
+    } while (member != function);
+  };
+  for (Function *function : graph.functions) {
+    if (!index.contains(function)) visit(visit, function);
+  }
+}
+
+CallGraph BuildCallGraph(const std::vector<Function *> &functions) {
+  CallGraph graph;
+  graph.functions = functions;
+  std::map<std::string, Function *> by_name;
+  for (Function *function : functions) by_name[function->name] = function;
+
+  for (Function *caller : functions) {
+    std::vector<Function *> &callees = graph.callees[caller];
+    for (BasicBlock *bb : caller->basic_blocks) {
+      for (Instruction *instr : bb->instrs) {
+        if (!instr->hasOp() || instr->getOp() != "call") continue;
+        auto it = by_name.find(instr->instr["funcs"][0].get<std::string>());
+        if (it == by_name.end()) continue;
+        Function *callee = it->second;
+        if (std::find(callees.begin(), callees.end(), callee) !=
+            callees.end()) {
+          continue;
+        }
+        callees.push_back(callee);
+        graph.callers[callee].push_back(caller);
+      }
+    }
+  }
+  findSCCs(graph);
+  return graph;
+}
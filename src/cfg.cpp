@@ -1,20 +1,27 @@
 #include "cfg.h"
 
+#include <algorithm>
 #include <fstream>
 #include <iostream>
+#include <set>
+#include <vector>
 
 #include "basic_block.h"
 #include "function.h"
+#include "instruction.h"
+#include "mem_stats.h"
 
 CFG BuildCFG(const Function &function) {
+  MemScope scope("BuildCFG");
   CFG cfg = {.function = const_cast<Function *>(&function)};
 
   for (auto it = cfg.function->basic_blocks.begin(),
             end = cfg.function->basic_blocks.end();
        it != end; ++it) {
     BasicBlock *bb = *it;
-    Instruction *instr = (*it)->instrs.back();
-    std::string op = instr->getOp();
+    // Empty blocks, like a label right before another one, fall through.
+    Instruction *instr = bb->instrs.empty() ? nullptr : bb->instrs.back();
+    std::string op = instr ? instr->getOp() : "";
 
     if (op == "br" || op == "jmp") {
       for (const std::string &dst : instr->GetLabels()) {
@@ -35,6 +42,48 @@ CFG BuildCFG(const Function &function) {
   return cfg;
 }
 
+void RemoveUnreachableBlocks(Function &function) {
+  if (function.basic_blocks.empty()) return;
+  CFG cfg = BuildCFG(function);
+  std::set<BasicBlock *> reachable = {function.basic_blocks.front()};
+  std::vector<BasicBlock *> worklist = {function.basic_blocks.front()};
+  while (!worklist.empty()) {
+    BasicBlock *bb = worklist.back();
+    worklist.pop_back();
+    for (BasicBlock *succ : cfg.successors[bb]) {
+      if (reachable.insert(succ).second) worklist.push_back(succ);
+    }
+  }
+
+  // A reachable block never falls through into an unreachable one, so the
+  // layout of the rest stays valid.
+  std::erase_if(function.basic_blocks, [&](BasicBlock *bb) {
+    if (reachable.contains(bb)) return false;
+    function.block_map.erase(bb->name);
+    return true;
+  });
+  function.all_instrs.clear();
+
+  for (BasicBlock *bb : function.basic_blocks) {
+    std::set<std::string> preds;
+    for (BasicBlock *pred : cfg.predecessors[bb]) {
+      if (reachable.contains(pred)) preds.insert(pred->name);
+    }
+    for (Instruction *instr : bb->instrs) {
+      if (!instr->hasOp() || instr->getOp() != "phi") continue;
+      nl::json args = nl::json::array(), labels = nl::json::array();
+      for (int i = 0; i < instr->instr["args"].size(); ++i) {
+        const nl::json &label = instr->instr["labels"][i];
+        if (!preds.contains(label.get<std::string>())) continue;
+        args.push_back(instr->instr["args"][i]);
+        labels.push_back(label);
+      }
+      instr->instr["args"] = std::move(args);
+      instr->instr["labels"] = std::move(labels);
+    }
+  }
+}
+
 void CFG::dump() const {
   if (!successors.empty()) {
     std::cout << "Successors:\n";
@@ -84,3 +133,65 @@ void CFG::dumpDot(const std::string &filepath) const {
   f << "}";
   f.close();
 }
+
+void MergeBlocks(Function &function) {
+  if (function.basic_blocks.empty()) return;
+  CFG cfg = BuildCFG(function);
+  std::set<BasicBlock *> merged;
+  for (auto it = function.basic_blocks.begin();
+       it != function.basic_blocks.end(); ++it) {
+    BasicBlock *bb = *it;
+    if (merged.contains(bb)) continue;
+    while (!bb->instrs.empty() && bb->instrs.back()->getOp() == "jmp") {
+      Instruction *jmp = bb->instrs.back();
+      BasicBlock *next = function.GetBasicBlock(jmp->GetLabels()[0]);
+      if (next == bb || next == function.basic_blocks.front() ||
+          cfg.predecessors[next].size() != 1) {
+        break;
+      }
+      // What `next` falls through to it has to jump to instead, with the
+      // jump `bb` doesn't need any more, and falling off the end of the
+      // function returns.
+      std::string op = next->instrs.empty() ? "" : next->instrs.back()->getOp();
+      bool falls_through = op != "jmp" && op != "br" && op != "ret";
+      bb->instrs.pop_back();
+      for (Instruction *instr : next->instrs) {
+        instr->parent = bb;
+        // With one predecessor, a phi is a copy.
+        if (instr->getOp() == "phi") {
+          instr->instr["op"] = "id";
+          instr->instr.erase("labels");
+        }
+        bb->instrs.push_back(instr);
+      }
+      if (falls_through && cfg.successors[next].empty()) {
+        jmp->instr = {{"op", "ret"}};
+        bb->instrs.push_back(jmp);
+      } else if (falls_through) {
+        jmp->instr["labels"] =
+            nl::json::array({cfg.successors[next][0]->name});
+        bb->instrs.push_back(jmp);
+      }
+
+      for (BasicBlock *succ : cfg.successors[next]) {
+        std::replace(cfg.predecessors[succ].begin(),
+                     cfg.predecessors[succ].end(), next, bb);
+        for (Instruction *instr : succ->instrs) {
+          if (instr->getOp() != "phi") continue;
+          for (nl::json &label : instr->instr["labels"]) {
+            if (label == next->name) label = bb->name;
+          }
+        }
+      }
+      cfg.successors[bb] = cfg.successors[next];
+      merged.insert(next);
+      next->instrs.clear();
+    }
+  }
+  std::erase_if(function.basic_blocks, [&](BasicBlock *bb) {
+    if (!merged.contains(bb)) return false;
+    function.block_map.erase(bb->name);
+    return true;
+  });
+  function.all_instrs.clear();
+}
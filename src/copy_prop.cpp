@@ -1,41 +1,99 @@
-#include <algorithm>
-#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
 #include "basic_block.h"
 #include "function.h"
 #include "instruction.h"
+#include "mem_stats.h"
 #include "transform.h"
 
-// TODO: Make it work across basic blocks.
-void CopyProp(Function& func) {
-  for (BasicBlock* bb : func.basic_blocks) {
-    std::vector<std::vector<std::string>> copies;
-    for (Instruction* instr : bb->instrs) {
+namespace {
+
+// Union-find over SSA names. The root of a set is the one name that is not
+// a copy: the original value every other name in the set copies.
+struct Copies {
+  std::unordered_map<std::string, std::string> parent;
+
+  std::string find(const std::string &var) {
+    std::string root = var;
+    for (auto it = parent.find(root); it != parent.end();
+         it = parent.find(root)) {
+      root = it->second;
+    }
+    // Point everything on the way straight at the root.
+    std::string node = var;
+    for (auto it = parent.find(node); it != parent.end();
+         it = parent.find(node)) {
+      node = std::exchange(it->second, root);
+    }
+    return root;
+  }
+
+  // `copy` is a copy of `value`. Returns false if they already were.
+  bool unite(const std::string &copy, const std::string &value) {
+    std::string from = find(copy), to = find(value);
+    if (from == to) return false;
+    parent[from] = to;
+    return true;
+  }
+};
+
+}  // namespace
+
+void CopyProp(Function &func) {
+  MemScope scope("CopyProp");
+  Copies copies;
+  std::vector<Instruction *> phis;
+  for (BasicBlock *bb : func.basic_blocks) {
+    for (Instruction *instr : bb->instrs) {
       if (!instr->hasOp() || !instr->hasDest()) continue;
-      if (instr->getOp() != "id") continue;
+      std::string op = instr->getOp();
+      if (op == "id") {
+        copies.unite(instr->GetDest(), instr->GetArgs()[0]);
+      } else if (op == "phi") {
+        phis.push_back(instr);
+      }
+    }
+  }
 
-      // Only handle id operation (x: int = id y;)
-      std::string arg = instr->GetArgs()[0];
-      std::string dest = instr->GetDest();
-      bool exist = false;
-      for (std::vector<std::string>& copy : copies) {
-        if (std::find(copy.begin(), copy.end(), arg) != copy.end()) {
-          copy.push_back(dest);
-          exist = true;
-          break;
-        }
+  // A phi that only merges one value, besides itself, is a copy of it.
+  // Resolving one can make others trivial, so repeat until nothing changes.
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (Instruction *phi : phis) {
+      std::string dest = copies.find(phi->GetDest());
+      std::string value;
+      bool trivial = true;
+      for (const std::string &arg : phi->GetArgs()) {
+        std::string root = arg == "__undef" ? arg : copies.find(arg);
+        if (root == dest || root == value) continue;
+        trivial &= value.empty() && root != "__undef";
+        value = root;
       }
-      if (!exist) copies.emplace_back(std::vector<std::string>{arg, dest});
+      if (trivial && !value.empty()) changed |= copies.unite(dest, value);
     }
+  }
 
-    for (std::vector<std::string>& copy : copies) {
-      if (copy.size() == 1) continue;
-      auto beg = copy.begin();
-      for (auto it = std::next(beg); it != copy.end(); ++it) {
-        Instruction* instr = func.GetInstrByName(*it);
-        instr->instr["args"] = {*beg};
+  // Rewrite every use to the original value in one sweep, then drop the
+  // copies, which nothing uses anymore.
+  for (BasicBlock *bb : func.basic_blocks) {
+    for (Instruction *instr : bb->instrs) {
+      if (!instr->hasArgs()) continue;
+      for (nl::json &arg : instr->instr["args"]) {
+        const std::string &name = arg.get_ref<const std::string &>();
+        if (name != "__undef") arg = copies.find(name);
       }
     }
+    std::erase_if(bb->instrs, [&](Instruction *instr) {
+      if (!instr->hasOp() || !instr->hasDest()) return false;
+      std::string op = instr->getOp();
+      if (op != "id" && op != "phi") return false;
+      std::string dest = instr->GetDest();
+      return copies.find(dest) != dest;
+    });
   }
+  func.all_instrs.clear();
 }
@@ -8,6 +8,7 @@
 #include "dom.h"
 #include "function.h"
 #include "instruction.h"
+#include "mem_stats.h"
 #include "transform.h"
 
 struct Identity {
@@ -42,6 +43,7 @@ struct std::hash<Identity> {
 };
 
 void cse(Function &func) {
+  MemScope scope("cse");
   CFG cfg = BuildCFG(func);
   DomInfo dom = ComputeDomInfo(cfg);
 
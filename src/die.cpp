@@ -1,31 +1,182 @@
-#include <set>
+#include <memory>
 #include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
 #include "basic_block.h"
+#include "cfg.h"
+#include "dom.h"
 #include "function.h"
 #include "instruction.h"
+#include "mem_stats.h"
 #include "transform.h"
 
-void die(Function &func) {
-  std::set<std::string> uses;
+// Ops that are live no matter what: they have effects or may trap in ways
+// the program can observe.
+static bool isCritical(const std::string &op) {
+  return op == "print" || op == "store" || op == "free" || op == "call" ||
+         op == "ret" || op == "alloc" || op == "load";
+}
+
+static bool isBranch(Instruction *instr) {
+  if (!instr->hasOp()) return false;
+  std::string op = instr->getOp();
+  return op == "br" || op == "jmp";
+}
+
+namespace {
+
+// Control dependences from post-dominance on the reversed CFG, where a
+// virtual exit node succeeds every block without successors.
+struct PostDom {
+  BasicBlock exit;
+  Function reversed;
+  DomInfo info;
+
+  // False if some block can't reach the exit, like an infinite loop.
+  // Post-dominance isn't meaningful for those.
+  bool valid = true;
+
+  explicit PostDom(const CFG &cfg) {
+    reversed.basic_blocks.push_back(&exit);
+    CFG rcfg = {.function = &reversed};
+    for (BasicBlock *bb : cfg.function->basic_blocks) {
+      reversed.basic_blocks.push_back(bb);
+      auto succs = cfg.successors.find(bb);
+      if (succs == cfg.successors.end() || succs->second.empty()) {
+        rcfg.successors[&exit].push_back(bb);
+        rcfg.predecessors[bb].push_back(&exit);
+        continue;
+      }
+      for (BasicBlock *succ : succs->second) {
+        rcfg.successors[succ].push_back(bb);
+        rcfg.predecessors[bb].push_back(succ);
+      }
+    }
 
-  // Collect uses.
-  for (BasicBlock *bb : func.basic_blocks) {
-    for (Instruction *instr : bb->instrs) {
-      if (!instr->hasArgs()) continue;
-      for (const std::string &arg : instr->GetArgs()) {
-        uses.insert(std::move(arg));
+    std::unordered_set<BasicBlock *> seen = {&exit};
+    std::vector<BasicBlock *> worklist = {&exit};
+    while (!worklist.empty()) {
+      BasicBlock *bb = worklist.back();
+      worklist.pop_back();
+      for (BasicBlock *succ : rcfg.successors[bb]) {
+        if (seen.insert(succ).second) worklist.push_back(succ);
       }
     }
+    valid = seen.size() == reversed.basic_blocks.size();
+    if (valid) info = ComputeDomInfo(rcfg);
+  }
+
+  // The nearest post-dominator of `bb` that passes `pred`, if any.
+  template <typename Pred>
+  BasicBlock *find(BasicBlock *bb, Pred pred) {
+    while (true) {
+      auto it = info.idom.find(bb);
+      if (it == info.idom.end() || it->second == &exit) return nullptr;
+      bb = it->second;
+      if (pred(bb)) return bb;
+    }
   }
+};
+
+struct DIE {
+  Function &func;
+  CFG cfg;
+  bool remove_branches;
 
-  for (BasicBlock *bb : func.basic_blocks) {
-    for (auto it = bb->instrs.begin(); it != bb->instrs.end(); it++) {
-      if (!(*it)->hasDest()) continue;
-      //  No use for this def.
-      if (!uses.contains((*it)->GetDest()) /*or no side effect*/) {
-        bb->instrs.erase(it);
+  std::unordered_map<std::string, std::vector<Instruction *>> defs;
+  std::unordered_set<Instruction *> live;
+  std::unordered_set<BasicBlock *> live_blocks;
+  std::vector<Instruction *> worklist;
+  std::unique_ptr<PostDom> pdom;
+
+  DIE(Function &func, bool remove_branches)
+      : func(func), cfg(BuildCFG(func)), remove_branches(remove_branches) {
+    if (remove_branches) {
+      pdom = std::make_unique<PostDom>(cfg);
+      this->remove_branches = pdom->valid;
+    }
+  }
+
+  void mark(Instruction *instr) {
+    if (live.insert(instr).second) worklist.push_back(instr);
+  }
+
+  // A block with live code depends on the branches that decide whether it
+  // runs.
+  void markBlock(BasicBlock *bb) {
+    if (!live_blocks.insert(bb).second || !remove_branches) return;
+    auto it = pdom->info.df.find(bb);
+    if (it == pdom->info.df.end()) return;
+    for (BasicBlock *branch : it->second) {
+      if (branch == &pdom->exit || branch->instrs.empty()) continue;
+      if (isBranch(branch->instrs.back())) mark(branch->instrs.back());
+    }
+  }
+
+  void run() {
+    for (BasicBlock *bb : func.basic_blocks) {
+      for (Instruction *instr : bb->instrs) {
+        if (!instr->hasOp()) continue;
+        if (instr->hasDest()) defs[instr->GetDest()].push_back(instr);
+        std::string op = instr->getOp();
+        if (isCritical(op) || (!remove_branches && op == "br")) mark(instr);
       }
     }
+
+    // Every def of a used name is live, so this works without SSA too.
+    while (!worklist.empty()) {
+      Instruction *instr = worklist.back();
+      worklist.pop_back();
+      markBlock(instr->parent);
+      if (instr->hasArgs()) {
+        for (const std::string &arg : instr->GetArgs()) {
+          auto it = defs.find(arg);
+          if (it == defs.end()) continue;
+          for (Instruction *def : it->second) mark(def);
+        }
+      }
+      // Which value a phi takes depends on the edge it came in on.
+      if (instr->getOp() == "phi") {
+        for (const std::string &label : instr->GetLabels()) {
+          BasicBlock *pred = func.GetBasicBlock(label);
+          if (!pred) continue;
+          markBlock(pred);
+          if (!pred->instrs.empty() && isBranch(pred->instrs.back())) {
+            mark(pred->instrs.back());
+          }
+        }
+      }
+    }
+
+    bool branches_removed = false;
+    for (BasicBlock *bb : func.basic_blocks) {
+      std::erase_if(bb->instrs, [&](Instruction *instr) {
+        if (!instr->hasOp() || live.count(instr)) return false;
+        std::string op = instr->getOp();
+        if (op == "jmp") return false;
+        if (op != "br") return true;
+        // Nothing live runs until the nearest live post-dominator, so go
+        // there directly. If there is none, nothing live runs at all.
+        BasicBlock *target = pdom->find(bb, [&](BasicBlock *candidate) {
+          return live_blocks.count(candidate);
+        });
+        instr->instr["op"] = "jmp";
+        instr->instr["labels"] = {target ? target->name
+                                         : instr->GetLabels()[0]};
+        instr->instr.erase("args");
+        branches_removed = true;
+        return false;
+      });
+    }
+    if (branches_removed) RemoveUnreachableBlocks(func);
   }
+};
+
+}  // namespace
+
+void die(Function &func, bool remove_branches) {
+  MemScope scope("die");
+  DIE(func, remove_branches).run();
 }
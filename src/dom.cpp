@@ -9,6 +9,7 @@
 #include "basic_block.h"
 #include "cfg.h"
 #include "function.h"
+#include "mem_stats.h"
 
 static void build(CFG &cfg, std::vector<BasicBlock *> &postorder,
                   std::set<BasicBlock *> &visited, BasicBlock *root) {
@@ -37,9 +38,10 @@ static std::vector<BasicBlock *> buildCFGVisitNode(CFG &cfg) {
 static void computeDominators(DomInfo &dom_info, CFG &cfg) {
   std::vector<BasicBlock *> postorder = buildCFGVisitNode(cfg);
 
+  // The entry is only dominated by itself, even if it starts a loop.
+  BasicBlock *root = cfg.function->basic_blocks[0];
   for (BasicBlock *bb : cfg.function->basic_blocks) {
-    if (bb->isEntry()) continue;
-    dom_info.dom[bb] = postorder;
+    dom_info.dom[bb] = bb == root ? std::vector<BasicBlock *>{root} : postorder;
   }
 
   auto intersect = [](std::vector<BasicBlock *> new_dom,
@@ -56,6 +58,7 @@ static void computeDominators(DomInfo &dom_info, CFG &cfg) {
   while (true) {
     bool changed = false;
     for (BasicBlock *node : postorder) {
+      if (node == root) continue;
       std::vector<BasicBlock *> new_dom;
 
       // intersect preds' dom.
@@ -189,6 +192,7 @@ static void computeDomTree(DomInfo &dom_info, CFG &cfg) {
 }
 
 DomInfo ComputeDomInfo(CFG &cfg) {
+  MemScope scope("ComputeDomInfo");
   DomInfo dom_info;
   computeDominators(dom_info, cfg);
   computeIntermidiateDominators(dom_info, cfg);
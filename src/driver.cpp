@@ -0,0 +1,161 @@
+#include "driver.h"
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "basic_block.h"
+#include "call_graph.h"
+#include "cfg.h"
+#include "context.h"
+#include "dom.h"
+#include "emit_c.h"
+#include "function.h"
+#include "instruction.h"
+#include "interp.h"
+#include "jit.h"
+#include "loop.h"
+#include "mem_stats.h"
+#include "scev.h"
+#include "ssa.h"
+#include "thread_pool.h"
+#include "tiered.h"
+#include "transform.h"
+#include "vm.h"
+
+// `optimized` are the functions done so far that `function` calls, which may
+// be inlined.
+static void optimize(Context *ctx, Function *function,
+                     const std::map<std::string, Function *> &optimized,
+                     const DriverOptions &options) {
+  if (options.opt_level == 1) {
+    lvn(*function);
+    die(*function);
+    return;
+  }
+  CFG cfg = BuildCFG(*function);
+  DomInfo dom = ComputeDomInfo(cfg);
+  ToSSA(ctx, *function, cfg, dom);
+  Inline(ctx, *function, optimized);
+  Optimize(ctx, *function, options.unroll_factor);
+}
+
+// Optimizes the functions of every component of `graph` after the components
+// they call, so that Inline sees the final bodies of callees. Components that
+// don't call each other are optimized in parallel, each allocating in a
+// Context of its own added to `contexts`.
+static void optimizeAll(const CallGraph &graph,
+                        std::vector<std::unique_ptr<Context>> &contexts,
+                        const DriverOptions &options) {
+  int n = graph.sccs.size();
+  // How many components each one still waits for, and which wait for it.
+  std::vector<std::atomic<int>> waiting(n);
+  std::vector<std::set<int>> users(n);
+  std::vector<int> ready;
+  for (int i = 0; i < n; ++i) {
+    std::set<int> deps;
+    for (Function *function : graph.sccs[i]) {
+      for (Function *callee : graph.callees.at(function)) {
+        int j = graph.scc_of.at(callee);
+        if (j != i) deps.insert(j);
+      }
+    }
+    waiting[i] = deps.size();
+    for (int j : deps) users[j].insert(i);
+    if (deps.empty()) ready.push_back(i);
+    contexts.push_back(std::make_unique<Context>());
+  }
+
+  int jobs = options.jobs > 0 ? options.jobs
+                              : std::thread::hardware_concurrency();
+  ThreadPool pool(std::clamp(jobs, 1, std::max(n, 1)) - 1);
+  std::function<void(int)> run = [&](int i) {
+    // Functions of the component are done one after the other, and those
+    // done may be inlined into the rest.
+    std::set<Function *> done;
+    for (Function *function : graph.sccs[i]) {
+      std::map<std::string, Function *> optimized;
+      for (Function *callee : graph.callees.at(function)) {
+        if (graph.scc_of.at(callee) != i || done.contains(callee)) {
+          optimized[callee->name] = callee;
+        }
+      }
+      optimize(contexts[i].get(), function, optimized, options);
+      done.insert(function);
+    }
+    for (int user : users[i]) {
+      if (--waiting[user] == 0) pool.Submit([&run, user] { run(user); });
+    }
+  };
+  for (int i : ready) pool.Submit([&run, i] { run(i); });
+  pool.Wait();
+}
+
+int CompileProgram(const nl::json &ir, std::ostream &out,
+                   const DriverOptions &options) {
+  Context ctx;
+  std::vector<Function *> functions;
+
+  for (const nl::json &input : ir["functions"]) {
+    functions.push_back(Function::Create(&ctx, input));
+  }
+  // Tiered execution optimizes on demand.
+  std::vector<std::unique_ptr<Context>> contexts;
+  if (options.opt_level > 0 &&
+      options.action != DriverOptions::Action::RunTiered) {
+    optimizeAll(BuildCallGraph(functions), contexts, options);
+  }
+
+  for (Function *function : functions) {
+    if (options.action == DriverOptions::Action::PrintLoops) {
+      AnalysisCache analyses(*function);
+      analyses.GetLoopInfo().dump(*function, out);
+    } else if (options.action == DriverOptions::Action::PrintScev) {
+      AnalysisCache analyses(*function);
+      analyses.GetScalarEvolution().dump(out);
+    } else if (options.action == DriverOptions::Action::EmitJson) {
+      MemScope scope("ToJson");
+      nl::json prog;
+      prog["functions"].push_back(function->ToJson());
+      out << prog << "\n";
+    }
+  }
+
+  if (options.action == DriverOptions::Action::Interpret) {
+    Interpreter interp(functions, out);
+    interp.Run(options.args);
+    if (options.profile) interp.DumpProfile(std::cerr);
+  } else if (options.action == DriverOptions::Action::RunVM) {
+    VM vm(functions, out, options.profile);
+    vm.Run(options.args);
+    if (options.profile) vm.DumpPairProfile(std::cerr);
+  } else if (options.action == DriverOptions::Action::RunJIT) {
+    JIT jit(functions, out);
+    if (jit.Compiled()) {
+      jit.Run(options.args);
+    } else {
+      VM vm(functions, out);
+      vm.Run(options.args);
+    }
+  } else if (options.action == DriverOptions::Action::RunTiered) {
+    // Declared first so that optimized functions outlive the interpreter.
+    Tiering tiering(ir, options.tier_threshold);
+    Interpreter interp(functions, out);
+    interp.SetTierPolicy(&tiering);
+    interp.Run(options.args);
+    if (options.profile) {
+      interp.DumpProfile(std::cerr);
+      tiering.DumpLog(std::cerr);
+    }
+  } else if (options.action == DriverOptions::Action::EmitC) {
+    EmitC(functions, out);
+  }
+  return functions.size();
+}
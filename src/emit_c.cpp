@@ -0,0 +1,451 @@
+#include "emit_c.h"
+
+#include <cctype>
+#include <cinttypes>
+#include <cstdio>
+#include <map>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+
+#include "basic_block.h"
+#include "function.h"
+#include "instruction.h"
+#include "interp.h"
+
+// Helpers every generated program starts with, inline so that unused ones
+// don't warn. Printing follows brili, and errors exit the way brandy's own
+// runtime errors do.
+static const char *kRuntime = R"(#include <inttypes.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int64_t brandy_live_allocs;
+
+static inline void brandy_error(const char *message) {
+  fflush(stdout);
+  fprintf(stderr, "error: %s\n", message);
+  exit(2);
+}
+
+static inline int64_t brandy_div(int64_t a, int64_t b) {
+  if (b == 0) brandy_error("division by zero");
+  return b == -1 ? (int64_t)(0 - (uint64_t)a) : a / b;
+}
+
+static inline void *brandy_alloc(int64_t n, size_t size) {
+  if (n <= 0) {
+    char message[64];
+    snprintf(message, sizeof(message), "cannot allocate %" PRId64 " entries",
+             n);
+    brandy_error(message);
+  }
+  ++brandy_live_allocs;
+  return calloc((size_t)n, size);
+}
+
+static inline void brandy_free(void *p) {
+  --brandy_live_allocs;
+  free(p);
+}
+
+static inline void brandy_print_int(int64_t v) { printf("%" PRId64, v); }
+
+static inline void brandy_print_bool(bool v) {
+  fputs(v ? "true" : "false", stdout);
+}
+
+static inline void brandy_print_float(double v) {
+  if (isnan(v)) {
+    fputs("NaN", stdout);
+  } else if (isinf(v)) {
+    fputs(v > 0 ? "Infinity" : "-Infinity", stdout);
+  } else {
+    printf("%.17f", v);
+  }
+}
+
+static inline void brandy_print_char(uint32_t c) {
+  char buf[5] = {0};
+  if (c < 0x80) {
+    buf[0] = (char)c;
+  } else if (c < 0x800) {
+    buf[0] = (char)(0xc0 | c >> 6);
+    buf[1] = (char)(0x80 | (c & 0x3f));
+  } else if (c < 0x10000) {
+    buf[0] = (char)(0xe0 | c >> 12);
+    buf[1] = (char)(0x80 | (c >> 6 & 0x3f));
+    buf[2] = (char)(0x80 | (c & 0x3f));
+  } else {
+    buf[0] = (char)(0xf0 | c >> 18);
+    buf[1] = (char)(0x80 | (c >> 12 & 0x3f));
+    buf[2] = (char)(0x80 | (c >> 6 & 0x3f));
+    buf[3] = (char)(0x80 | (c & 0x3f));
+  }
+  fputs(buf, stdout);
+}
+
+static inline void brandy_print_ptr(const void *p) { printf("%p", p); }
+
+static inline int64_t brandy_parse_int(const char *text) {
+  return strtoll(text, NULL, 10);
+}
+
+static inline bool brandy_parse_bool(const char *text) {
+  if (strcmp(text, "true") && strcmp(text, "false")) {
+    brandy_error("invalid bool argument");
+  }
+  return !strcmp(text, "true");
+}
+
+static inline double brandy_parse_float(const char *text) {
+  return strtod(text, NULL);
+}
+
+static inline uint32_t brandy_parse_char(const char *text) {
+  const unsigned char *s = (const unsigned char *)text;
+  if (s[0] < 0x80) return s[0];
+  if (s[0] < 0xe0) return (s[0] & 0x1f) << 6 | (s[1] & 0x3f);
+  if (s[0] < 0xf0) {
+    return (s[0] & 0x0f) << 12 | (s[1] & 0x3f) << 6 | (s[2] & 0x3f);
+  }
+  return (s[0] & 0x07) << 18 | (s[1] & 0x3f) << 12 | (s[2] & 0x3f) << 6 |
+         (s[3] & 0x3f);
+}
+)";
+
+// Bril names may contain characters C identifiers can't, and mapping them
+// must not make two names collide: letters and digits are kept, '_' is
+// doubled and everything else becomes '_' plus two hex digits.
+static std::string mangle(const std::string &prefix, const std::string &name) {
+  std::string out = prefix;
+  for (unsigned char c : name) {
+    if (std::isalnum(c)) {
+      out += c;
+    } else if (c == '_') {
+      out += "__";
+    } else {
+      char buf[4];
+      std::snprintf(buf, sizeof(buf), "_%02x", c);
+      out += buf;
+    }
+  }
+  return out;
+}
+
+static std::string var(const std::string &name) { return mangle("v_", name); }
+
+static std::string shadow(const std::string &name) {
+  return mangle("p_", name);
+}
+
+static std::string label(const std::string &name) {
+  return mangle("l_", name);
+}
+
+static std::string func(const std::string &name) {
+  return mangle("f_", name);
+}
+
+static std::string cType(const nl::json &type) {
+  if (type.is_null()) return "void";
+  if (type.is_object()) return cType(type["ptr"]) + " *";
+  if (type == "bool") return "bool";
+  if (type == "float") return "double";
+  if (type == "char") return "uint32_t";
+  return "int64_t";
+}
+
+// The suffix of the runtime's print and parse helpers for a type.
+static std::string kindOf(const nl::json &type) {
+  if (type.is_object()) return "ptr";
+  if (type == "bool" || type == "float" || type == "char") {
+    return type.get<std::string>();
+  }
+  return "int";
+}
+
+namespace {
+
+struct FunctionEmitter {
+  const Function &function;
+  std::ostream &out;
+  std::map<std::string, nl::json> types;
+
+  FunctionEmitter(const Function &function, std::ostream &out)
+      : function(function), out(out) {}
+
+  std::string signature() {
+    std::string sig = cType(function.type) + " " + func(function.name) + "(";
+    for (int i = 0; i < function.args.size(); ++i) {
+      if (i) sig += ", ";
+      sig += cType(function.arg_types[i]) + " " + var(function.args[i]);
+    }
+    if (function.args.empty()) sig += "void";
+    return sig + ")";
+  }
+
+  std::string constant(Instruction *instr) {
+    const nl::json &value = instr->instr["value"];
+    const nl::json &type = types[instr->GetDest()];
+    if (type == "bool" || value.is_boolean()) {
+      return value.get<bool>() ? "true" : "false";
+    }
+    if (type == "float") {
+      // Hex floats round-trip exactly.
+      char buf[64];
+      std::snprintf(buf, sizeof(buf), "%a", value.get<double>());
+      return buf;
+    }
+    if (type == "char") {
+      uint32_t c = Value::Parse(value.get<std::string>(), "char").c;
+      return "UINT32_C(" + std::to_string(c) + ")";
+    }
+    int64_t v = value.get<int64_t>();
+    if (v == INT64_MIN) return "INT64_MIN";
+    return "INT64_C(" + std::to_string(v) + ")";
+  }
+
+  // The assignments to phi shadows on the edge from `pred` to `succ`.
+  void edgeCopies(BasicBlock *pred, BasicBlock *succ,
+                  const std::string &indent) {
+    for (Instruction *instr : succ->instrs) {
+      if (!instr->hasOp() || instr->getOp() != "phi") continue;
+      std::vector<std::string> labels = instr->GetLabels();
+      std::vector<std::string> args = instr->GetArgs();
+      for (int i = 0; i < labels.size(); ++i) {
+        if (labels[i] != pred->name) continue;
+        // Undefined along this edge, the shadow keeps whatever it holds.
+        if (args[i] != "__undef") {
+          out << indent << shadow(instr->GetDest()) << " = " << var(args[i])
+              << ";\n";
+        }
+        break;
+      }
+    }
+  }
+
+  void branch(BasicBlock *pred, BasicBlock *succ, const std::string &indent) {
+    edgeCopies(pred, succ, indent);
+    out << indent << "goto " << label(succ->name) << ";\n";
+  }
+
+  std::string expr(const std::string &op,
+                   const std::vector<std::string> &args) {
+    static const std::unordered_map<std::string, std::string> kWrapping = {
+        {"add", "+"}, {"sub", "-"}, {"mul", "*"}};
+    static const std::unordered_map<std::string, std::string> kInfix = {
+        {"eq", "=="},   {"lt", "<"},    {"gt", ">"},   {"le", "<="},
+        {"ge", ">="},   {"and", "&&"},  {"or", "||"},  {"fadd", "+"},
+        {"fsub", "-"},  {"fmul", "*"},  {"fdiv", "/"}, {"feq", "=="},
+        {"flt", "<"},   {"fgt", ">"},   {"fle", "<="}, {"fge", ">="},
+        {"ceq", "=="},  {"clt", "<"},   {"cgt", ">"},  {"cle", "<="},
+        {"cge", ">="},  {"ptradd", "+"}};
+
+    if (auto it = kWrapping.find(op); it != kWrapping.end()) {
+      return "(int64_t)((uint64_t)" + var(args[0]) + " " + it->second +
+             " (uint64_t)" + var(args[1]) + ")";
+    }
+    if (auto it = kInfix.find(op); it != kInfix.end()) {
+      return var(args[0]) + " " + it->second + " " + var(args[1]);
+    }
+    if (op == "div") {
+      return "brandy_div(" + var(args[0]) + ", " + var(args[1]) + ")";
+    }
+    if (op == "id") return var(args[0]);
+    if (op == "not") return "!" + var(args[0]);
+    if (op == "char2int") return "(int64_t)" + var(args[0]);
+    if (op == "int2char") return "(uint32_t)" + var(args[0]);
+    if (op == "load") return "*" + var(args[0]);
+    throw std::runtime_error("the C backend doesn't support " + op);
+  }
+
+  void call(Instruction *instr, const std::vector<std::string> &args) {
+    out << "  ";
+    if (instr->hasDest()) out << var(instr->GetDest()) << " = ";
+    out << func(instr->instr["funcs"][0].get<std::string>()) << "(";
+    for (int i = 0; i < args.size(); ++i) {
+      if (i) out << ", ";
+      out << var(args[i]);
+    }
+    out << ");\n";
+  }
+
+  void print(const std::vector<std::string> &args) {
+    for (int i = 0; i < args.size(); ++i) {
+      if (i) out << "  putchar(' ');\n";
+      out << "  brandy_print_" << kindOf(types[args[i]]) << "("
+          << var(args[i]) << ");\n";
+    }
+    out << "  putchar('\\n');\n";
+  }
+
+  void instr(Instruction *instr) {
+    std::string op = instr->getOp();
+    std::vector<std::string> args;
+    if (instr->hasArgs()) args = instr->GetArgs();
+
+    if (op == "const") {
+      out << "  " << var(instr->GetDest()) << " = " << constant(instr)
+          << ";\n";
+    } else if (op == "alloc") {
+      const nl::json &type = types[instr->GetDest()];
+      out << "  " << var(instr->GetDest()) << " = (" << cType(type)
+          << ")brandy_alloc(" << var(args[0]) << ", sizeof("
+          << cType(type["ptr"]) << "));\n";
+    } else if (op == "free") {
+      out << "  brandy_free(" << var(args[0]) << ");\n";
+    } else if (op == "store") {
+      out << "  *" << var(args[0]) << " = " << var(args[1]) << ";\n";
+    } else if (op == "print") {
+      print(args);
+    } else if (op == "call") {
+      call(instr, args);
+    } else if (op == "nop") {
+      out << "  ;\n";
+    } else if (op == "ret") {
+      out << "  return";
+      if (!args.empty()) out << " " << var(args[0]);
+      out << ";\n";
+    } else {
+      out << "  " << var(instr->GetDest()) << " = " << expr(op, args)
+          << ";\n";
+    }
+  }
+
+  void emit() {
+    for (int i = 0; i < function.args.size(); ++i) {
+      types[function.args[i]] = function.arg_types[i];
+    }
+    std::set<std::string> phis;
+    for (BasicBlock *bb : function.basic_blocks) {
+      for (Instruction *instr : bb->instrs) {
+        if (instr->hasDest() && instr->instr.contains("type")) {
+          types.emplace(instr->GetDest(), instr->instr["type"]);
+        }
+        if (instr->hasOp() && instr->getOp() == "phi") {
+          phis.insert(instr->GetDest());
+        }
+      }
+    }
+
+    out << signature() << " {\n";
+    // Zero-initialized so that paths reading a variable before any definition
+    // stay defined in C.
+    for (const auto &[name, type] : types) {
+      bool param = false;
+      for (const std::string &arg : function.args) param |= arg == name;
+      if (!param) out << "  " << cType(type) << " " << var(name) << " = 0;\n";
+      if (phis.count(name)) {
+        out << "  " << cType(type) << " " << shadow(name) << " = 0;\n";
+      }
+    }
+
+    // Every edge is an explicit goto, so blocks without predecessors don't
+    // need a label.
+    std::set<std::string> targets;
+    const auto &blocks = function.basic_blocks;
+    for (int i = 0; i < blocks.size(); ++i) {
+      bool terminated = false;
+      for (Instruction *instr : blocks[i]->instrs) {
+        if (!instr->hasOp()) continue;
+        std::string op = instr->getOp();
+        if (op == "jmp" || op == "br") {
+          for (const std::string &target : instr->GetLabels()) {
+            targets.insert(target);
+          }
+        }
+        terminated = op == "jmp" || op == "br" || op == "ret";
+        if (terminated) break;
+      }
+      if (!terminated && i + 1 < blocks.size()) {
+        targets.insert(blocks[i + 1]->name);
+      }
+    }
+
+    for (int i = 0; i < blocks.size(); ++i) {
+      BasicBlock *bb = blocks[i];
+      if (targets.count(bb->name)) out << label(bb->name) << ":;\n";
+      bool terminated = false;
+      for (Instruction *instr : bb->instrs) {
+        if (!instr->hasOp()) continue;
+        std::string op = instr->getOp();
+        if (op == "phi") {
+          out << "  " << var(instr->GetDest()) << " = "
+              << shadow(instr->GetDest()) << ";\n";
+          continue;
+        }
+        if (op == "jmp") {
+          branch(bb, function.GetBasicBlock(instr->GetLabels()[0]), "  ");
+          terminated = true;
+          break;
+        }
+        if (op == "br") {
+          std::vector<std::string> labels = instr->GetLabels();
+          out << "  if (" << var(instr->GetArgs()[0]) << ") {\n";
+          branch(bb, function.GetBasicBlock(labels[0]), "    ");
+          out << "  }\n";
+          branch(bb, function.GetBasicBlock(labels[1]), "  ");
+          terminated = true;
+          break;
+        }
+        this->instr(instr);
+        if (op == "ret") {
+          terminated = true;
+          break;
+        }
+      }
+      if (!terminated && i + 1 < blocks.size()) {
+        branch(bb, blocks[i + 1], "  ");
+      }
+    }
+    // Falling off the end of the last block.
+    out << "  return" << (function.type.is_null() ? "" : " 0") << ";\n";
+    out << "}\n\n";
+  }
+};
+
+}  // namespace
+
+void EmitC(const std::vector<Function *> &functions, std::ostream &out) {
+  const Function *main = nullptr;
+  for (const Function *function : functions) {
+    if (function->name == "main") main = function;
+  }
+  if (!main) throw std::runtime_error("no @main function");
+
+  out << kRuntime << "\n";
+  for (const Function *function : functions) {
+    out << "static " << FunctionEmitter(*function, out).signature() << ";\n";
+  }
+  out << "\n";
+  for (const Function *function : functions) {
+    out << "static ";
+    FunctionEmitter(*function, out).emit();
+  }
+
+  out << "int main(int argc, char **argv) {\n";
+  out << "  if (argc != " << main->args.size() + 1 << ") {\n";
+  out << "    brandy_error(\"@main expects " << main->args.size()
+      << " arguments\");\n";
+  out << "  }\n";
+  out << "  " << func("main") << "(";
+  for (int i = 0; i < main->args.size(); ++i) {
+    if (i) out << ", ";
+    out << "brandy_parse_" << kindOf(main->arg_types[i]) << "(argv["
+        << i + 1 << "])";
+  }
+  out << ");\n";
+  out << "  if (brandy_live_allocs != 0) {\n";
+  out << "    brandy_error(\n";
+  out << "        \"Some memory locations have not been freed by end of "
+         "execution.\");\n";
+  out << "  }\n";
+  out << "  return 0;\n";
+  out << "}\n";
+}
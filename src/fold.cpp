@@ -0,0 +1,52 @@
+#include "fold.h"
+
+#include <cmath>
+#include <cstdint>
+
+std::optional<nl::json> FoldConstant(const std::string &op,
+                                     const std::vector<nl::json> &args) {
+  auto i = [&](int n) {
+    return static_cast<uint64_t>(args[n].get<int64_t>());
+  };
+  auto f = [&](int n) { return args[n].get<double>(); };
+  auto b = [&](int n) { return args[n].get<bool>(); };
+  auto wrap = [](uint64_t value) { return static_cast<int64_t>(value); };
+
+  if (op == "add") return wrap(i(0) + i(1));
+  if (op == "sub") return wrap(i(0) - i(1));
+  if (op == "mul") return wrap(i(0) * i(1));
+  if (op == "div") {
+    int64_t rhs = wrap(i(1));
+    if (rhs == 0) return std::nullopt;
+    if (rhs == -1) return wrap(0 - i(0));
+    return wrap(i(0)) / rhs;
+  }
+  if (op == "eq") return i(0) == i(1);
+  if (op == "lt") return wrap(i(0)) < wrap(i(1));
+  if (op == "gt") return wrap(i(0)) > wrap(i(1));
+  if (op == "le") return wrap(i(0)) <= wrap(i(1));
+  if (op == "ge") return wrap(i(0)) >= wrap(i(1));
+  if (op == "not") return !b(0);
+  if (op == "and") return b(0) && b(1);
+  if (op == "or") return b(0) || b(1);
+  if (op == "feq") return f(0) == f(1);
+  if (op == "flt") return f(0) < f(1);
+  if (op == "fgt") return f(0) > f(1);
+  if (op == "fle") return f(0) <= f(1);
+  if (op == "fge") return f(0) >= f(1);
+
+  double result;
+  if (op == "fadd") {
+    result = f(0) + f(1);
+  } else if (op == "fsub") {
+    result = f(0) - f(1);
+  } else if (op == "fmul") {
+    result = f(0) * f(1);
+  } else if (op == "fdiv") {
+    result = f(0) / f(1);
+  } else {
+    return std::nullopt;
+  }
+  if (!std::isfinite(result)) return std::nullopt;
+  return result;
+}
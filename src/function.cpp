@@ -1,10 +1,12 @@
 #include "function.h"
 
+#include <atomic>
 #include <iostream>
 
 #include "basic_block.h"
 #include "context.h"
 #include "instruction.h"
+#include "mem_stats.h"
 
 static std::optional<std::string> getOp(const nl::json &instr) {
   if (instr.contains("op")) {
@@ -27,18 +29,22 @@ static bool isTerminator(const nl::json &instr) {
 }
 
 static std::string createBBName() {
-  static int i = 1;
+  // Functions may be created on a background thread during tiered execution.
+  static std::atomic<int> i = 1;
   return "bb." + std::to_string(i++);
 }
 
 Function *Function::Create(Context *ctx, const nl::json &function) {
+  MemScope scope("Function::Create");
   Function *program = ctx->CreateFunction();
   program->name = function["name"];
   if (function.contains("args")) {
     for (const nl::json &arg : function["args"]) {
       program->args.push_back(std::move(arg["name"]));
+      program->arg_types.push_back(arg["type"]);
     }
   }
+  if (function.contains("type")) program->type = function["type"];
 
   BasicBlock *bb = ctx->CreateBasicBlock();
   for (const nl::json &instr : function["instrs"]) {
@@ -107,6 +113,10 @@ void Function::dump() const {
 nl::json Function::ToJson() {
   nl::json out;
   out["name"] = name;
+  for (int i = 0; i < args.size(); ++i) {
+    out["args"].push_back({{"name", args[i]}, {"type", arg_types[i]}});
+  }
+  if (!type.is_null()) out["type"] = type;
   for (BasicBlock *bb : basic_blocks) {
     nl::json label;
     label["label"] = bb->name;
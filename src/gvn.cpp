@@ -0,0 +1,208 @@
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "basic_block.h"
+#include "cfg.h"
+#include "dom.h"
+#include "function.h"
+#include "instruction.h"
+#include "mem_stats.h"
+#include "transform.h"
+
+// Ops without side effects whose result only depends on their operands. A
+// redundant div is still safe to drop: the dominating one traps first.
+static bool isPure(const std::string &op) {
+  static const std::unordered_set<std::string> kPure = {
+      "const", "add",  "sub",  "mul",  "div",  "eq",     "lt",
+      "gt",    "le",   "ge",   "not",  "and",  "or",     "fadd",
+      "fsub",  "fmul", "fdiv", "feq",  "flt",  "fgt",    "fle",
+      "fge",   "ceq",  "clt",  "cgt",  "cle",  "cge",    "char2int",
+      "int2char", "ptradd"};
+  return kPure.count(op);
+}
+
+static bool isCommutative(const std::string &op) {
+  return op == "add" || op == "mul" || op == "eq" || op == "and" ||
+         op == "or" || op == "fadd" || op == "fmul" || op == "feq" ||
+         op == "ceq";
+}
+
+static void makeCopy(Instruction *instr, const std::string &leader) {
+  instr->instr["op"] = "id";
+  instr->instr["args"] = {leader};
+  instr->instr.erase("value");
+  instr->instr.erase("labels");
+}
+
+namespace {
+
+struct GVN {
+  Function &func;
+  DomInfo &dom;
+
+  // The value number of every SSA name: the name of the first, dominating
+  // definition of the same value.
+  std::unordered_map<std::string, std::string> vn;
+  // Expressions available in the current dominator-tree scope.
+  std::unordered_map<std::string, std::string> table;
+  std::vector<std::string> undo;
+
+  GVN(Function &func, DomInfo &dom) : func(func), dom(dom) {}
+
+  std::string number(const std::string &var) {
+    auto it = vn.find(var);
+    return it == vn.end() ? var : it->second;
+  }
+
+  // Look `key` up in scope, or make `dest` its leader.
+  std::string lookup(const std::string &key, const std::string &dest) {
+    auto [it, inserted] = table.emplace(key, dest);
+    if (inserted) undo.push_back(key);
+    return it->second;
+  }
+
+  void phis(BasicBlock *bb) {
+    std::unordered_set<std::string> own;
+    for (Instruction *instr : bb->instrs) {
+      if (instr->hasOp() && instr->getOp() == "phi") {
+        own.insert(instr->GetDest());
+      }
+    }
+
+    bool rewritten = false;
+    for (Instruction *instr : bb->instrs) {
+      if (!instr->hasOp() || instr->getOp() != "phi") continue;
+      std::string dest = instr->GetDest();
+      std::vector<std::string> args = instr->GetArgs();
+      std::vector<std::string> labels = instr->GetLabels();
+
+      // A phi whose incoming values are all the same is that value, unless
+      // it's another phi of this block, which a copy would read too late.
+      std::string same = number(args[0]);
+      bool trivial = same != "__undef" && !own.count(same);
+      for (const std::string &arg : args) trivial &= number(arg) == same;
+      if (trivial) {
+        vn[dest] = same;
+        makeCopy(instr, same);
+        rewritten = true;
+        continue;
+      }
+
+      // Phis in the same block that merge the same values are congruent.
+      std::vector<std::pair<std::string, std::string>> incoming;
+      for (int i = 0; i < args.size(); ++i) {
+        incoming.emplace_back(labels[i], number(args[i]));
+      }
+      std::sort(incoming.begin(), incoming.end());
+      std::string key = "phi " + bb->name + " " +
+                        instr->instr.value("type", nl::json()).dump();
+      for (const auto &[label, arg] : incoming) key += " " + label + ":" + arg;
+      std::string leader = lookup(key, dest);
+      vn[dest] = leader;
+      if (leader != dest) {
+        makeCopy(instr, leader);
+        rewritten = true;
+      }
+    }
+
+    // Keep the remaining phis together at the top of the block.
+    if (rewritten) {
+      std::stable_partition(
+          bb->instrs.begin(), bb->instrs.end(), [](Instruction *instr) {
+            return !instr->hasOp() || instr->getOp() == "phi";
+          });
+    }
+  }
+
+  void body(BasicBlock *bb) {
+    for (Instruction *instr : bb->instrs) {
+      if (!instr->hasOp()) continue;
+      std::string op = instr->getOp();
+      if (op == "phi") continue;
+
+      if (instr->hasArgs()) {
+        nl::json &args = instr->instr["args"];
+        for (nl::json &arg : args) arg = number(arg.get<std::string>());
+      }
+      if (!instr->hasDest()) continue;
+      std::string dest = instr->GetDest();
+
+      if (op == "id") {
+        vn[dest] = instr->GetArgs()[0];
+        continue;
+      }
+      if (!isPure(op)) continue;
+
+      std::vector<std::string> args;
+      if (instr->hasArgs()) args = instr->GetArgs();
+      if (isCommutative(op)) std::sort(args.begin(), args.end());
+      std::string key = op + " " +
+                        instr->instr.value("type", nl::json()).dump();
+      if (op == "const") key += " " + instr->instr["value"].dump();
+      for (const std::string &arg : args) key += " " + arg;
+
+      std::string leader = lookup(key, dest);
+      vn[dest] = leader;
+      if (leader != dest) makeCopy(instr, leader);
+    }
+  }
+
+  // Phi arguments are uses at the end of the predecessor, so they are
+  // renamed once that block has been numbered.
+  void successorPhis(BasicBlock *bb, const CFG &cfg) {
+    auto it = cfg.successors.find(bb);
+    if (it == cfg.successors.end()) return;
+    for (BasicBlock *succ : it->second) {
+      for (Instruction *instr : succ->instrs) {
+        if (!instr->hasOp() || instr->getOp() != "phi") continue;
+        nl::json &args = instr->instr["args"];
+        const nl::json &labels = instr->instr["labels"];
+        for (int i = 0; i < args.size(); ++i) {
+          if (labels[i] == bb->name) args[i] = number(args[i]);
+        }
+      }
+    }
+  }
+
+  void run(const CFG &cfg) {
+    if (func.basic_blocks.empty()) return;
+    // Preorder over the dominator tree without recursing, so that long
+    // chains of blocks don't overflow the stack. A null entry closes the
+    // scope opened at the matching undo mark.
+    struct Visit {
+      BasicBlock *bb;
+      size_t mark;
+    };
+    std::vector<Visit> stack = {{func.basic_blocks.front(), 0}};
+    while (!stack.empty()) {
+      Visit visit = stack.back();
+      stack.pop_back();
+      if (!visit.bb) {
+        while (undo.size() > visit.mark) {
+          table.erase(undo.back());
+          undo.pop_back();
+        }
+        continue;
+      }
+      stack.push_back({nullptr, undo.size()});
+      phis(visit.bb);
+      body(visit.bb);
+      successorPhis(visit.bb, cfg);
+      auto it = dom.dom_tree.find(visit.bb);
+      if (it == dom.dom_tree.end()) continue;
+      for (BasicBlock *child : it->second) stack.push_back({child, 0});
+    }
+  }
+};
+
+}  // namespace
+
+void gvn(Function &func) {
+  MemScope scope("gvn");
+  CFG cfg = BuildCFG(func);
+  DomInfo dom = ComputeDomInfo(cfg);
+  GVN(func, dom).run(cfg);
+}
@@ -0,0 +1,88 @@
+#include "induction.h"
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "basic_block.h"
+#include "function.h"
+#include "instruction.h"
+#include "loop.h"
+
+InductionInfo FindInductionVariables(Function &function, const Loop &loop) {
+  InductionInfo info;
+  if (!loop.preheader || loop.latches.size() != 1) return info;
+  const std::string &preheader = loop.preheader->name;
+  const std::string &latch = loop.latches[0]->name;
+
+  std::unordered_map<std::string, Instruction *> defs;
+  for (BasicBlock *bb : function.basic_blocks) {
+    for (Instruction *instr : bb->instrs) {
+      if (instr->hasDest()) defs[instr->GetDest()] = instr;
+    }
+  }
+  auto definedInLoop = [&](const std::string &var) {
+    auto it = defs.find(var);
+    return it != defs.end() && loop.Contains(it->second->parent);
+  };
+
+  for (Instruction *phi : loop.header->instrs) {
+    if (!phi->hasOp() || phi->getOp() != "phi") break;
+    std::vector<std::string> args = phi->GetArgs();
+    std::vector<std::string> labels = phi->GetLabels();
+    if (args.size() != 2) continue;
+    InductionVariable iv = {.phi = phi};
+    std::string back;
+    for (int i = 0; i < 2; ++i) {
+      if (labels[i] == preheader) iv.init = args[i];
+      if (labels[i] == latch) back = args[i];
+    }
+    if (iv.init.empty() || iv.init == "__undef" || back.empty()) continue;
+
+    auto it = defs.find(back);
+    if (it == defs.end() || !loop.Contains(it->second->parent)) continue;
+    Instruction *next = it->second;
+    std::string op = next->getOp();
+    if (op != "add" && op != "sub") continue;
+    std::vector<std::string> operands = next->GetArgs();
+    std::string dest = phi->GetDest();
+    if (operands[0] == dest && !definedInLoop(operands[1])) {
+      iv.step = operands[1];
+    } else if (op == "add" && operands[1] == dest &&
+               !definedInLoop(operands[0])) {
+      iv.step = operands[0];
+    } else {
+      continue;
+    }
+    iv.next = next;
+    iv.decrement = op == "sub";
+    info.basic.push_back(std::move(iv));
+  }
+
+  std::unordered_map<std::string, std::pair<const InductionVariable *, bool>>
+      ivs;
+  for (const InductionVariable &iv : info.basic) {
+    ivs[iv.phi->GetDest()] = {&iv, false};
+    ivs[iv.next->GetDest()] = {&iv, true};
+  }
+  for (BasicBlock *bb : loop.blocks) {
+    for (Instruction *instr : bb->instrs) {
+      if (!instr->hasOp() || !instr->hasDest()) continue;
+      std::string op = instr->getOp();
+      if (op != "mul" && op != "ptradd") continue;
+      std::vector<std::string> operands = instr->GetArgs();
+      // The index of ptradd is its second operand; mul commutes.
+      for (int i = op == "ptradd" ? 1 : 0; i < 2; ++i) {
+        auto it = ivs.find(operands[i]);
+        const std::string &factor = operands[1 - i];
+        if (it == ivs.end() || definedInLoop(factor)) continue;
+        info.derived.push_back({.instr = instr,
+                                .basis = it->second.first,
+                                .of_next = it->second.second,
+                                .factor = factor});
+        break;
+      }
+    }
+  }
+  return info;
+}
@@ -0,0 +1,254 @@
+#include <algorithm>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "basic_block.h"
+#include "cfg.h"
+#include "context.h"
+#include "function.h"
+#include "instruction.h"
+#include "loop.h"
+#include "loop_utils.h"
+#include "mem_stats.h"
+#include "transform.h"
+
+// Callees of up to this many instructions are inlined wherever they're
+// called.
+static constexpr int64_t kInlineBudget = 24;
+// Calls in loops run more often, so each loop around a call, up to
+// kInlineMaxDepth of them, lets callees this much bigger be inlined there.
+static constexpr int64_t kInlineLoopBonus = 40;
+static constexpr int kInlineMaxDepth = 3;
+// A caller stops taking in callees once it's this big.
+static constexpr int64_t kInlineCallerBudget = 2000;
+
+static bool isPhi(Instruction *instr) {
+  return instr->hasOp() && instr->getOp() == "phi";
+}
+
+static int64_t size(const Function &function) {
+  int64_t size = 0;
+  for (BasicBlock *bb : function.basic_blocks) size += bb->instrs.size();
+  return size;
+}
+
+namespace {
+
+struct Inliner {
+  Context *ctx;
+  Function &caller;
+  Function &callee;
+
+  // Every name in the caller, to keep the copy's names apart.
+  std::unordered_set<std::string> used;
+  // The copy of every block and value of the callee. The callee's
+  // arguments are the call's.
+  std::unordered_map<std::string, std::string> blocks, values;
+  // New blocks, in the order they go in after the call.
+  std::vector<BasicBlock *> created;
+
+  Inliner(Context *ctx, Function &caller, Function &callee)
+      : ctx(ctx), caller(caller), callee(callee) {
+    used.insert(caller.args.begin(), caller.args.end());
+    for (BasicBlock *bb : caller.basic_blocks) {
+      used.insert(bb->name);
+      for (Instruction *instr : bb->instrs) {
+        if (instr->hasDest()) used.insert(instr->GetDest());
+      }
+    }
+  }
+
+  std::string fresh(const std::string &base) {
+    std::string name = base;
+    for (int i = 1; used.contains(name); ++i) {
+      name = base + "." + std::to_string(i);
+    }
+    used.insert(name);
+    return name;
+  }
+
+  BasicBlock *createBlock(const std::string &base) {
+    BasicBlock *bb = ctx->CreateBasicBlock();
+    bb->name = fresh(base);
+    caller.block_map[bb->name] = bb;
+    created.push_back(bb);
+    return bb;
+  }
+
+  void append(BasicBlock *bb, nl::json instr) {
+    bb->instrs.push_back(ctx->CreateInstruction(std::move(instr), bb));
+  }
+
+  std::string value(const std::string &var) const {
+    auto it = values.find(var);
+    return it == values.end() ? var : it->second;
+  }
+
+  // Whether the callee's body can stand in for `call`: it returns a value
+  // if the call takes one, its arguments are only ever read, and it doesn't
+  // call itself, which would have it inlined over and over.
+  bool canInline(Instruction *call) {
+    if (callee.basic_blocks.empty() ||
+        call->GetArgs().size() != callee.args.size()) {
+      return false;
+    }
+    std::unordered_set<std::string> args(callee.args.begin(),
+                                         callee.args.end());
+    bool returns = false;
+    for (BasicBlock *bb : callee.basic_blocks) {
+      for (Instruction *instr : bb->instrs) {
+        if (instr->hasDest() && args.contains(instr->GetDest())) return false;
+        if (bb == callee.basic_blocks.front() && isPhi(instr)) return false;
+        if (instr->hasOp() && instr->getOp() == "call" &&
+            instr->instr["funcs"][0] == callee.name) {
+          return false;
+        }
+        if (!instr->hasOp() || instr->getOp() != "ret") continue;
+        if (call->hasDest() && !instr->hasArgs()) return false;
+        returns = true;
+      }
+    }
+    return returns || !call->hasDest();
+  }
+
+  // Splits the call's block after the call, jumps from it into a copy of
+  // the callee, and has the copy's returns jump to the rest of the block.
+  void run(Instruction *call) {
+    BasicBlock *bb = call->parent;
+    auto pos = std::find(bb->instrs.begin(), bb->instrs.end(), call);
+    std::vector<std::string> call_args = call->GetArgs();
+    for (int i = 0; i < callee.args.size(); ++i) {
+      values[callee.args[i]] = call_args[i];
+    }
+    for (BasicBlock *block : callee.basic_blocks) {
+      for (Instruction *instr : block->instrs) {
+        if (!instr->hasDest()) continue;
+        values[instr->GetDest()] = fresh(instr->GetDest());
+      }
+    }
+
+    // The rest of the block is reached from the copy now, and so are the
+    // block's successors.
+    BasicBlock *rest = ctx->CreateBasicBlock();
+    rest->name = fresh(bb->name + ".ret");
+    caller.block_map[rest->name] = rest;
+    for (BasicBlock *block : caller.basic_blocks) {
+      for (Instruction *phi : block->instrs) {
+        if (!isPhi(phi)) break;
+        for (nl::json &name : phi->instr["labels"]) {
+          if (name == bb->name) name = rest->name;
+        }
+      }
+    }
+    for (auto it = std::next(pos); it != bb->instrs.end(); ++it) {
+      rest->instrs.push_back(*it);
+      (*it)->parent = rest;
+    }
+    bb->instrs.erase(pos, bb->instrs.end());
+
+    for (BasicBlock *block : callee.basic_blocks) {
+      blocks[block->name] =
+          createBlock(callee.name + "." + block->name)->name;
+    }
+    append(bb, {{"op", "jmp"},
+                {"labels", nl::json::array({created.front()->name})}});
+    nl::json returned = nl::json::array(), from = nl::json::array();
+    for (int i = 0; i < callee.basic_blocks.size(); ++i) {
+      BasicBlock *block = callee.basic_blocks[i];
+      BasicBlock *copy = created[i];
+      for (Instruction *instr : block->instrs) {
+        nl::json json = instr->instr;
+        if (json.contains("dest")) json["dest"] = value(json["dest"]);
+        if (json.contains("args")) {
+          for (nl::json &arg : json["args"]) arg = value(arg);
+        }
+        if (json.contains("labels")) {
+          for (nl::json &name : json["labels"]) name = blocks.at(name);
+        }
+        if (json["op"] == "ret") {
+          if (call->hasDest()) {
+            returned.push_back(json["args"][0]);
+            from.push_back(copy->name);
+          }
+          json = {{"op", "jmp"}, {"labels", nl::json::array({rest->name})}};
+        }
+        append(copy, std::move(json));
+      }
+      // The copy is laid out apart from the callee, so it can't fall
+      // through, and falling off the end of the callee returns.
+      if (FallsThrough(block)) {
+        std::string next = i + 1 < callee.basic_blocks.size()
+                               ? created[i + 1]->name
+                               : rest->name;
+        append(copy, {{"op", "jmp"}, {"labels", nl::json::array({next})}});
+      }
+    }
+
+    if (call->hasDest()) {
+      nl::json result = {{"dest", call->GetDest()},
+                         {"type", call->instr["type"]}};
+      if (returned.size() == 1) {
+        result["op"] = "id";
+        result["args"] = std::move(returned);
+      } else {
+        result["op"] = "phi";
+        result["args"] = std::move(returned);
+        result["labels"] = std::move(from);
+      }
+      rest->instrs.push_front(ctx->CreateInstruction(std::move(result), rest));
+    }
+    created.push_back(rest);
+
+    auto at = std::find(caller.basic_blocks.begin(), caller.basic_blocks.end(),
+                        bb);
+    caller.basic_blocks.insert(std::next(at), created.begin(), created.end());
+  }
+};
+
+}  // namespace
+
+void Inline(Context *ctx, Function &caller,
+            const std::map<std::string, Function *> &callees) {
+  MemScope scope("inline");
+  AnalysisCache analyses(caller);
+  // Calls that were left alone, so as not to weigh them again.
+  std::unordered_set<Instruction *> kept;
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    int64_t caller_size = size(caller);
+    LoopInfo &info = analyses.GetLoopInfo();
+    for (BasicBlock *bb : caller.basic_blocks) {
+      for (Instruction *call : bb->instrs) {
+        if (!call->hasOp() || call->getOp() != "call" || kept.contains(call)) {
+          continue;
+        }
+        auto it = callees.find(call->instr["funcs"][0].get<std::string>());
+        if (it == callees.end() || it->second == &caller) {
+          kept.insert(call);
+          continue;
+        }
+        Function &callee = *it->second;
+        int depth = std::min(info.Depth(bb), kInlineMaxDepth);
+        int64_t cost = size(callee);
+        Inliner inliner(ctx, caller, callee);
+        if (cost > kInlineBudget + depth * kInlineLoopBonus ||
+            caller_size + cost > kInlineCallerBudget ||
+            !inliner.canInline(call)) {
+          kept.insert(call);
+          continue;
+        }
+        inliner.run(call);
+        changed = true;
+        break;
+      }
+      if (changed) break;
+    }
+    analyses.Invalidate();
+  }
+  caller.all_instrs.clear();
+}
@@ -0,0 +1,545 @@
+#include "interp.h"
+
+#include <cmath>
+#include <cstdio>
+#include <stdexcept>
+#include <unordered_map>
+
+#include "basic_block.h"
+#include "function.h"
+#include "instruction.h"
+
+#define BRIL_OPS(X)                                                        \
+  X(Const, "const") X(Id, "id") X(Add, "add") X(Sub, "sub") X(Mul, "mul")  \
+  X(Div, "div") X(Eq, "eq") X(Lt, "lt") X(Gt, "gt") X(Le, "le")            \
+  X(Ge, "ge") X(Not, "not") X(And, "and") X(Or, "or") X(Jmp, "jmp")        \
+  X(Br, "br") X(Call, "call") X(Ret, "ret") X(Print, "print")              \
+  X(Nop, "nop") X(Phi, "phi") X(Fadd, "fadd") X(Fsub, "fsub")              \
+  X(Fmul, "fmul") X(Fdiv, "fdiv") X(Feq, "feq") X(Flt, "flt")              \
+  X(Fgt, "fgt") X(Fle, "fle") X(Fge, "fge") X(Alloc, "alloc")              \
+  X(Free, "free") X(Store, "store") X(Load, "load") X(PtrAdd, "ptradd")    \
+  X(Ceq, "ceq") X(Clt, "clt") X(Cgt, "cgt") X(Cle, "cle") X(Cge, "cge")    \
+  X(Char2Int, "char2int") X(Int2Char, "int2char")
+
+enum class Op {
+#define X(name, str) name,
+  BRIL_OPS(X)
+#undef X
+      NumOps
+};
+
+static const char *kOpNames[] = {
+#define X(name, str) str,
+    BRIL_OPS(X)
+#undef X
+};
+
+static Op parseOp(const std::string &op) {
+  static const std::unordered_map<std::string, Op> ops = {
+#define X(name, str) {str, Op::name},
+      BRIL_OPS(X)
+#undef X
+  };
+  auto it = ops.find(op);
+  if (it == ops.end()) throw std::runtime_error("unknown opcode: " + op);
+  return it->second;
+}
+
+#undef BRIL_OPS
+
+// One pre-decoded instruction, so that the interpreter loop doesn't have to
+// dig through JSON objects.
+struct Code {
+  Op op;
+  std::string dest;
+  std::vector<std::string> args;
+  // Block indices of jmp/br targets.
+  std::vector<int> targets;
+  // Incoming block names of a phi.
+  std::vector<std::string> labels;
+  std::string func;
+  Value value;
+};
+
+struct BlockCode {
+  std::string name;
+  std::vector<Code> phis;
+  std::vector<Code> body;
+  // The next block in layout order, -1 for the last one.
+  int fallthrough = -1;
+};
+
+struct FunctionCode {
+  Function *function;
+  std::vector<BlockCode> blocks;
+  uint64_t counts[static_cast<int>(Op::NumOps)] = {};
+  uint64_t calls = 0;
+  // Jumps to a block at or before the current one in layout order.
+  uint64_t back_edges = 0;
+};
+
+static std::string encodeUTF8(char32_t c) {
+  std::string out;
+  if (c < 0x80) {
+    out += static_cast<char>(c);
+  } else if (c < 0x800) {
+    out += static_cast<char>(0xC0 | (c >> 6));
+    out += static_cast<char>(0x80 | (c & 0x3F));
+  } else if (c < 0x10000) {
+    out += static_cast<char>(0xE0 | (c >> 12));
+    out += static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+    out += static_cast<char>(0x80 | (c & 0x3F));
+  } else {
+    out += static_cast<char>(0xF0 | (c >> 18));
+    out += static_cast<char>(0x80 | ((c >> 12) & 0x3F));
+    out += static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+    out += static_cast<char>(0x80 | (c & 0x3F));
+  }
+  return out;
+}
+
+static char32_t decodeUTF8(const std::string &s) {
+  if (s.empty()) throw std::runtime_error("empty char literal");
+  unsigned char c = s[0];
+  if (c < 0x80) return c;
+  int len = c >= 0xF0 ? 4 : c >= 0xE0 ? 3 : 2;
+  char32_t out = c & (0x3F >> (len - 1));
+  for (int i = 1; i < len && i < s.size(); ++i) {
+    out = (out << 6) | (s[i] & 0x3F);
+  }
+  return out;
+}
+
+Value Value::Int(int64_t v) {
+  Value out;
+  out.kind = Kind::Int;
+  out.i = v;
+  return out;
+}
+
+Value Value::Bool(bool v) {
+  Value out;
+  out.kind = Kind::Bool;
+  out.b = v;
+  return out;
+}
+
+Value Value::Float(double v) {
+  Value out;
+  out.kind = Kind::Float;
+  out.f = v;
+  return out;
+}
+
+Value Value::Char(char32_t v) {
+  Value out;
+  out.kind = Kind::Char;
+  out.c = v;
+  return out;
+}
+
+Value Value::Ptr(int64_t alloc, int64_t offset) {
+  Value out;
+  out.kind = Kind::Ptr;
+  out.ptr.alloc = alloc;
+  out.ptr.offset = offset;
+  return out;
+}
+
+Value Value::Parse(const std::string &text, const nl::json &type) {
+  if (type == "bool") {
+    if (text != "true" && text != "false") {
+      throw std::runtime_error("invalid bool argument: " + text);
+    }
+    return Bool(text == "true");
+  }
+  if (type == "float") return Float(std::stod(text));
+  if (type == "char") return Char(decodeUTF8(text));
+  return Int(std::stoll(text));
+}
+
+std::string Value::ToString() const {
+  switch (kind) {
+    case Kind::Int:
+      return std::to_string(i);
+    case Kind::Bool:
+      return b ? "true" : "false";
+    case Kind::Float: {
+      if (std::isnan(f)) return "NaN";
+      if (std::isinf(f)) return f > 0 ? "Infinity" : "-Infinity";
+      char buf[512];
+      std::snprintf(buf, sizeof(buf), "%.17f", f);
+      return buf;
+    }
+    case Kind::Char:
+      return encodeUTF8(c);
+    case Kind::Ptr:
+      return "{ loc: " + std::to_string(ptr.alloc) +
+             ", offset: " + std::to_string(ptr.offset) + " }";
+    case Kind::Undef:
+      break;
+  }
+  return "undefined";
+}
+
+// Constants come as plain JSON literals, the type tells how to read them.
+static Value constValue(const nl::json &instr) {
+  const nl::json &value = instr["value"];
+  const nl::json &type = instr.contains("type") ? instr["type"] : nl::json();
+  if (type == "bool" || value.is_boolean()) {
+    return Value::Bool(value.get<bool>());
+  }
+  if (type == "float") return Value::Float(value.get<double>());
+  if (type == "char") return Value::Char(decodeUTF8(value.get<std::string>()));
+  return Value::Int(value.get<int64_t>());
+}
+
+Interpreter::Interpreter(const std::vector<Function *> &functions,
+                         std::ostream &out)
+    : out(out) {
+  for (Function *function : functions) {
+    this->functions[function->name] = function;
+  }
+}
+
+Interpreter::~Interpreter() = default;
+
+FunctionCode &Interpreter::code(Function *function) {
+  if (auto it = decoded.find(function); it != decoded.end()) {
+    return *it->second;
+  }
+
+  auto fc = std::make_unique<FunctionCode>();
+  fc->function = function;
+  std::unordered_map<std::string, int> index;
+  for (int i = 0; i < function->basic_blocks.size(); ++i) {
+    index[function->basic_blocks[i]->name] = i;
+  }
+
+  for (int i = 0; i < function->basic_blocks.size(); ++i) {
+    BasicBlock *bb = function->basic_blocks[i];
+    BlockCode &block = fc->blocks.emplace_back();
+    block.name = bb->name;
+    if (i + 1 < function->basic_blocks.size()) block.fallthrough = i + 1;
+
+    for (Instruction *instr : bb->instrs) {
+      if (!instr->hasOp()) continue;
+      Code c;
+      c.op = parseOp(instr->getOp());
+      if (instr->hasDest()) c.dest = instr->GetDest();
+      if (instr->hasArgs()) c.args = instr->GetArgs();
+      if (instr->instr.contains("funcs")) {
+        c.func = instr->instr["funcs"][0].get<std::string>();
+      }
+      if (c.op == Op::Const) c.value = constValue(instr->instr);
+      if (instr->instr.contains("labels")) {
+        if (c.op == Op::Phi) {
+          c.labels = instr->GetLabels();
+        } else {
+          for (const std::string &label : instr->GetLabels()) {
+            auto it = index.find(label);
+            if (it == index.end()) {
+              throw std::runtime_error("unknown label: " + label);
+            }
+            c.targets.push_back(it->second);
+          }
+        }
+      }
+      (c.op == Op::Phi ? block.phis : block.body).push_back(std::move(c));
+    }
+  }
+
+  return *decoded.emplace(function, std::move(fc)).first->second;
+}
+
+void Interpreter::Run(const std::vector<std::string> &args) {
+  auto it = functions.find("main");
+  if (it == functions.end()) throw std::runtime_error("no @main function");
+  Function *main = it->second;
+  if (args.size() != main->args.size()) {
+    throw std::runtime_error("@main expects " +
+                             std::to_string(main->args.size()) +
+                             " arguments");
+  }
+
+  std::vector<Value> values;
+  for (int i = 0; i < args.size(); ++i) {
+    values.push_back(Value::Parse(args[i], main->arg_types[i]));
+  }
+  Call("main", values);
+
+  if (!heap.empty()) {
+    throw std::runtime_error(
+        "Some memory locations have not been freed by end of execution.");
+  }
+}
+
+Value Interpreter::Call(const std::string &name,
+                        const std::vector<Value> &args) {
+  auto it = functions.find(name);
+  if (it == functions.end()) {
+    throw std::runtime_error("unknown function @" + name);
+  }
+  uint64_t calls = ++code(it->second).calls;
+  if (tier_policy) {
+    // A replacement takes over for all later calls too.
+    it->second = tier_policy->OnCall(it->second, calls);
+  }
+  FunctionCode &fc = code(it->second);
+  Function *function = fc.function;
+  if (args.size() != function->args.size()) {
+    throw std::runtime_error("wrong number of arguments to @" + name);
+  }
+
+  std::unordered_map<std::string, Value> env;
+  for (int i = 0; i < args.size(); ++i) env[function->args[i]] = args[i];
+
+  auto get = [&env](const std::string &var) -> const Value & {
+    auto it = env.find(var);
+    if (it == env.end()) throw std::runtime_error("undefined variable " + var);
+    return it->second;
+  };
+  auto pointee = [this](const Value &ptr) -> Value & {
+    auto it = heap.find(ptr.ptr.alloc);
+    if (it == heap.end() || ptr.ptr.offset < 0 ||
+        ptr.ptr.offset >= it->second.size()) {
+      throw std::runtime_error("uninitialized heap location " +
+                               ptr.ToString());
+    }
+    return it->second[ptr.ptr.offset];
+  };
+  // Bril integers wrap around like two's complement 64-bit values.
+  auto wrap = [](uint64_t v) { return Value::Int(static_cast<int64_t>(v)); };
+
+  if (fc.blocks.empty()) return Value();
+
+  int block = 0;
+  const BlockCode *prev = nullptr;
+  std::vector<std::pair<const std::string *, Value>> phi_values;
+  while (true) {
+    const BlockCode &bb = fc.blocks[block];
+
+    // All phis of a block read their arguments before any of them writes.
+    if (!bb.phis.empty()) {
+      phi_values.clear();
+      for (const Code &phi : bb.phis) {
+        ++fc.counts[static_cast<int>(Op::Phi)];
+        for (int i = 0; prev && i < phi.labels.size(); ++i) {
+          if (phi.labels[i] != prev->name) continue;
+          // Undefined along this edge, leave the dest alone.
+          if (auto arg = env.find(phi.args[i]); arg != env.end()) {
+            phi_values.emplace_back(&phi.dest, arg->second);
+          }
+          break;
+        }
+      }
+      for (auto &[dest, value] : phi_values) env[*dest] = value;
+    }
+
+    int next = bb.fallthrough;
+    for (const Code &c : bb.body) {
+      ++fc.counts[static_cast<int>(c.op)];
+      auto arg = [&](int i) -> const Value & { return get(c.args[i]); };
+      Value result;
+      switch (c.op) {
+        case Op::Const:
+          result = c.value;
+          break;
+        case Op::Id:
+          result = arg(0);
+          break;
+        case Op::Add:
+          result = wrap(static_cast<uint64_t>(arg(0).i) +
+                        static_cast<uint64_t>(arg(1).i));
+          break;
+        case Op::Sub:
+          result = wrap(static_cast<uint64_t>(arg(0).i) -
+                        static_cast<uint64_t>(arg(1).i));
+          break;
+        case Op::Mul:
+          result = wrap(static_cast<uint64_t>(arg(0).i) *
+                        static_cast<uint64_t>(arg(1).i));
+          break;
+        case Op::Div: {
+          int64_t lhs = arg(0).i, rhs = arg(1).i;
+          if (rhs == 0) throw std::runtime_error("division by zero");
+          result = rhs == -1 ? wrap(0 - static_cast<uint64_t>(lhs))
+                             : Value::Int(lhs / rhs);
+          break;
+        }
+        case Op::Eq:
+          result = Value::Bool(arg(0).i == arg(1).i);
+          break;
+        case Op::Lt:
+          result = Value::Bool(arg(0).i < arg(1).i);
+          break;
+        case Op::Gt:
+          result = Value::Bool(arg(0).i > arg(1).i);
+          break;
+        case Op::Le:
+          result = Value::Bool(arg(0).i <= arg(1).i);
+          break;
+        case Op::Ge:
+          result = Value::Bool(arg(0).i >= arg(1).i);
+          break;
+        case Op::Not:
+          result = Value::Bool(!arg(0).b);
+          break;
+        case Op::And:
+          result = Value::Bool(arg(0).b && arg(1).b);
+          break;
+        case Op::Or:
+          result = Value::Bool(arg(0).b || arg(1).b);
+          break;
+        case Op::Fadd:
+          result = Value::Float(arg(0).f + arg(1).f);
+          break;
+        case Op::Fsub:
+          result = Value::Float(arg(0).f - arg(1).f);
+          break;
+        case Op::Fmul:
+          result = Value::Float(arg(0).f * arg(1).f);
+          break;
+        case Op::Fdiv:
+          result = Value::Float(arg(0).f / arg(1).f);
+          break;
+        case Op::Feq:
+          result = Value::Bool(arg(0).f == arg(1).f);
+          break;
+        case Op::Flt:
+          result = Value::Bool(arg(0).f < arg(1).f);
+          break;
+        case Op::Fgt:
+          result = Value::Bool(arg(0).f > arg(1).f);
+          break;
+        case Op::Fle:
+          result = Value::Bool(arg(0).f <= arg(1).f);
+          break;
+        case Op::Fge:
+          result = Value::Bool(arg(0).f >= arg(1).f);
+          break;
+        case Op::Ceq:
+          result = Value::Bool(arg(0).c == arg(1).c);
+          break;
+        case Op::Clt:
+          result = Value::Bool(arg(0).c < arg(1).c);
+          break;
+        case Op::Cgt:
+          result = Value::Bool(arg(0).c > arg(1).c);
+          break;
+        case Op::Cle:
+          result = Value::Bool(arg(0).c <= arg(1).c);
+          break;
+        case Op::Cge:
+          result = Value::Bool(arg(0).c >= arg(1).c);
+          break;
+        case Op::Char2Int:
+          result = Value::Int(arg(0).c);
+          break;
+        case Op::Int2Char:
+          result = Value::Char(static_cast<char32_t>(arg(0).i));
+          break;
+        case Op::Alloc: {
+          int64_t size = arg(0).i;
+          if (size <= 0) {
+            throw std::runtime_error("cannot allocate " +
+                                     std::to_string(size) + " entries");
+          }
+          heap[next_alloc].resize(size);
+          result = Value::Ptr(next_alloc++, 0);
+          break;
+        }
+        case Op::Free: {
+          const Value &ptr = arg(0);
+          if (ptr.ptr.offset != 0 || !heap.erase(ptr.ptr.alloc)) {
+            throw std::runtime_error("tried to free illegal memory location " +
+                                     ptr.ToString());
+          }
+          break;
+        }
+        case Op::Store:
+          pointee(arg(0)) = arg(1);
+          break;
+        case Op::Load:
+          result = pointee(arg(0));
+          if (result.kind == Value::Kind::Undef) {
+            throw std::runtime_error("load of uninitialized memory");
+          }
+          break;
+        case Op::PtrAdd:
+          result = Value::Ptr(arg(0).ptr.alloc, arg(0).ptr.offset + arg(1).i);
+          break;
+        case Op::Print: {
+          std::string line;
+          for (int i = 0; i < c.args.size(); ++i) {
+            if (i) line += " ";
+            line += arg(i).ToString();
+          }
+          out << line << "\n";
+          break;
+        }
+        case Op::Nop:
+          break;
+        case Op::Call: {
+          std::vector<Value> call_args;
+          for (const std::string &a : c.args) call_args.push_back(get(a));
+          result = Call(c.func, call_args);
+          break;
+        }
+        case Op::Jmp:
+          next = c.targets[0];
+          goto terminated;
+        case Op::Br:
+          next = arg(0).b ? c.targets[0] : c.targets[1];
+          goto terminated;
+        case Op::Ret:
+          return c.args.empty() ? Value() : arg(0);
+        case Op::Phi:
+        case Op::NumOps:
+          throw std::runtime_error("unexpected phi");
+      }
+      if (!c.dest.empty()) env[c.dest] = result;
+    }
+
+  terminated:
+    if (next < 0) return Value();
+    if (next <= block) {
+      ++fc.back_edges;
+      if (tier_policy) tier_policy->OnBackEdge(function, fc.back_edges);
+    }
+    prev = &bb;
+    block = next;
+  }
+}
+
+std::map<std::string, std::map<std::string, uint64_t>> Interpreter::Counts()
+    const {
+  std::map<std::string, std::map<std::string, uint64_t>> out;
+  for (const auto &[function, fc] : decoded) {
+    for (int op = 0; op < static_cast<int>(Op::NumOps); ++op) {
+      // Different versions of a function add up.
+      if (fc->counts[op]) out[function->name][kOpNames[op]] += fc->counts[op];
+    }
+  }
+  return out;
+}
+
+uint64_t Interpreter::TotalCount() const {
+  uint64_t total = 0;
+  for (const auto &[function, fc] : decoded) {
+    for (uint64_t count : fc->counts) total += count;
+  }
+  return total;
+}
+
+void Interpreter::DumpProfile(std::ostream &os) const {
+  os << "total_dyn_inst: " << TotalCount() << "\n";
+  for (const auto &[function, ops] : Counts()) {
+    uint64_t total = 0;
+    for (const auto &[op, count] : ops) total += count;
+    os << "@" << function << ": " << total << "\n";
+    for (const auto &[op, count] : ops) {
+      os << "  " << op << ": " << count << "\n";
+    }
+  }
+}
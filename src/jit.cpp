@@ -0,0 +1,633 @@
+#include "jit.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+#include <map>
+#include <stdexcept>
+
+#include "bytecode.h"
+#include "function.h"
+#include "interp.h"
+
+#if defined(__x86_64__) && defined(__linux__)
+#include <sys/mman.h>
+#define BRANDY_JIT 1
+#endif
+
+struct JIT::Runtime {
+  [[noreturn]] static void Error(JIT *jit, const char *message) {
+    jit->error = message;
+    std::longjmp(jit->on_error, 1);
+  }
+
+  static void Print(JIT *jit, const int32_t *pairs, const int64_t *values,
+                    int64_t n) {
+    std::string line;
+    for (int i = 0; i < n; ++i) {
+      if (i) line += " ";
+      switch (static_cast<Tag>(pairs[2 * i + 1])) {
+        case Tag::Int:
+        case Tag::Ptr:
+          line += std::to_string(values[i]);
+          break;
+        case Tag::Bool:
+          line += values[i] ? "true" : "false";
+          break;
+        case Tag::Float: {
+          double f;
+          std::memcpy(&f, &values[i], sizeof(f));
+          line += Value::Float(f).ToString();
+          break;
+        }
+        case Tag::Char:
+          line += Value::Char(static_cast<char32_t>(values[i])).ToString();
+          break;
+      }
+    }
+    jit->out << line << "\n";
+  }
+
+  static void *Alloc(JIT *jit, int64_t n) {
+    if (n <= 0) {
+      jit->error = "cannot allocate " + std::to_string(n) + " entries";
+      std::longjmp(jit->on_error, 1);
+    }
+    ++jit->live_allocs;
+    return std::calloc(n, sizeof(int64_t));
+  }
+
+  static void Free(JIT *jit, void *p) {
+    --jit->live_allocs;
+    std::free(p);
+  }
+};
+
+#ifdef BRANDY_JIT
+
+namespace {
+
+enum Reg : uint8_t {
+  RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+  R8, R9, R10, R11, R12, R13, R14, R15
+};
+
+// The callee-saved registers handed out to slots.
+constexpr Reg kAllocatable[] = {RBX, R12, R13, R14, R15};
+constexpr int kNumAllocatable = std::size(kAllocatable);
+// Below the saved rbp, the callee-saved registers take this many bytes.
+constexpr int32_t kSavedBytes = 8 * kNumAllocatable;
+
+// Just the encodings the code generator needs, all with REX.W.
+struct Assembler {
+  std::vector<uint8_t> bytes;
+
+  size_t pos() const { return bytes.size(); }
+
+  void byte(uint8_t b) { bytes.push_back(b); }
+
+  void imm32(int32_t v) {
+    for (int i = 0; i < 4; ++i) byte(v >> (8 * i));
+  }
+
+  void imm64(uint64_t v) {
+    for (int i = 0; i < 8; ++i) byte(v >> (8 * i));
+  }
+
+  void patch32(size_t at, int32_t v) {
+    for (int i = 0; i < 4; ++i) bytes[at + i] = v >> (8 * i);
+  }
+
+  void rex(uint8_t reg, uint8_t rm) {
+    byte(0x48 | (reg >> 3) << 2 | rm >> 3);
+  }
+
+  // op reg, rm with a register operand.
+  void rr(std::initializer_list<uint8_t> op, uint8_t reg, uint8_t rm) {
+    rex(reg, rm);
+    for (uint8_t b : op) byte(b);
+    byte(0xc0 | (reg & 7) << 3 | (rm & 7));
+  }
+
+  // op reg, [base + disp].
+  void rm(std::initializer_list<uint8_t> op, uint8_t reg, uint8_t base,
+          int32_t disp) {
+    rex(reg, base);
+    for (uint8_t b : op) byte(b);
+    byte(0x80 | (reg & 7) << 3 | (base & 7));
+    if ((base & 7) == RSP) byte(0x24);
+    imm32(disp);
+  }
+
+  void movabs(Reg reg, uint64_t v) {
+    rex(0, reg);
+    byte(0xb8 + (reg & 7));
+    imm64(v);
+  }
+
+  void push(Reg reg) {
+    if (reg >= R8) byte(0x41);
+    byte(0x50 + (reg & 7));
+  }
+
+  void pop(Reg reg) {
+    if (reg >= R8) byte(0x41);
+    byte(0x58 + (reg & 7));
+  }
+
+  void callAbs(const void *target) {
+    movabs(RAX, reinterpret_cast<uint64_t>(target));
+    byte(0xff);
+    byte(0xd0);
+  }
+
+  // Emit a rel32 jump or call and return where its displacement goes.
+  size_t jmp() {
+    byte(0xe9);
+    imm32(0);
+    return pos() - 4;
+  }
+
+  size_t jcc(uint8_t cc) {
+    byte(0x0f);
+    byte(0x80 | cc);
+    imm32(0);
+    return pos() - 4;
+  }
+
+  size_t call() {
+    byte(0xe8);
+    imm32(0);
+    return pos() - 4;
+  }
+
+  void bind(size_t at, size_t target) { patch32(at, target - (at + 4)); }
+};
+
+// Condition codes.
+constexpr uint8_t kE = 0x4, kNE = 0x5, kB = 0x2, kL = 0xc, kGE = 0xd,
+                  kLE = 0xe, kG = 0xf;
+
+}  // namespace
+
+// Compiles one function. Nested in JIT for access to the runtime helpers.
+struct JIT::CodeGen {
+  const VMFunction &fn;
+  JIT *jit;
+  Assembler &as;
+
+  // Where each slot lives: a register or an rbp-relative displacement.
+  std::vector<int> reg;
+  std::vector<int32_t> disp;
+  int32_t frame = 0;
+
+  std::vector<size_t> pc_pos;
+  std::vector<std::pair<size_t, int>> jumps;
+  std::vector<size_t> to_epilogue;
+  std::vector<size_t> to_div_error;
+  std::vector<size_t> to_overflow;
+
+  // Calls to other functions: (displacement, callee index).
+  std::vector<std::pair<size_t, int>> &calls;
+
+  CodeGen(const VMFunction &fn, JIT *jit, Assembler &as,
+          std::vector<std::pair<size_t, int>> &calls)
+      : fn(fn), jit(jit), as(as), calls(calls) {}
+
+  template <typename F>
+  void forEachSlot(const VMInstr &instr, F f) {
+    switch (instr.op) {
+      case VMOp::Jmp:
+      case VMOp::Nop:
+        break;
+      case VMOp::Br:
+      case VMOp::Free:
+      case VMOp::Ret:
+        if (instr.a >= 0) f(instr.a);
+        break;
+      case VMOp::Call:
+        for (int i = 0; i < instr.b; ++i) f(fn.pool[instr.c + i]);
+        if (instr.dst >= 0) f(instr.dst);
+        break;
+      case VMOp::Print:
+        for (int i = 0; i < instr.b; ++i) f(fn.pool[instr.c + 2 * i]);
+        break;
+      default:
+        if (instr.dst >= 0) f(instr.dst);
+        if (instr.a >= 0) f(instr.a);
+        if (instr.b >= 0) f(instr.b);
+    }
+  }
+
+  // Give the registers to the slots with the most uses, where every level of
+  // loop nesting, found through backward jumps, counts eight times as much.
+  void allocate() {
+    std::vector<int> depth(fn.code.size() + 1);
+    for (int pc = 0; pc < fn.code.size(); ++pc) {
+      const VMInstr &instr = fn.code[pc];
+      std::vector<int> targets;
+      if (instr.op == VMOp::Jmp) targets = {instr.b};
+      if (instr.op == VMOp::Br) targets = {instr.b, instr.c};
+      for (int target : targets) {
+        if (target > pc) continue;
+        ++depth[target];
+        --depth[pc + 1];
+      }
+    }
+    std::vector<double> weight(fn.num_slots);
+    int level = 0;
+    for (int pc = 0; pc < fn.code.size(); ++pc) {
+      level += depth[pc];
+      double w = 1;
+      for (int i = 0; i < std::min(level, 6); ++i) w *= 8;
+      forEachSlot(fn.code[pc], [&](int slot) { weight[slot] += w; });
+    }
+
+    std::vector<int> order(fn.num_slots);
+    for (int i = 0; i < fn.num_slots; ++i) order[i] = i;
+    std::stable_sort(order.begin(), order.end(),
+                     [&](int x, int y) { return weight[x] > weight[y]; });
+
+    reg.assign(fn.num_slots, -1);
+    disp.assign(fn.num_slots, 0);
+    int spills = 0;
+    for (int i = 0; i < order.size(); ++i) {
+      if (i < kNumAllocatable && weight[order[i]] > 0) {
+        reg[order[i]] = kAllocatable[i];
+      } else {
+        disp[order[i]] = -(kSavedBytes + 8 * ++spills);
+      }
+    }
+
+    // Room at the bottom of the frame for call and print arguments.
+    int outgoing = 0;
+    for (const VMInstr &instr : fn.code) {
+      if (instr.op == VMOp::Call || instr.op == VMOp::Print) {
+        outgoing = std::max(outgoing, instr.b);
+      }
+    }
+    frame = 8 * (spills + outgoing);
+    // The return address and six pushes leave rsp 8 bytes off alignment.
+    if (frame % 16 == 0) frame += 8;
+  }
+
+  void load(Reg r, int slot) {
+    if (reg[slot] >= 0) {
+      if (reg[slot] != r) as.rr({0x8b}, r, reg[slot]);
+    } else {
+      as.rm({0x8b}, r, RBP, disp[slot]);
+    }
+  }
+
+  void store(int slot, Reg r) {
+    if (reg[slot] >= 0) {
+      if (reg[slot] != r) as.rr({0x89}, r, reg[slot]);
+    } else {
+      as.rm({0x89}, r, RBP, disp[slot]);
+    }
+  }
+
+  // op r, slot for instructions of the "r64, r/m64" form.
+  void alu(std::initializer_list<uint8_t> op, Reg r, int slot) {
+    if (reg[slot] >= 0) {
+      as.rr(op, r, reg[slot]);
+    } else {
+      as.rm(op, r, RBP, disp[slot]);
+    }
+  }
+
+  void move(int dst, int src) {
+    if (dst == src) return;
+    if (reg[src] >= 0) {
+      store(dst, static_cast<Reg>(reg[src]));
+    } else if (reg[dst] >= 0) {
+      load(static_cast<Reg>(reg[dst]), src);
+    } else {
+      load(RAX, src);
+      store(dst, RAX);
+    }
+  }
+
+  void constant(int dst, int64_t v) {
+    if (v != static_cast<int32_t>(v)) {
+      as.movabs(RAX, v);
+      store(dst, RAX);
+    } else if (reg[dst] >= 0) {
+      as.rr({0xc7}, 0, reg[dst]);
+      as.imm32(v);
+    } else {
+      as.rm({0xc7}, 0, RBP, disp[dst]);
+      as.imm32(v);
+    }
+  }
+
+  void binary(const VMInstr &instr, std::initializer_list<uint8_t> op) {
+    load(RAX, instr.a);
+    alu(op, RAX, instr.b);
+    store(instr.dst, RAX);
+  }
+
+  void compare(const VMInstr &instr, uint8_t cc) {
+    load(RAX, instr.a);
+    alu({0x3b}, RAX, instr.b);
+    // setcc al; movzx eax, al
+    as.byte(0x0f);
+    as.byte(0x90 | cc);
+    as.byte(0xc0);
+    as.byte(0x0f);
+    as.byte(0xb6);
+    as.byte(0xc0);
+    store(instr.dst, RAX);
+  }
+
+  void branchTo(int pc, int target) {
+    if (target != pc + 1) jumps.emplace_back(as.jmp(), target);
+  }
+
+  // Store the slots listed in the pool at `offset` (every `stride` entries)
+  // to the outgoing area at rsp.
+  void outgoing(int offset, int n, int stride) {
+    for (int i = 0; i < n; ++i) {
+      load(RAX, fn.pool[offset + stride * i]);
+      as.rm({0x89}, RAX, RSP, 8 * i);
+    }
+  }
+
+  bool instr(int pc) {
+    const VMInstr &instr = fn.code[pc];
+    switch (instr.op) {
+      case VMOp::Const:
+        constant(instr.dst, instr.imm.i);
+        break;
+      case VMOp::Mov:
+        move(instr.dst, instr.a);
+        break;
+      case VMOp::Add:
+        binary(instr, {0x03});
+        break;
+      case VMOp::Sub:
+        binary(instr, {0x2b});
+        break;
+      case VMOp::Mul:
+        binary(instr, {0x0f, 0xaf});
+        break;
+      case VMOp::And:
+        binary(instr, {0x23});
+        break;
+      case VMOp::Or:
+        binary(instr, {0x0b});
+        break;
+      case VMOp::Div: {
+        load(RAX, instr.a);
+        load(RCX, instr.b);
+        as.rr({0x85}, RCX, RCX);
+        to_div_error.push_back(as.jcc(kE));
+        // INT64_MIN / -1 traps, so negate instead.
+        as.rr({0x83}, 7, RCX);
+        as.byte(0xff);
+        size_t divide = as.jcc(kNE);
+        as.rr({0xf7}, 3, RAX);
+        size_t done = as.jmp();
+        as.bind(divide, as.pos());
+        as.byte(0x48);
+        as.byte(0x99);
+        as.rr({0xf7}, 7, RCX);
+        as.bind(done, as.pos());
+        store(instr.dst, RAX);
+        break;
+      }
+      case VMOp::Eq:
+        compare(instr, kE);
+        break;
+      case VMOp::Lt:
+        compare(instr, kL);
+        break;
+      case VMOp::Gt:
+        compare(instr, kG);
+        break;
+      case VMOp::Le:
+        compare(instr, kLE);
+        break;
+      case VMOp::Ge:
+        compare(instr, kGE);
+        break;
+      case VMOp::Not:
+        load(RAX, instr.a);
+        as.rr({0x83}, 6, RAX);
+        as.byte(1);
+        store(instr.dst, RAX);
+        break;
+      case VMOp::Alloc:
+        load(RSI, instr.a);
+        as.movabs(RDI, reinterpret_cast<uint64_t>(jit));
+        as.callAbs(reinterpret_cast<void *>(&Runtime::Alloc));
+        store(instr.dst, RAX);
+        break;
+      case VMOp::Free:
+        load(RSI, instr.a);
+        as.movabs(RDI, reinterpret_cast<uint64_t>(jit));
+        as.callAbs(reinterpret_cast<void *>(&Runtime::Free));
+        break;
+      case VMOp::Store:
+        load(RAX, instr.a);
+        load(RCX, instr.b);
+        as.rm({0x89}, RCX, RAX, 0);
+        break;
+      case VMOp::Load:
+        load(RAX, instr.a);
+        as.rm({0x8b}, RAX, RAX, 0);
+        store(instr.dst, RAX);
+        break;
+      case VMOp::PtrAdd:
+        load(RAX, instr.a);
+        load(RCX, instr.b);
+        // shl rcx, 3
+        as.rr({0xc1}, 4, RCX);
+        as.byte(3);
+        as.rr({0x01}, RCX, RAX);
+        store(instr.dst, RAX);
+        break;
+      case VMOp::Jmp:
+        branchTo(pc, instr.b);
+        break;
+      case VMOp::Br:
+        if (reg[instr.a] >= 0) {
+          as.rr({0x85}, reg[instr.a], reg[instr.a]);
+        } else {
+          as.rm({0x83}, 7, RBP, disp[instr.a]);
+          as.byte(0);
+        }
+        if (instr.b == pc + 1) {
+          jumps.emplace_back(as.jcc(kE), instr.c);
+        } else {
+          jumps.emplace_back(as.jcc(kNE), instr.b);
+          branchTo(pc, instr.c);
+        }
+        break;
+      case VMOp::Call:
+        outgoing(instr.c, instr.b, 1);
+        as.rr({0x89}, RSP, RDI);
+        calls.emplace_back(as.call(), instr.a);
+        if (instr.dst >= 0) store(instr.dst, RAX);
+        break;
+      case VMOp::Ret:
+        if (instr.a >= 0) {
+          load(RAX, instr.a);
+        } else {
+          // xor eax, eax
+          as.byte(0x31);
+          as.byte(0xc0);
+        }
+        to_epilogue.push_back(as.jmp());
+        break;
+      case VMOp::Print:
+        outgoing(instr.c, instr.b, 2);
+        as.movabs(RDI, reinterpret_cast<uint64_t>(jit));
+        as.movabs(RSI, reinterpret_cast<uint64_t>(fn.pool.data() + instr.c));
+        as.rr({0x89}, RSP, RDX);
+        as.rr({0xc7}, 0, RCX);
+        as.imm32(instr.b);
+        as.callAbs(reinterpret_cast<void *>(&Runtime::Print));
+        break;
+      case VMOp::Nop:
+        break;
+      default:
+        return false;
+    }
+    return true;
+  }
+
+  void errorStub(const std::vector<size_t> &from, const char *message) {
+    for (size_t at : from) as.bind(at, as.pos());
+    as.movabs(RDI, reinterpret_cast<uint64_t>(jit));
+    as.movabs(RSI, reinterpret_cast<uint64_t>(message));
+    as.callAbs(reinterpret_cast<void *>(&Runtime::Error));
+  }
+
+  // Functions take a pointer to their arguments in rdi and return in rax.
+  bool compile() {
+    allocate();
+
+    as.push(RBP);
+    as.rr({0x89}, RSP, RBP);
+    for (Reg r : kAllocatable) as.push(r);
+    as.rr({0x81}, 5, RSP);
+    as.imm32(frame);
+    as.movabs(RAX, reinterpret_cast<uint64_t>(&jit->stack_limit));
+    as.rm({0x3b}, RSP, RAX, 0);
+    to_overflow.push_back(as.jcc(kB));
+    for (int i = 0; i < fn.num_params; ++i) {
+      as.rm({0x8b}, RAX, RDI, 8 * i);
+      store(i, RAX);
+    }
+
+    for (int pc = 0; pc < fn.code.size(); ++pc) {
+      pc_pos.push_back(as.pos());
+      if (!instr(pc)) return false;
+    }
+    pc_pos.push_back(as.pos());
+    for (auto [at, pc] : jumps) as.bind(at, pc_pos[pc]);
+
+    // Lowering always ends functions in a Ret, so nothing falls through.
+    for (size_t at : to_epilogue) as.bind(at, as.pos());
+    as.rm({0x8d}, RSP, RBP, -kSavedBytes);
+    for (int i = kNumAllocatable - 1; i >= 0; --i) as.pop(kAllocatable[i]);
+    as.pop(RBP);
+    as.byte(0xc3);
+
+    errorStub(to_div_error, "division by zero");
+    errorStub(to_overflow, "stack overflow");
+    return true;
+  }
+};
+
+JIT::JIT(const std::vector<Function *> &functions, std::ostream &out)
+    : out(out) {
+  std::map<std::string, int> index;
+  for (int i = 0; i < functions.size(); ++i) index[functions[i]->name] = i;
+  for (Function *function : functions) {
+    auto &lowered = this->functions.emplace_back(
+        std::make_unique<VMFunction>());
+    LowerFunction(*function, index, *lowered, /*fuse=*/false);
+  }
+
+  Assembler as;
+  std::vector<std::pair<size_t, int>> calls;
+  for (auto &function : this->functions) {
+    entries.push_back(as.pos());
+    if (!CodeGen(*function, this, as, calls).compile()) return;
+  }
+  for (auto [at, callee] : calls) as.bind(at, entries[callee]);
+
+  void *mem = mmap(nullptr, as.bytes.size(), PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED) return;
+  std::memcpy(mem, as.bytes.data(), as.bytes.size());
+  if (mprotect(mem, as.bytes.size(), PROT_READ | PROT_EXEC) != 0) {
+    munmap(mem, as.bytes.size());
+    return;
+  }
+  code = static_cast<uint8_t *>(mem);
+  code_size = as.bytes.size();
+}
+
+JIT::~JIT() {
+  if (code) munmap(code, code_size);
+}
+
+// Keep this much of the native stack for the runtime and brandy itself.
+static constexpr uintptr_t kStackReserve = 1 << 20;
+
+void JIT::Run(const std::vector<std::string> &args) {
+  int main = -1;
+  for (int i = 0; i < functions.size(); ++i) {
+    if (functions[i]->name == "main") main = i;
+  }
+  if (main < 0) throw std::runtime_error("no @main function");
+  if (args.size() != functions[main]->num_params) {
+    throw std::runtime_error("@main expects " +
+                             std::to_string(functions[main]->num_params) +
+                             " arguments");
+  }
+  std::vector<int64_t> values;
+  for (int i = 0; i < args.size(); ++i) {
+    Value value = Value::Parse(args[i], functions[main]->param_types[i]);
+    if (value.kind == Value::Kind::Float) {
+      int64_t bits;
+      std::memcpy(&bits, &value.f, sizeof(bits));
+      values.push_back(bits);
+    } else if (value.kind == Value::Kind::Bool) {
+      values.push_back(value.b);
+    } else if (value.kind == Value::Kind::Char) {
+      values.push_back(value.c);
+    } else {
+      values.push_back(value.i);
+    }
+  }
+
+  stack_limit = NativeStackLimit(kStackReserve);
+
+  auto entry =
+      reinterpret_cast<int64_t (*)(const int64_t *)>(code + entries[main]);
+  if (setjmp(on_error)) throw std::runtime_error(error);
+  entry(values.data());
+
+  if (live_allocs != 0) {
+    throw std::runtime_error(
+        "Some memory locations have not been freed by end of execution.");
+  }
+}
+
+#else
+
+JIT::JIT(const std::vector<Function *> &functions, std::ostream &out)
+    : out(out) {}
+
+JIT::~JIT() = default;
+
+void JIT::Run(const std::vector<std::string> &args) {
+  throw std::runtime_error("the JIT only supports x86-64 Linux");
+}
+
+#endif
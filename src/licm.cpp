@@ -0,0 +1,154 @@
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "basic_block.h"
+#include "function.h"
+#include "instruction.h"
+#include "loop.h"
+#include "loop_utils.h"
+#include "mem_stats.h"
+#include "transform.h"
+
+// Ops that can run as often as we like, even on paths that didn't run them
+// before: no side effects and no traps. div traps on zero, so it's handled
+// separately.
+static bool isSpeculatable(const std::string &op) {
+  static const std::unordered_set<std::string> kSpeculatable = {
+      "const", "id",   "add",  "sub",  "mul",  "eq",      "lt",
+      "gt",    "le",   "ge",   "not",  "and",  "or",      "fadd",
+      "fsub",  "fmul", "fdiv", "feq",  "flt",  "fgt",     "fle",
+      "fge",   "ceq",  "clt",  "cgt",  "cle",  "cge",     "char2int",
+      "int2char", "ptradd"};
+  return kSpeculatable.count(op);
+}
+
+static bool hasSideEffects(const std::string &op) {
+  return op == "print" || op == "store" || op == "free" || op == "call" ||
+         op == "alloc";
+}
+
+namespace {
+
+struct LICM {
+  Function &func;
+  DomInfo &dom;
+
+  // The instruction defining every SSA name but the arguments.
+  std::unordered_map<std::string, Instruction *> defs;
+
+  LICM(Function &func, DomInfo &dom) : func(func), dom(dom) {
+    for (BasicBlock *bb : func.basic_blocks) {
+      for (Instruction *instr : bb->instrs) {
+        if (instr->hasDest()) defs[instr->GetDest()] = instr;
+      }
+    }
+  }
+
+  bool dominates(BasicBlock *a, BasicBlock *b) {
+    const std::vector<BasicBlock *> &doms = dom.dom[b];
+    return std::find(doms.begin(), doms.end(), a) != doms.end();
+  }
+
+  bool isInvariant(const std::string &var, const Loop &loop) {
+    auto it = defs.find(var);
+    return it == defs.end() || !loop.Contains(it->second->parent);
+  }
+
+  bool isNonZeroConst(const std::string &var) {
+    auto it = defs.find(var);
+    if (it == defs.end()) return false;
+    Instruction *def = it->second;
+    return def->getOp() == "const" && def->instr["value"].is_number() &&
+           def->instr["value"] != 0;
+  }
+
+  // A hoisted load must read what it would have, and trap only if it would
+  // have trapped before anything observable happened. So the loop must not
+  // touch memory or print.
+  bool canHoistLoads(const Loop &loop) {
+    for (BasicBlock *bb : loop.blocks) {
+      for (Instruction *instr : bb->instrs) {
+        if (instr->hasOp() && hasSideEffects(instr->getOp())) return false;
+      }
+    }
+    return true;
+  }
+
+  // The blocks an instruction must dominate to run on every iteration that
+  // starts: those that leave the loop and the latches.
+  std::vector<BasicBlock *> mustDominate(const Loop &loop, CFG &cfg) {
+    std::vector<BasicBlock *> blocks = loop.latches;
+    for (BasicBlock *bb : loop.blocks) {
+      const std::vector<BasicBlock *> &succs = cfg.successors[bb];
+      auto outside = [&](BasicBlock *succ) { return !loop.Contains(succ); };
+      if (succs.empty() || std::any_of(succs.begin(), succs.end(), outside)) {
+        blocks.push_back(bb);
+      }
+    }
+    return blocks;
+  }
+
+  bool canHoist(Instruction *instr, const Loop &loop, bool loads,
+                const std::vector<BasicBlock *> &always) {
+    if (!instr->hasOp() || !instr->hasDest()) return false;
+    std::string op = instr->getOp();
+    if (instr->hasArgs()) {
+      for (const std::string &arg : instr->GetArgs()) {
+        if (!isInvariant(arg, loop)) return false;
+      }
+    }
+    if (isSpeculatable(op)) return true;
+    if (op == "div") return isNonZeroConst(instr->GetArgs()[1]);
+    if (op == "load" && loads) {
+      return std::all_of(always.begin(), always.end(), [&](BasicBlock *bb) {
+        return dominates(instr->parent, bb);
+      });
+    }
+    return false;
+  }
+
+  // Hoists into the preheader until nothing else is invariant: moving one
+  // instruction out can make the ones using it invariant.
+  void run(Loop &loop, CFG &cfg) {
+    BasicBlock *preheader = loop.preheader;
+    bool loads = canHoistLoads(loop);
+    std::vector<BasicBlock *> always = mustDominate(loop, cfg);
+    bool changed = true;
+    while (changed) {
+      changed = false;
+      for (BasicBlock *bb : loop.blocks) {
+        std::erase_if(bb->instrs, [&](Instruction *instr) {
+          if (!canHoist(instr, loop, loads, always)) return false;
+          preheader->instrs.insert(BeforeTerminator(preheader), instr);
+          instr->parent = preheader;
+          changed = true;
+          return true;
+        });
+      }
+    }
+  }
+};
+
+}  // namespace
+
+void licm(Context *ctx, Function &func) {
+  MemScope scope("licm");
+  AnalysisCache analyses(func);
+  bool added = false;
+  for (const auto &loop : analyses.GetLoopInfo().loops) {
+    if (loop->preheader) continue;
+    EnsurePreheader(ctx, func, analyses.GetCFG(), *loop);
+    added = true;
+  }
+  if (added) analyses.Invalidate();
+
+  LoopInfo &info = analyses.GetLoopInfo();
+  LICM pass(func, analyses.GetDomInfo());
+  // Innermost loops first, so what they hoist can keep going out.
+  for (auto it = info.loops.rbegin(); it != info.loops.rend(); ++it) {
+    pass.run(**it, analyses.GetCFG());
+  }
+}
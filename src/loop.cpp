@@ -0,0 +1,255 @@
+#include "loop.h"
+
+#include <algorithm>
+#include <unordered_map>
+
+#include "basic_block.h"
+#include "function.h"
+#include "mem_stats.h"
+#include "scev.h"
+
+static bool dominates(DomInfo &dom, BasicBlock *a, BasicBlock *b) {
+  const std::vector<BasicBlock *> &doms = dom.dom[b];
+  return std::find(doms.begin(), doms.end(), a) != doms.end();
+}
+
+// Every block reachable from `from` along `edges` without entering
+// `blocked`.
+static std::set<BasicBlock *> reaching(
+    std::map<BasicBlock *, std::vector<BasicBlock *>> &edges,
+    const std::vector<BasicBlock *> &from,
+    const std::set<BasicBlock *> &blocked) {
+  std::set<BasicBlock *> seen;
+  std::vector<BasicBlock *> worklist;
+  for (BasicBlock *bb : from) {
+    if (!blocked.contains(bb) && seen.insert(bb).second) {
+      worklist.push_back(bb);
+    }
+  }
+  while (!worklist.empty()) {
+    BasicBlock *bb = worklist.back();
+    worklist.pop_back();
+    for (BasicBlock *next : edges[bb]) {
+      if (!blocked.contains(next) && seen.insert(next).second) {
+        worklist.push_back(next);
+      }
+    }
+  }
+  return seen;
+}
+
+LoopInfo ComputeLoopInfo(CFG &cfg, DomInfo &dom) {
+  MemScope scope("ComputeLoopInfo");
+  LoopInfo info;
+  Function &function = *cfg.function;
+  if (function.basic_blocks.empty()) return info;
+
+  std::unordered_map<BasicBlock *, int> order;
+  int index = 0;
+  for (BasicBlock *bb : function.basic_blocks) order[bb] = index++;
+  auto byLayout = [&](BasicBlock *a, BasicBlock *b) {
+    return order[a] < order[b];
+  };
+
+  // Find the edges that close a cycle in a depth-first walk. Those whose
+  // target dominates their source are back edges; the rest enter a cycle
+  // from the side, which makes the cycle irreducible.
+  std::map<BasicBlock *, std::vector<BasicBlock *>> latches;
+  std::vector<std::pair<BasicBlock *, BasicBlock *>> retreating;
+  {
+    enum State { kUnseen, kOnStack, kDone };
+    std::unordered_map<BasicBlock *, State> state;
+    struct Frame {
+      BasicBlock *bb;
+      size_t next;
+    };
+    std::vector<Frame> stack = {{function.basic_blocks.front(), 0}};
+    state[function.basic_blocks.front()] = kOnStack;
+    while (!stack.empty()) {
+      Frame &frame = stack.back();
+      std::vector<BasicBlock *> &succs = cfg.successors[frame.bb];
+      if (frame.next == succs.size()) {
+        state[frame.bb] = kDone;
+        stack.pop_back();
+        continue;
+      }
+      BasicBlock *from = frame.bb, *to = succs[frame.next++];
+      if (state[to] == kOnStack) {
+        if (dominates(dom, to, from)) {
+          std::vector<BasicBlock *> &tails = latches[to];
+          if (std::find(tails.begin(), tails.end(), from) == tails.end()) {
+            tails.push_back(from);
+          }
+        } else {
+          retreating.emplace_back(from, to);
+        }
+      } else if (state[to] == kUnseen) {
+        state[to] = kOnStack;
+        stack.push_back({to, 0});
+      }
+    }
+  }
+
+  // The cycle a retreating edge closes runs through blocks that `to`
+  // doesn't dominate. Walking around the loops that contain it is kept out
+  // by not going through the blocks dominating `to`.
+  for (const auto &[from, to] : retreating) {
+    std::set<BasicBlock *> blocked(dom.dom[to].begin(), dom.dom[to].end());
+    blocked.erase(to);
+    std::set<BasicBlock *> forward = reaching(cfg.successors, {to}, blocked);
+    std::set<BasicBlock *> backward =
+        reaching(cfg.predecessors, {from}, blocked);
+    for (BasicBlock *bb : forward) {
+      if (backward.contains(bb)) info.irreducible.insert(bb);
+    }
+  }
+
+  for (auto &[header, tails] : latches) {
+    if (info.irreducible.contains(header)) continue;
+    auto loop = std::make_unique<Loop>();
+    loop->header = header;
+    loop->latches = tails;
+    std::sort(loop->latches.begin(), loop->latches.end(), byLayout);
+    loop->block_set = reaching(cfg.predecessors, tails, {header});
+    loop->block_set.insert(header);
+    loop->blocks.assign(loop->block_set.begin(), loop->block_set.end());
+    std::sort(loop->blocks.begin(), loop->blocks.end(), byLayout);
+    // The header goes first even if a block of the loop is laid out above
+    // it.
+    std::stable_partition(loop->blocks.begin(), loop->blocks.end(),
+                          [&](BasicBlock *bb) { return bb == header; });
+
+    std::set<BasicBlock *> exits;
+    for (BasicBlock *bb : loop->blocks) {
+      for (BasicBlock *succ : cfg.successors[bb]) {
+        if (!loop->Contains(succ)) exits.insert(succ);
+      }
+    }
+    loop->exits.assign(exits.begin(), exits.end());
+    std::sort(loop->exits.begin(), loop->exits.end(), byLayout);
+
+    std::vector<BasicBlock *> outside;
+    for (BasicBlock *pred : cfg.predecessors[header]) {
+      if (!loop->Contains(pred)) outside.push_back(pred);
+    }
+    if (outside.size() == 1 && cfg.successors[outside[0]].size() == 1) {
+      loop->preheader = outside[0];
+    }
+    info.loops.push_back(std::move(loop));
+  }
+
+  // Loops with different headers are either nested or disjoint, so the
+  // parent of a loop is the smallest other loop containing its header.
+  std::stable_sort(info.loops.begin(), info.loops.end(),
+                   [](const auto &a, const auto &b) {
+                     return a->blocks.size() > b->blocks.size();
+                   });
+  for (size_t i = 0; i < info.loops.size(); ++i) {
+    Loop *loop = info.loops[i].get();
+    for (size_t j = i; j-- > 0;) {
+      if (info.loops[j]->Contains(loop)) {
+        loop->parent = info.loops[j].get();
+        break;
+      }
+    }
+    if (loop->parent) {
+      loop->parent->children.push_back(loop);
+      loop->depth = loop->parent->depth + 1;
+    } else {
+      info.top_level.push_back(loop);
+    }
+    // Inner loops come later and overwrite their blocks' entries.
+    for (BasicBlock *bb : loop->blocks) info.loop_of[bb] = loop;
+  }
+
+  auto byHeader = [&](Loop *a, Loop *b) {
+    return byLayout(a->header, b->header);
+  };
+  std::sort(info.top_level.begin(), info.top_level.end(), byHeader);
+  for (const auto &loop : info.loops) {
+    std::sort(loop->children.begin(), loop->children.end(), byHeader);
+  }
+  return info;
+}
+
+Loop *LoopInfo::GetLoop(BasicBlock *bb) const {
+  auto it = loop_of.find(bb);
+  return it == loop_of.end() ? nullptr : it->second;
+}
+
+int LoopInfo::Depth(BasicBlock *bb) const {
+  Loop *loop = GetLoop(bb);
+  return loop ? loop->depth : 0;
+}
+
+static void dumpBlocks(std::ostream &os, const char *what,
+                       const std::vector<BasicBlock *> &blocks,
+                       const std::string &indent) {
+  os << indent << what << ":";
+  for (BasicBlock *bb : blocks) os << " ." << bb->name;
+  os << "\n";
+}
+
+static void dumpLoop(std::ostream &os, const Loop *loop, int level) {
+  std::string indent(2 * level, ' ');
+  os << indent << "loop ." << loop->header->name << " (depth " << loop->depth
+     << ")\n";
+  indent += "  ";
+  dumpBlocks(os, "blocks", loop->blocks, indent);
+  dumpBlocks(os, "latches", loop->latches, indent);
+  dumpBlocks(os, "exits", loop->exits, indent);
+  os << indent << "preheader: ";
+  os << (loop->preheader ? "." + loop->preheader->name : "none") << "\n";
+  for (const Loop *child : loop->children) dumpLoop(os, child, level + 1);
+}
+
+void LoopInfo::dump(const Function &function, std::ostream &os) const {
+  os << "@" << function.name << ":";
+  if (loops.empty() && irreducible.empty()) {
+    os << " no loops\n";
+    return;
+  }
+  os << "\n";
+  for (const Loop *loop : top_level) dumpLoop(os, loop, 1);
+  if (!irreducible.empty()) {
+    std::vector<BasicBlock *> blocks;
+    for (BasicBlock *bb : function.basic_blocks) {
+      if (irreducible.contains(bb)) blocks.push_back(bb);
+    }
+    dumpBlocks(os, "irreducible", blocks, "  ");
+  }
+}
+
+AnalysisCache::AnalysisCache(Function &function) : function(function) {}
+
+AnalysisCache::~AnalysisCache() = default;
+
+CFG &AnalysisCache::GetCFG() {
+  if (!cfg) cfg = BuildCFG(function);
+  return *cfg;
+}
+
+DomInfo &AnalysisCache::GetDomInfo() {
+  if (!dom) dom = ComputeDomInfo(GetCFG());
+  return *dom;
+}
+
+LoopInfo &AnalysisCache::GetLoopInfo() {
+  if (!loops) loops = ComputeLoopInfo(GetCFG(), GetDomInfo());
+  return *loops;
+}
+
+ScalarEvolution &AnalysisCache::GetScalarEvolution() {
+  if (!scev) {
+    scev = std::make_unique<ScalarEvolution>(GetCFG(), GetDomInfo(),
+                                             GetLoopInfo());
+  }
+  return *scev;
+}
+
+void AnalysisCache::Invalidate() {
+  scev.reset();
+  loops.reset();
+  dom.reset();
+  cfg.reset();
+}
@@ -0,0 +1,117 @@
+#include "loop_utils.h"
+
+#include <algorithm>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include "basic_block.h"
+#include "cfg.h"
+#include "context.h"
+#include "function.h"
+#include "instruction.h"
+#include "loop.h"
+
+std::string FreshName(const Function &function, const std::string &base) {
+  std::unordered_set<std::string> used(function.args.begin(),
+                                       function.args.end());
+  for (BasicBlock *bb : function.basic_blocks) {
+    used.insert(bb->name);
+    for (Instruction *instr : bb->instrs) {
+      if (instr->hasDest()) used.insert(instr->GetDest());
+    }
+  }
+  std::string name = base;
+  for (int i = 1; used.contains(name); ++i) {
+    name = base + "." + std::to_string(i);
+  }
+  return name;
+}
+
+static void appendJump(Context *ctx, BasicBlock *bb, BasicBlock *target) {
+  nl::json jmp = {{"op", "jmp"}, {"labels", nl::json::array({target->name})}};
+  bb->instrs.push_back(ctx->CreateInstruction(std::move(jmp), bb));
+}
+
+bool FallsThrough(BasicBlock *bb) {
+  if (bb->instrs.empty()) return true;
+  std::string op = bb->instrs.back()->getOp();
+  return op != "jmp" && op != "br" && op != "ret";
+}
+
+std::deque<Instruction *>::iterator BeforeTerminator(BasicBlock *bb) {
+  return FallsThrough(bb) ? bb->instrs.end() : std::prev(bb->instrs.end());
+}
+
+BasicBlock *EnsurePreheader(Context *ctx, Function &function, const CFG &cfg,
+                            Loop &loop) {
+  if (loop.preheader) return loop.preheader;
+  BasicBlock *header = loop.header;
+  std::vector<BasicBlock *> outside;
+  if (auto it = cfg.predecessors.find(header); it != cfg.predecessors.end()) {
+    for (BasicBlock *pred : it->second) {
+      if (!loop.Contains(pred)) outside.push_back(pred);
+    }
+  }
+
+  BasicBlock *preheader = ctx->CreateBasicBlock();
+  preheader->name = FreshName(function, header->name + ".preheader");
+  function.block_map[preheader->name] = preheader;
+  auto pos = std::find(function.basic_blocks.begin(),
+                       function.basic_blocks.end(), header);
+  // A block of the loop laid out above the header mustn't fall into the
+  // preheader instead.
+  if (pos != function.basic_blocks.begin() && loop.Contains(*std::prev(pos)) &&
+      FallsThrough(*std::prev(pos))) {
+    appendJump(ctx, *std::prev(pos), header);
+  }
+  function.basic_blocks.insert(pos, preheader);
+
+  for (BasicBlock *pred : outside) {
+    if (pred->instrs.empty() || !pred->instrs.back()->hasOp()) continue;
+    Instruction *branch = pred->instrs.back();
+    std::string op = branch->getOp();
+    if (op != "jmp" && op != "br") continue;
+    for (nl::json &label : branch->instr["labels"]) {
+      if (label == header->name) label = preheader->name;
+    }
+  }
+
+  // The values the header's phis take on entry now come from the preheader.
+  // Where several predecessors merge, a phi in the preheader merges them
+  // first.
+  std::unordered_set<std::string> from_outside;
+  for (BasicBlock *pred : outside) from_outside.insert(pred->name);
+  for (Instruction *phi : header->instrs) {
+    if (!phi->hasOp() || phi->getOp() != "phi") break;
+    nl::json args = nl::json::array(), labels = nl::json::array();
+    nl::json entry_args = nl::json::array(), entry_labels = nl::json::array();
+    for (int i = 0; i < phi->instr["args"].size(); ++i) {
+      const nl::json &label = phi->instr["labels"][i];
+      bool entry = from_outside.contains(label.get<std::string>());
+      (entry ? entry_args : args).push_back(phi->instr["args"][i]);
+      (entry ? entry_labels : labels).push_back(label);
+    }
+    if (entry_args.empty()) continue;
+    nl::json value = entry_args[0];
+    if (entry_args.size() > 1) {
+      value = FreshName(function, phi->GetDest() + ".pre");
+      nl::json merge = {{"op", "phi"},
+                        {"dest", value},
+                        {"type", phi->instr["type"]},
+                        {"args", std::move(entry_args)},
+                        {"labels", std::move(entry_labels)}};
+      preheader->instrs.push_back(
+          ctx->CreateInstruction(std::move(merge), preheader));
+    }
+    args.push_back(std::move(value));
+    labels.push_back(preheader->name);
+    phi->instr["args"] = std::move(args);
+    phi->instr["labels"] = std::move(labels);
+  }
+
+  appendJump(ctx, preheader, header);
+  function.all_instrs.clear();
+  loop.preheader = preheader;
+  return preheader;
+}
@@ -0,0 +1,255 @@
+#include <algorithm>
+#include <deque>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "basic_block.h"
+#include "context.h"
+#include "fold.h"
+#include "function.h"
+#include "induction.h"
+#include "instruction.h"
+#include "loop.h"
+#include "loop_utils.h"
+#include "mem_stats.h"
+#include "transform.h"
+
+namespace {
+
+struct LSR {
+  Context *ctx;
+  Function &func;
+  DomInfo &dom;
+  Loop &loop;
+
+  std::unordered_map<std::string, Instruction *> defs;
+  // What reduce computed in the preheader, which is dead if the recurrence
+  // it started turns out to be.
+  std::vector<Instruction *> setup;
+
+  LSR(Context *ctx, Function &func, DomInfo &dom, Loop &loop)
+      : ctx(ctx), func(func), dom(dom), loop(loop) {
+    for (BasicBlock *bb : func.basic_blocks) {
+      for (Instruction *instr : bb->instrs) {
+        if (instr->hasDest()) defs[instr->GetDest()] = instr;
+      }
+    }
+  }
+
+  const nl::json *constant(const std::string &var) {
+    auto it = defs.find(var);
+    if (it == defs.end() || it->second->getOp() != "const") return nullptr;
+    return &it->second->instr["value"];
+  }
+
+  bool sameValue(const std::string &a, const std::string &b) {
+    if (a == b) return true;
+    const nl::json *x = constant(a), *y = constant(b);
+    return x && y && *x == *y;
+  }
+
+  // Does `a` run before `b` on every path to `b`?
+  bool dominates(Instruction *a, Instruction *b) {
+    if (a->parent == b->parent) {
+      const std::deque<Instruction *> &instrs = a->parent->instrs;
+      return std::find(instrs.begin(), instrs.end(), a) <
+             std::find(instrs.begin(), instrs.end(), b);
+    }
+    const std::vector<BasicBlock *> &doms = dom.dom[b->parent];
+    return std::find(doms.begin(), doms.end(), a->parent) != doms.end();
+  }
+
+  // Make every use of `from` use `to` and drop the instruction defining
+  // `from`.
+  void replace(Instruction *instr, const std::string &to) {
+    std::string from = instr->GetDest();
+    for (BasicBlock *bb : func.basic_blocks) {
+      for (Instruction *user : bb->instrs) {
+        if (!user->hasArgs()) continue;
+        for (nl::json &arg : user->instr["args"]) {
+          if (arg == from) arg = to;
+        }
+      }
+    }
+    std::erase(instr->parent->instrs, instr);
+    defs.erase(from);
+  }
+
+  std::unordered_map<std::string, int> countUses() {
+    std::unordered_map<std::string, int> uses;
+    for (BasicBlock *bb : func.basic_blocks) {
+      for (Instruction *instr : bb->instrs) {
+        if (!instr->hasArgs()) continue;
+        for (const std::string &arg : instr->GetArgs()) ++uses[arg];
+      }
+    }
+    return uses;
+  }
+
+  Instruction *insert(BasicBlock *bb, std::deque<Instruction *>::iterator pos,
+                      nl::json instr) {
+    std::string dest = instr["dest"];
+    Instruction *created = ctx->CreateInstruction(std::move(instr), bb);
+    bb->instrs.insert(pos, created);
+    defs[dest] = created;
+    return created;
+  }
+
+  // A new value `op a b` computed once in the preheader, or folded.
+  std::string preheaderValue(const std::string &op, const std::string &a,
+                             const std::string &b, const nl::json &type,
+                             const std::string &base) {
+    nl::json instr = {{"dest", FreshName(func, base)}, {"type", type}};
+    const nl::json *x = constant(a), *y = constant(b);
+    std::optional<nl::json> folded;
+    if (x && y) folded = FoldConstant(op, {*x, *y});
+    if (folded) {
+      instr["op"] = "const";
+      instr["value"] = *folded;
+    } else {
+      instr["op"] = op;
+      instr["args"] = {a, b};
+    }
+    setup.push_back(
+        insert(loop.preheader, BeforeTerminator(loop.preheader), instr));
+    return instr["dest"];
+  }
+
+  // Replace a derived induction variable with a recurrence of its own: a
+  // header phi that starts at its value on entry and adds the basis' step
+  // scaled by the factor whenever the basis adds its step.
+  void reduce(const DerivedInductionVariable &derived) {
+    const InductionVariable &basis = *derived.basis;
+    Instruction *instr = derived.instr;
+    std::string dest = instr->GetDest();
+    nl::json type = instr->instr["type"];
+    std::string start, increment, op;
+    if (instr->getOp() == "mul") {
+      start = preheaderValue("mul", basis.init, derived.factor, type,
+                             dest + ".start");
+      increment = preheaderValue("mul", basis.step, derived.factor, type,
+                                 dest + ".step");
+      op = basis.decrement ? "sub" : "add";
+    } else {
+      start = preheaderValue("ptradd", derived.factor, basis.init, type,
+                             dest + ".start");
+      increment = basis.step;
+      if (basis.decrement) {
+        nl::json zero = {{"dest", FreshName(func, dest + ".zero")},
+                         {"op", "const"},
+                         {"type", "int"},
+                         {"value", 0}};
+        setup.push_back(
+            insert(loop.preheader, BeforeTerminator(loop.preheader), zero));
+        increment = preheaderValue("sub", zero["dest"], basis.step, "int",
+                                   dest + ".step");
+      }
+      op = "ptradd";
+    }
+
+    std::string phi_dest = FreshName(func, dest + ".iv");
+    nl::json phi = {{"dest", phi_dest}, {"op", "phi"}, {"type", type}};
+    Instruction *recurrence =
+        insert(loop.header, loop.header->instrs.begin(), phi);
+    std::string next_dest = FreshName(func, phi_dest + ".next");
+    BasicBlock *step_block = basis.next->parent;
+    auto after = std::next(std::find(step_block->instrs.begin(),
+                                     step_block->instrs.end(), basis.next));
+    insert(step_block, after,
+           {{"dest", next_dest},
+            {"op", op},
+            {"type", type},
+            {"args", {phi_dest, increment}}});
+    recurrence->instr["args"] = {start, next_dest};
+    recurrence->instr["labels"] = {loop.preheader->name,
+                                   loop.latches[0]->name};
+
+    replace(instr, derived.of_next ? next_dest : phi_dest);
+  }
+
+  // Two induction variables that start at the same value and move by the
+  // same step are the same; keep the one whose step runs first.
+  void mergeDuplicates(const InductionInfo &info) {
+    std::vector<bool> gone(info.basic.size());
+    for (size_t i = 0; i < info.basic.size(); ++i) {
+      for (size_t j = 0; j < info.basic.size(); ++j) {
+        const InductionVariable &a = info.basic[i], &b = info.basic[j];
+        if (i == j || gone[i] || gone[j]) continue;
+        if (a.phi->instr["type"] != b.phi->instr["type"] ||
+            a.decrement != b.decrement || !sameValue(a.init, b.init) ||
+            !sameValue(a.step, b.step) || !dominates(a.next, b.next)) {
+          continue;
+        }
+        replace(b.phi, a.phi->GetDest());
+        replace(b.next, a.next->GetDest());
+        gone[j] = true;
+      }
+    }
+  }
+
+  // Induction variables only used to compute themselves.
+  void removeDead(const InductionInfo &info) {
+    std::unordered_map<std::string, int> uses = countUses();
+    for (const InductionVariable &iv : info.basic) {
+      if (uses[iv.phi->GetDest()] == 1 && uses[iv.next->GetDest()] == 1) {
+        std::erase(iv.phi->parent->instrs, iv.phi);
+        std::erase(iv.next->parent->instrs, iv.next);
+      }
+    }
+    // Later setup can use earlier setup, so go backwards.
+    uses = countUses();
+    for (auto it = setup.rbegin(); it != setup.rend(); ++it) {
+      Instruction *instr = *it;
+      if (uses[instr->GetDest()] > 0) continue;
+      if (instr->hasArgs()) {
+        for (const std::string &arg : instr->GetArgs()) --uses[arg];
+      }
+      std::erase(instr->parent->instrs, instr);
+    }
+  }
+
+  // A multiply is always worth trading for an add. A ptradd only is if
+  // that leaves its basis without uses: the new recurrence replaces it.
+  void run() {
+    while (true) {
+      InductionInfo info = FindInductionVariables(func, loop);
+      std::unordered_map<std::string, int> uses = countUses();
+      for (const DerivedInductionVariable &derived : info.derived) {
+        if (derived.instr->getOp() != "ptradd") continue;
+        const InductionVariable &basis = *derived.basis;
+        --uses[derived.of_next ? basis.next->GetDest()
+                               : basis.phi->GetDest()];
+      }
+      bool changed = false;
+      for (const DerivedInductionVariable &derived : info.derived) {
+        const InductionVariable &basis = *derived.basis;
+        if (derived.instr->getOp() == "ptradd" &&
+            (uses[basis.phi->GetDest()] > 1 ||
+             uses[basis.next->GetDest()] > 1)) {
+          continue;
+        }
+        reduce(derived);
+        changed = true;
+      }
+      if (!changed) break;
+    }
+    mergeDuplicates(FindInductionVariables(func, loop));
+    removeDead(FindInductionVariables(func, loop));
+  }
+};
+
+}  // namespace
+
+void lsr(Context *ctx, Function &func) {
+  MemScope scope("lsr");
+  AnalysisCache analyses(func);
+  LoopInfo &info = analyses.GetLoopInfo();
+  // Innermost loops first: what they compute in their preheaders may be
+  // derived from the induction variables of the loops around them.
+  for (auto it = info.loops.rbegin(); it != info.loops.rend(); ++it) {
+    LSR(ctx, func, analyses.GetDomInfo(), **it).run();
+  }
+  func.all_instrs.clear();
+}
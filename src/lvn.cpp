@@ -0,0 +1,247 @@
+#include <algorithm>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "basic_block.h"
+#include "fold.h"
+#include "function.h"
+#include "instruction.h"
+#include "mem_stats.h"
+#include "transform.h"
+
+static bool isPure(const std::string &op) {
+  static const std::unordered_set<std::string> kPure = {
+      "const", "add", "sub",  "mul",  "div", "eq",  "lt",       "gt",
+      "le",    "ge",  "not",  "and",  "or",  "fadd", "fsub",    "fmul",
+      "fdiv",  "feq", "flt",  "fgt",  "fle", "fge",  "ceq",     "clt",
+      "cgt",   "cle", "cge",  "ptradd", "char2int",  "int2char"};
+  return kPure.count(op);
+}
+
+static bool isCommutative(const std::string &op) {
+  return op == "add" || op == "mul" || op == "eq" || op == "and" ||
+         op == "or" || op == "fadd" || op == "fmul" || op == "feq" ||
+         op == "ceq";
+}
+
+namespace {
+
+// The operands of an instruction: their value number, and their constant,
+// if known.
+struct Operand {
+  int num;
+  std::optional<nl::json> constant;
+};
+
+// What an instruction simplifies to, if anything: a copy of one of its
+// operands or a constant.
+struct Simplified {
+  int copy = -1;
+  std::optional<nl::json> constant;
+};
+
+bool isInt(const Operand &operand, int64_t value) {
+  return operand.constant && operand.constant->is_number_integer() &&
+         operand.constant->get<int64_t>() == value;
+}
+
+bool isBool(const Operand &operand, bool value) {
+  return operand.constant && operand.constant->is_boolean() &&
+         operand.constant->get<bool>() == value;
+}
+
+// Integer and boolean identities. Floats are left alone: x - x isn't 0 and
+// x * 0 isn't 0 when x is NaN or infinite.
+Simplified simplify(const std::string &op, const std::vector<Operand> &args) {
+  Simplified s;
+  if (args.size() != 2) return s;
+  const Operand &lhs = args[0], &rhs = args[1];
+  bool same = lhs.num == rhs.num;
+  if (op == "add") {
+    if (isInt(rhs, 0)) s.copy = 0;
+    if (isInt(lhs, 0)) s.copy = 1;
+  } else if (op == "sub") {
+    if (isInt(rhs, 0)) s.copy = 0;
+    if (same) s.constant = 0;
+  } else if (op == "mul") {
+    if (isInt(rhs, 1)) s.copy = 0;
+    if (isInt(lhs, 1)) s.copy = 1;
+    if (isInt(lhs, 0) || isInt(rhs, 0)) s.constant = 0;
+  } else if (op == "div") {
+    if (isInt(rhs, 1)) s.copy = 0;
+  } else if (op == "and") {
+    if (isBool(rhs, true) || same) s.copy = 0;
+    if (isBool(lhs, true)) s.copy = 1;
+    if (isBool(lhs, false) || isBool(rhs, false)) s.constant = false;
+  } else if (op == "or") {
+    if (isBool(rhs, false) || same) s.copy = 0;
+    if (isBool(lhs, false)) s.copy = 1;
+    if (isBool(lhs, true) || isBool(rhs, true)) s.constant = true;
+  } else if (same && (op == "eq" || op == "le" || op == "ge")) {
+    s.constant = true;
+  } else if (same && (op == "lt" || op == "gt")) {
+    s.constant = false;
+  }
+  if (s.constant) s.copy = -1;
+  return s;
+}
+
+struct LVN {
+  struct Value {
+    // The variables currently holding the value, oldest first.
+    std::vector<std::string> vars;
+    // Set if the value is a known int, bool or float constant.
+    std::optional<nl::json> constant;
+  };
+
+  std::vector<Value> values;
+  std::unordered_map<std::string, int> table;
+  std::unordered_map<std::string, int> var2num;
+
+  int fresh() {
+    values.emplace_back();
+    return values.size() - 1;
+  }
+
+  // The value number of `var`; variables defined before the block get a
+  // number of their own on first use.
+  int number(const std::string &var) {
+    auto [it, inserted] = var2num.emplace(var, 0);
+    if (inserted) {
+      it->second = fresh();
+      values[it->second].vars.push_back(var);
+    }
+    return it->second;
+  }
+
+  // `var` is being redefined, so it no longer holds its old value.
+  void kill(const std::string &var) {
+    auto it = var2num.find(var);
+    if (it == var2num.end()) return;
+    std::vector<std::string> &vars = values[it->second].vars;
+    vars.erase(std::find(vars.begin(), vars.end(), var));
+    var2num.erase(it);
+  }
+
+  void assign(const std::string &var, int num) {
+    kill(var);
+    var2num[var] = num;
+    values[num].vars.push_back(var);
+  }
+
+  void makeConst(Instruction *instr, const nl::json &value) {
+    instr->instr["op"] = "const";
+    instr->instr["value"] = value;
+    instr->instr.erase("args");
+    instr->instr.erase("funcs");
+    instr->instr.erase("labels");
+  }
+
+  void makeCopy(Instruction *instr, const std::string &var) {
+    instr->instr["op"] = "id";
+    instr->instr["args"] = {var};
+    instr->instr.erase("value");
+    instr->instr.erase("funcs");
+    instr->instr.erase("labels");
+  }
+
+  void run(BasicBlock *bb) {
+    for (Instruction *instr : bb->instrs) {
+      if (!instr->hasOp()) continue;
+      std::string op = instr->getOp();
+      // Phi arguments are uses at the end of the predecessors, which this
+      // block knows nothing about.
+      if (op == "phi") {
+        if (instr->hasDest()) kill(instr->GetDest());
+        continue;
+      }
+
+      std::vector<Operand> args;
+      if (instr->hasArgs()) {
+        for (nl::json &arg : instr->instr["args"]) {
+          int num = number(arg.get<std::string>());
+          const Value &value = values[num];
+          arg = value.vars.front();
+          args.push_back({num, value.constant});
+        }
+      }
+      if (!instr->hasDest()) continue;
+      std::string dest = instr->GetDest();
+
+      if (op == "id" && args.size() == 1) {
+        assign(dest, args[0].num);
+        continue;
+      }
+      if (!isPure(op)) {
+        kill(dest);
+        number(dest);
+        continue;
+      }
+
+      // Fold constants and apply identities first, so that the result is
+      // numbered as what it simplifies to.
+      std::optional<nl::json> constant;
+      if (op == "const") {
+        const nl::json &value = instr->instr["value"];
+        if (value.is_number() || value.is_boolean()) constant = value;
+      } else {
+        bool all_const = !args.empty();
+        std::vector<nl::json> operands;
+        for (const Operand &arg : args) {
+          all_const &= arg.constant.has_value();
+          if (arg.constant) operands.push_back(*arg.constant);
+        }
+        if (all_const) constant = FoldConstant(op, operands);
+        if (!constant) {
+          Simplified s = simplify(op, args);
+          if (s.copy >= 0) {
+            int num = args[s.copy].num;
+            makeCopy(instr, instr->GetArgs()[s.copy]);
+            assign(dest, num);
+            continue;
+          }
+          constant = s.constant;
+        }
+        if (constant) makeConst(instr, *constant);
+      }
+
+      std::string key;
+      if (constant) {
+        key = "const " + instr->instr.value("type", nl::json()).dump() +
+              " " + constant->dump();
+      } else {
+        std::vector<int> nums;
+        for (const Operand &arg : args) nums.push_back(arg.num);
+        if (isCommutative(op)) std::sort(nums.begin(), nums.end());
+        key = op + " " + instr->instr.value("type", nl::json()).dump();
+        if (op == "const") key += " " + instr->instr["value"].dump();
+        for (int num : nums) key += " " + std::to_string(num);
+      }
+
+      auto [it, inserted] = table.emplace(key, 0);
+      if (inserted) {
+        it->second = fresh();
+        values[it->second].constant = constant;
+      }
+      int num = it->second;
+      // Constants stay constants; anything else becomes a copy of a
+      // variable still holding the value, if there is one.
+      const std::vector<std::string> &holders = values[num].vars;
+      if (!constant && !holders.empty() && holders.front() != dest) {
+        makeCopy(instr, holders.front());
+      }
+      assign(dest, num);
+    }
+  }
+};
+
+}  // namespace
+
+void lvn(Function &func) {
+  MemScope scope("lvn");
+  for (BasicBlock *bb : func.basic_blocks) LVN().run(bb);
+}
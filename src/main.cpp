@@ -2,50 +2,107 @@
 #include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <stdexcept>
+#include <string>
 
-#include "basic_block.h"
-#include "cfg.h"
-#include "context.h"
-#include "dom.h"
-#include "function.h"
-#include "instruction.h"
-#include "ssa.h"
-#include "transform.h"
+#include "driver.h"
+#include "mem_stats.h"
 
 void usage() {
   std::cout << "Usage:\n";
-  std::cout << "$ cat test.bril | bril2json | brandy\n";
-  std::cout << "$ brandy test.json\n";
+  std::cout << "$ cat test.bril | bril2json | brandy [options]\n";
+  std::cout << "$ brandy [options] test.json [-- args...]\n";
+  std::cout << "Options:\n";
+  std::cout << "  -O0          Don't convert to SSA or optimize\n";
+  std::cout << "  -O1          Only run local value numbering\n";
+  std::cout << "  -O2          Convert to SSA and optimize (default)\n";
+  std::cout << "  --unroll=N   Partially unroll loops N times (default 4)\n";
+  std::cout << "  --jobs=N     Optimize on N threads (default one per core)\n";
+  std::cout << "  --interp     Run @main with the built-in interpreter\n";
+  std::cout << "  --vm         Run @main on the bytecode VM\n";
+  std::cout << "  --tiered     Interpret @main, optimizing hot functions\n";
+  std::cout << "  --jit        Run @main as native x86-64 code\n";
+  std::cout << "  --emit-c     Print the program as C\n";
+  std::cout << "  --print-loops\n";
+  std::cout << "               Print the loop nest of every function\n";
+  std::cout << "  --print-scev\n";
+  std::cout << "               Print loop trip counts and recurrences\n";
+  std::cout << "  --profile    Print dynamic instruction counts to stderr\n";
+  std::cout << "               (opcode pairs with --vm)\n";
   exit(-1);
 }
 
 int main(int argc, char** argv) {
   nl::json ir;
-  if (argc > 2) usage();
+  DriverOptions options;
+  std::string file;
 
-  if (argc == 1) {
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "--") {
+      options.args.assign(argv + i + 1, argv + argc);
+      break;
+    } else if (arg == "-O0") {
+      options.opt_level = 0;
+    } else if (arg == "-O1") {
+      options.opt_level = 1;
+    } else if (arg == "-O2") {
+      options.opt_level = 2;
+    } else if (arg.starts_with("--unroll=")) {
+      try {
+        options.unroll_factor = std::stoi(arg.substr(9));
+      } catch (const std::exception&) {
+        usage();
+      }
+      if (options.unroll_factor < 1) usage();
+    } else if (arg.starts_with("--jobs=")) {
+      try {
+        options.jobs = std::stoi(arg.substr(7));
+      } catch (const std::exception&) {
+        usage();
+      }
+      if (options.jobs < 1) usage();
+    } else if (arg == "--interp") {
+      options.action = DriverOptions::Action::Interpret;
+    } else if (arg == "--vm") {
+      options.action = DriverOptions::Action::RunVM;
+    } else if (arg == "--tiered") {
+      options.action = DriverOptions::Action::RunTiered;
+    } else if (arg == "--jit") {
+      options.action = DriverOptions::Action::RunJIT;
+    } else if (arg == "--emit-c") {
+      options.action = DriverOptions::Action::EmitC;
+    } else if (arg == "--print-loops") {
+      options.action = DriverOptions::Action::PrintLoops;
+    } else if (arg == "--print-scev") {
+      options.action = DriverOptions::Action::PrintScev;
+    } else if (arg == "--profile") {
+      options.profile = true;
+    } else if (arg.starts_with("-") || !file.empty()) {
+      usage();
+    } else {
+      file = arg;
+    }
+  }
+
+  if (file.empty()) {
+    MemScope scope("parse");
     ir = nl::json::parse(std::cin);
   } else {
-    std::string file = argv[1];
-    if (file.empty() || !std::filesystem::exists(file)) {
+    if (!std::filesystem::exists(file)) {
       std::cout << "Error: Invalid input\n";
       usage();
     }
+    MemScope scope("parse");
     std::ifstream f(file);
     ir = nl::json::parse(f);
   }
 
-  Context ctx;
-
-  for (const nl::json& input : ir["functions"]) {
-    Function* function = Function::Create(&ctx, input);
-    CFG cfg = BuildCFG(*function);
-    DomInfo dom = ComputeDomInfo(cfg);
-    ToSSA(&ctx, *function, cfg, dom);
-    Optimize(*function);
-
-    nl::json prog;
-    prog["functions"].push_back(function->ToJson());
-    std::cout << prog << "\n";
+  try {
+    CompileProgram(ir, std::cout, options);
+  } catch (const std::runtime_error& e) {
+    std::cout.flush();
+    std::cerr << "error: " << e.what() << "\n";
+    return 2;
   }
 }
@@ -0,0 +1,167 @@
+#include "mem_stats.h"
+
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <new>
+
+namespace {
+
+constexpr int kMaxPhases = 64;
+
+struct PhaseStats {
+  const char* name = nullptr;
+  std::atomic<uint64_t> allocs{0};
+  std::atomic<uint64_t> bytes{0};
+  std::atomic<int64_t> live{0};
+  std::atomic<int64_t> peak_live{0};
+};
+
+// Fixed-size storage so that bookkeeping never allocates itself. Slot 0
+// collects everything that happens outside of any MemScope.
+PhaseStats phases[kMaxPhases];
+std::atomic<int> num_phases{1};
+std::mutex register_mutex;
+
+thread_local int current_phase = 0;
+
+// Stored right in front of every block we hand out.
+struct alignas(alignof(std::max_align_t)) Header {
+  void* base;
+  size_t size;
+  int phase;
+};
+
+int registerPhase(const char* name) {
+  std::lock_guard<std::mutex> lock(register_mutex);
+  int n = num_phases.load(std::memory_order_relaxed);
+  for (int i = 1; i < n; ++i) {
+    if (std::strcmp(phases[i].name, name) == 0) return i;
+  }
+  if (n == kMaxPhases) return 0;
+  phases[n].name = name;
+  num_phases.store(n + 1, std::memory_order_release);
+  return n;
+}
+
+void* allocate(size_t size, size_t align) {
+  align = std::max(align, alignof(Header));
+  size_t offset = (sizeof(Header) + align - 1) / align * align;
+  size_t total = offset + size;
+
+  void* base =
+      align <= alignof(std::max_align_t)
+          ? std::malloc(total)
+          : std::aligned_alloc(align, (total + align - 1) / align * align);
+  if (!base) return nullptr;
+
+  char* user = static_cast<char*>(base) + offset;
+  Header* header = reinterpret_cast<Header*>(user) - 1;
+  header->base = base;
+  header->size = size;
+  header->phase = current_phase;
+
+  PhaseStats& stats = phases[header->phase];
+  stats.allocs.fetch_add(1, std::memory_order_relaxed);
+  stats.bytes.fetch_add(size, std::memory_order_relaxed);
+  int64_t live = stats.live.fetch_add(size, std::memory_order_relaxed) + size;
+  int64_t peak = stats.peak_live.load(std::memory_order_relaxed);
+  while (live > peak && !stats.peak_live.compare_exchange_weak(
+                            peak, live, std::memory_order_relaxed)) {
+  }
+  return user;
+}
+
+void deallocate(void* ptr) {
+  if (!ptr) return;
+  Header* header = static_cast<Header*>(ptr) - 1;
+  phases[header->phase].live.fetch_sub(header->size,
+                                       std::memory_order_relaxed);
+  std::free(header->base);
+}
+
+void* allocateOrThrow(size_t size, size_t align) {
+  if (void* ptr = allocate(size, align)) return ptr;
+  throw std::bad_alloc();
+}
+
+struct Reporter {
+  Reporter() { phases[0].name = "<other>"; }
+
+  ~Reporter() {
+    std::fprintf(stderr, "%-20s %12s %14s %14s %14s\n", "Phase", "Allocs",
+                 "Bytes", "Live", "Peak live");
+    int n = num_phases.load(std::memory_order_acquire);
+    for (int i = 0; i < n; ++i) {
+      const PhaseStats& stats = phases[i];
+      std::fprintf(stderr, "%-20s %12llu %14llu %14lld %14lld\n", stats.name,
+                   static_cast<unsigned long long>(stats.allocs.load()),
+                   static_cast<unsigned long long>(stats.bytes.load()),
+                   static_cast<long long>(stats.live.load()),
+                   static_cast<long long>(stats.peak_live.load()));
+    }
+
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+      // ru_maxrss is reported in kilobytes on Linux.
+      std::fprintf(stderr, "Peak RSS: %ld KB\n", usage.ru_maxrss);
+    }
+  }
+};
+
+Reporter reporter;
+
+}  // namespace
+
+MemScope::MemScope(const char* phase) : prev(current_phase) {
+  current_phase = registerPhase(phase);
+}
+
+MemScope::~MemScope() { current_phase = prev; }
+
+void* operator new(size_t size) {
+  return allocateOrThrow(size, __STDCPP_DEFAULT_NEW_ALIGNMENT__);
+}
+void* operator new[](size_t size) {
+  return allocateOrThrow(size, __STDCPP_DEFAULT_NEW_ALIGNMENT__);
+}
+void* operator new(size_t size, std::align_val_t align) {
+  return allocateOrThrow(size, static_cast<size_t>(align));
+}
+void* operator new[](size_t size, std::align_val_t align) {
+  return allocateOrThrow(size, static_cast<size_t>(align));
+}
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+  return allocate(size, __STDCPP_DEFAULT_NEW_ALIGNMENT__);
+}
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+  return allocate(size, __STDCPP_DEFAULT_NEW_ALIGNMENT__);
+}
+
+void operator delete(void* ptr) noexcept { deallocate(ptr); }
+void operator delete[](void* ptr) noexcept { deallocate(ptr); }
+void operator delete(void* ptr, size_t) noexcept { deallocate(ptr); }
+void operator delete[](void* ptr, size_t) noexcept { deallocate(ptr); }
+void operator delete(void* ptr, std::align_val_t) noexcept { deallocate(ptr); }
+void operator delete[](void* ptr, std::align_val_t) noexcept {
+  deallocate(ptr);
+}
+void operator delete(void* ptr, size_t, std::align_val_t) noexcept {
+  deallocate(ptr);
+}
+void operator delete[](void* ptr, size_t, std::align_val_t) noexcept {
+  deallocate(ptr);
+}
+void operator delete(void* ptr, const std::nothrow_t&) noexcept {
+  deallocate(ptr);
+}
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept {
+  deallocate(ptr);
+}
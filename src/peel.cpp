@@ -0,0 +1,398 @@
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "basic_block.h"
+#include "cfg.h"
+#include "context.h"
+#include "dom.h"
+#include "function.h"
+#include "instruction.h"
+#include "loop.h"
+#include "loop_utils.h"
+#include "mem_stats.h"
+#include "transform.h"
+
+// A loop is copied whole to peel an iteration off it, so only loops of up
+// to this many instructions are.
+static constexpr int64_t kPeelLoopBudget = 100;
+// Instructions peeling may add to a function in all.
+static constexpr int64_t kPeelFunctionBudget = 400;
+// Iterations peeled off a loop at most: enough for a flag that is set from
+// another flag, which is set on the first iteration.
+static constexpr int kMaxPeeledIterations = 2;
+
+static bool isPhi(Instruction *instr) {
+  return instr->hasOp() && instr->getOp() == "phi";
+}
+
+// Ops whose result only depends on their operands, which a branch can be
+// decided through once they are.
+static bool isPure(const std::string &op) {
+  static const std::unordered_set<std::string> kImpure = {
+      "phi",  "print", "store", "free", "call", "alloc",
+      "load", "br",    "jmp",   "ret",  "nop"};
+  return !kImpure.contains(op);
+}
+
+namespace {
+
+struct Peeler {
+  Context *ctx;
+  Function &func;
+  CFG &cfg;
+  DomInfo &dom;
+  Loop &loop;
+
+  // The instruction defining every SSA name but the arguments.
+  std::unordered_map<std::string, Instruction *> defs;
+  // Every name in the function, to keep the copy's names apart.
+  std::unordered_set<std::string> used;
+  // The header's phis, with the values they take on entry and from the
+  // latch.
+  std::unordered_map<std::string, std::string> init, back;
+  // The copy of every block and value of the loop.
+  std::unordered_map<BasicBlock *, BasicBlock *> blocks;
+  std::unordered_map<std::string, std::string> values;
+  // New blocks, in the order they go in after the preheader.
+  std::vector<BasicBlock *> created;
+
+  Peeler(Context *ctx, Function &func, CFG &cfg, DomInfo &dom, Loop &loop)
+      : ctx(ctx), func(func), cfg(cfg), dom(dom), loop(loop) {
+    used.insert(func.args.begin(), func.args.end());
+    for (BasicBlock *bb : func.basic_blocks) {
+      used.insert(bb->name);
+      for (Instruction *instr : bb->instrs) {
+        if (!instr->hasDest()) continue;
+        used.insert(instr->GetDest());
+        defs[instr->GetDest()] = instr;
+      }
+    }
+  }
+
+  std::string fresh(const std::string &base) {
+    std::string name = base;
+    for (int i = 1; used.contains(name); ++i) {
+      name = base + "." + std::to_string(i);
+    }
+    used.insert(name);
+    return name;
+  }
+
+  BasicBlock *createBlock(const std::string &base) {
+    BasicBlock *bb = ctx->CreateBasicBlock();
+    bb->name = fresh(base);
+    func.block_map[bb->name] = bb;
+    created.push_back(bb);
+    return bb;
+  }
+
+  void append(BasicBlock *bb, nl::json instr) {
+    bb->instrs.push_back(ctx->CreateInstruction(std::move(instr), bb));
+  }
+
+  bool definedInLoop(const std::string &var) {
+    auto it = defs.find(var);
+    return it != defs.end() && loop.Contains(it->second->parent);
+  }
+
+  bool dominates(BasicBlock *a, BasicBlock *b) {
+    const std::vector<BasicBlock *> &doms = dom.dom[b];
+    return std::find(doms.begin(), doms.end(), a) != doms.end();
+  }
+
+  // Whether `var` is the same on every iteration. Constants in the loop
+  // are, and move to the preheader when it's peeled.
+  bool invariant(const std::string &var) {
+    return !definedInLoop(var) || defs[var]->getOp() == "const";
+  }
+
+  std::string value(const std::string &var) const {
+    auto it = values.find(var);
+    return it == values.end() ? var : it->second;
+  }
+
+  // Jumps of the copy to the header enter the loop, the rest stay in the
+  // copy. Phis of the copy name the copy of the header.
+  std::string label(const std::string &name, bool is_jump) {
+    BasicBlock *bb = func.GetBasicBlock(name);
+    if (!loop.Contains(bb) || (is_jump && bb == loop.header)) return name;
+    return blocks.at(bb)->name;
+  }
+
+  // How many iterations it takes a phi of the header to stop changing: one
+  // if it takes an invariant value from the latch, like a flag set to false
+  // at the end of the body, one more than the phi it takes otherwise, and 0
+  // if it never does.
+  int settle(const std::string &var, int depth = 0) {
+    if (depth == kMaxPeeledIterations || !back.contains(var)) return 0;
+    const std::string &next = back[var];
+    if (next == var) return 0;
+    if (invariant(next)) return 1;
+    int rest = settle(next, depth + 1);
+    return rest ? rest + 1 : 0;
+  }
+
+  // The fewest iterations to peel for a branch of the loop on flags of the
+  // header to always go the same way in what is left of the loop, or 0.
+  int iterations() {
+    int best = 0;
+    for (BasicBlock *bb : loop.blocks) {
+      if (bb->instrs.empty() || bb->instrs.back()->getOp() != "br") continue;
+      std::unordered_set<std::string> seen;
+      std::vector<std::string> worklist = {bb->instrs.back()->GetArgs()[0]};
+      int needed = 0;
+      bool decided = true;
+      while (decided && !worklist.empty()) {
+        std::string var = worklist.back();
+        worklist.pop_back();
+        if (!seen.insert(var).second || !definedInLoop(var)) continue;
+        Instruction *def = defs[var];
+        if (init.contains(var)) {
+          int n = settle(var);
+          decided = n > 0;
+          needed = std::max(needed, n);
+        } else if (!isPure(def->getOp())) {
+          decided = false;
+        } else if (def->hasArgs()) {
+          for (const std::string &arg : def->GetArgs()) {
+            worklist.push_back(arg);
+          }
+        }
+      }
+      if (decided && needed && (!best || needed < best)) best = needed;
+    }
+    return best;
+  }
+
+  // Copy the blocks of the loop, with the header's phis replaced by the
+  // values they take on entry.
+  void clone() {
+    for (BasicBlock *bb : loop.blocks) {
+      blocks[bb] = createBlock(bb->name + ".peel");
+      for (Instruction *instr : bb->instrs) {
+        if (!instr->hasDest()) continue;
+        values[instr->GetDest()] = fresh(instr->GetDest());
+      }
+    }
+    for (const auto &[phi, arg] : init) values[phi] = arg;
+    for (BasicBlock *bb : loop.blocks) {
+      BasicBlock *copy = blocks[bb];
+      for (Instruction *instr : bb->instrs) {
+        if (bb == loop.header && isPhi(instr)) continue;
+        nl::json json = instr->instr;
+        if (json.contains("dest")) json["dest"] = value(json["dest"]);
+        if (json.contains("args")) {
+          for (nl::json &arg : json["args"]) arg = value(arg);
+        }
+        if (json.contains("labels")) {
+          for (nl::json &name : json["labels"]) {
+            name = label(name, !isPhi(instr));
+          }
+        }
+        append(copy, std::move(json));
+      }
+      // The copy is laid out apart from the loop, so it can't fall through.
+      if (FallsThrough(bb)) {
+        append(copy, {{"op", "jmp"},
+                      {"labels", nl::json::array({label(
+                                     cfg.successors[bb][0]->name, true)})}});
+      }
+    }
+  }
+
+  // Peels one iteration off the loop if that gets a branch closer to going
+  // the same way every time, and no more than `allowed` iterations would
+  // have to be. Counts the iteration off `allowed`.
+  bool run(int &allowed, int64_t &budget) {
+    BasicBlock *header = loop.header, *preheader = loop.preheader;
+    if (!preheader || loop.latches.size() != 1) return false;
+    BasicBlock *latch = loop.latches[0];
+    for (Instruction *phi : header->instrs) {
+      if (!isPhi(phi)) break;
+      std::vector<std::string> args = phi->GetArgs();
+      std::vector<std::string> labels = phi->GetLabels();
+      for (int i = 0; i < args.size(); ++i) {
+        if (labels[i] == preheader->name) init[phi->GetDest()] = args[i];
+        if (labels[i] == latch->name) back[phi->GetDest()] = args[i];
+      }
+      if (args.size() != 2 || !init.contains(phi->GetDest()) ||
+          !back.contains(phi->GetDest()) || args[0] == "__undef" ||
+          args[1] == "__undef") {
+        return false;
+      }
+    }
+    int64_t size = 0;
+    for (BasicBlock *bb : loop.blocks) size += bb->instrs.size();
+    if (size > kPeelLoopBudget || size > budget) return false;
+    int needed = iterations();
+    if (!needed || needed > allowed) return false;
+
+    // Values of the loop used after it, other than by the phis of the exit
+    // blocks, have to merge the copy's and the loop's in the exit. That
+    // takes a single exit only reached from the loop, which they dominate.
+    std::unordered_set<std::string> escaping;
+    for (BasicBlock *bb : func.basic_blocks) {
+      if (loop.Contains(bb)) continue;
+      for (Instruction *instr : bb->instrs) {
+        if (!instr->hasArgs()) continue;
+        std::vector<std::string> args = instr->GetArgs();
+        for (int i = 0; i < args.size(); ++i) {
+          if (!definedInLoop(args[i])) continue;
+          if (isPhi(instr) &&
+              loop.Contains(func.GetBasicBlock(instr->GetLabels()[i]))) {
+            continue;
+          }
+          escaping.insert(args[i]);
+        }
+      }
+    }
+    BasicBlock *exit = nullptr;
+    if (!escaping.empty()) {
+      if (loop.exits.size() != 1) return false;
+      exit = loop.exits[0];
+      for (BasicBlock *pred : cfg.predecessors[exit]) {
+        if (!loop.Contains(pred)) return false;
+        for (const std::string &var : escaping) {
+          if (!dominates(defs[var]->parent, pred)) return false;
+        }
+      }
+    }
+
+    for (const auto &[phi, var] : back) {
+      Instruction *def = definedInLoop(var) ? defs[var] : nullptr;
+      if (!def || def->getOp() != "const") continue;
+      std::erase(def->parent->instrs, def);
+      preheader->instrs.insert(BeforeTerminator(preheader), def);
+      def->parent = preheader;
+    }
+    clone();
+    BasicBlock *first = blocks[header];
+    if (FallsThrough(preheader)) {
+      append(preheader,
+             {{"op", "jmp"}, {"labels", nl::json::array({first->name})}});
+    } else {
+      for (nl::json &name : preheader->instrs.back()->instr["labels"]) {
+        if (name == header->name) name = first->name;
+      }
+    }
+    // The loop is entered from the end of the copy, with the values of the
+    // first iteration.
+    for (Instruction *phi : header->instrs) {
+      if (!isPhi(phi)) break;
+      std::string dest = phi->GetDest();
+      phi->instr["args"] = {value(back[dest]), back[dest]};
+      phi->instr["labels"] = {blocks[latch]->name, latch->name};
+    }
+
+    // The exits are reached from the copy now.
+    for (BasicBlock *bb : loop.exits) {
+      for (Instruction *phi : bb->instrs) {
+        if (!isPhi(phi)) break;
+        std::vector<std::string> args = phi->GetArgs();
+        std::vector<std::string> labels = phi->GetLabels();
+        for (int i = 0; i < args.size(); ++i) {
+          BasicBlock *pred = func.GetBasicBlock(labels[i]);
+          if (!loop.Contains(pred)) continue;
+          phi->instr["args"].push_back(value(args[i]));
+          phi->instr["labels"].push_back(blocks[pred]->name);
+        }
+      }
+    }
+    if (exit) {
+      std::unordered_map<std::string, std::string> merged;
+      auto pos = std::find_if_not(exit->instrs.begin(), exit->instrs.end(),
+                                  isPhi);
+      for (const std::string &var : escaping) {
+        nl::json args = nl::json::array(), labels = nl::json::array();
+        for (BasicBlock *pred : cfg.predecessors[exit]) {
+          args.push_back(var);
+          labels.push_back(pred->name);
+          args.push_back(value(var));
+          labels.push_back(blocks[pred]->name);
+        }
+        merged[var] = fresh(var + ".merged");
+        nl::json phi = {{"dest", merged[var]},
+                        {"op", "phi"},
+                        {"type", defs[var]->instr["type"]},
+                        {"args", std::move(args)},
+                        {"labels", std::move(labels)}};
+        pos = std::next(exit->instrs.insert(
+            pos, ctx->CreateInstruction(std::move(phi), exit)));
+      }
+      for (BasicBlock *bb : func.basic_blocks) {
+        if (loop.Contains(bb)) continue;
+        for (Instruction *instr : bb->instrs) {
+          if (!instr->hasArgs() || (bb == exit && isPhi(instr))) continue;
+          for (nl::json &arg : instr->instr["args"]) {
+            if (auto it = merged.find(arg); it != merged.end()) {
+              arg = it->second;
+            }
+          }
+        }
+      }
+    }
+
+    // A flag that settled takes the same value both ways into the header
+    // now, so it's that value.
+    std::unordered_map<std::string, std::string> settled;
+    std::erase_if(header->instrs, [&](Instruction *phi) {
+      if (!isPhi(phi)) return false;
+      std::string dest = phi->GetDest();
+      if (value(back[dest]) != back[dest]) return false;
+      settled[dest] = back[dest];
+      return true;
+    });
+    for (BasicBlock *bb : func.basic_blocks) {
+      for (Instruction *instr : bb->instrs) {
+        if (!instr->hasArgs()) continue;
+        for (nl::json &arg : instr->instr["args"]) {
+          if (auto it = settled.find(arg); it != settled.end()) {
+            arg = it->second;
+          }
+        }
+      }
+    }
+
+    auto pos = std::find(func.basic_blocks.begin(), func.basic_blocks.end(),
+                         preheader);
+    func.basic_blocks.insert(std::next(pos), created.begin(), created.end());
+    budget -= size;
+    allowed = needed - 1;
+    return true;
+  }
+};
+
+}  // namespace
+
+void peel(Context *ctx, Function &func) {
+  MemScope scope("peel");
+  AnalysisCache analyses(func);
+  int64_t budget = kPeelFunctionBudget;
+  // Iterations each loop, by header, may still have peeled off.
+  std::unordered_map<std::string, int> allowed;
+  bool changed = false, peeled = true;
+  while (peeled) {
+    peeled = false;
+    LoopInfo &info = analyses.GetLoopInfo();
+    for (const auto &loop : info.loops) {
+      int &left = allowed.try_emplace(loop->header->name,
+                                      kMaxPeeledIterations).first->second;
+      if (left == 0) continue;
+      Peeler peeler(ctx, func, analyses.GetCFG(), analyses.GetDomInfo(),
+                    *loop);
+      if (!peeler.run(left, budget)) continue;
+      for (BasicBlock *bb : peeler.created) allowed[bb->name] = 0;
+      changed = peeled = true;
+      break;
+    }
+    analyses.Invalidate();
+  }
+  func.all_instrs.clear();
+  // The flags are constant in what is left of the loops and in the copies,
+  // so their branches fold.
+  if (changed) sccp(func);
+}
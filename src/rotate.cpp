@@ -0,0 +1,326 @@
+#include <algorithm>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "basic_block.h"
+#include "cfg.h"
+#include "context.h"
+#include "dom.h"
+#include "function.h"
+#include "instruction.h"
+#include "loop.h"
+#include "loop_utils.h"
+#include "mem_stats.h"
+#include "transform.h"
+
+// The header is copied into the guard, so only headers of up to this many
+// instructions, phis aside, are.
+static constexpr int kRotateHeaderBudget = 16;
+
+static bool isPhi(Instruction *instr) {
+  return instr->hasOp() && instr->getOp() == "phi";
+}
+
+// Ops whose result only depends on their operands. Trapping ones are fine:
+// the header runs whenever the preheader does.
+static bool isPure(const std::string &op) {
+  static const std::unordered_set<std::string> kImpure = {
+      "phi",  "print", "store", "free", "call", "alloc",
+      "load", "br",    "jmp",   "ret",  "nop"};
+  return !kImpure.contains(op);
+}
+
+namespace {
+
+struct Rotator {
+  Context *ctx;
+  Function &func;
+  CFG &cfg;
+  DomInfo &dom;
+  Loop &loop;
+
+  // Every name in the function, to keep the guard's names apart.
+  std::unordered_set<std::string> used;
+
+  Rotator(Context *ctx, Function &func, CFG &cfg, DomInfo &dom, Loop &loop)
+      : ctx(ctx), func(func), cfg(cfg), dom(dom), loop(loop) {
+    used.insert(func.args.begin(), func.args.end());
+    for (BasicBlock *bb : func.basic_blocks) {
+      used.insert(bb->name);
+      for (Instruction *instr : bb->instrs) {
+        if (instr->hasDest()) used.insert(instr->GetDest());
+      }
+    }
+  }
+
+  std::string fresh(const std::string &base) {
+    std::string name = base;
+    for (int i = 1; used.contains(name); ++i) {
+      name = base + "." + std::to_string(i);
+    }
+    used.insert(name);
+    return name;
+  }
+
+  bool dominates(BasicBlock *a, BasicBlock *b) {
+    const std::vector<BasicBlock *> &doms = dom.dom[b];
+    return std::find(doms.begin(), doms.end(), a) != doms.end();
+  }
+
+  bool onlyPred(BasicBlock *bb, BasicBlock *pred) {
+    const std::vector<BasicBlock *> &preds = cfg.predecessors[bb];
+    return preds.size() == 1 && preds[0] == pred;
+  }
+
+  // Move what the header computes from values defined outside the loop,
+  // like its constants, into the preheader, so the guard and the loop share
+  // it instead of merging two copies. Loads go too when nothing in the loop
+  // writes memory.
+  void hoistInvariants() {
+    std::unordered_set<std::string> in_loop;
+    bool writes = false;
+    for (BasicBlock *bb : loop.blocks) {
+      for (Instruction *instr : bb->instrs) {
+        if (instr->hasDest()) in_loop.insert(instr->GetDest());
+        if (!instr->hasOp()) continue;
+        const std::string &op = instr->getOp();
+        writes |= op == "store" || op == "free" || op == "call";
+      }
+    }
+    BasicBlock *header = loop.header, *preheader = loop.preheader;
+    std::erase_if(header->instrs, [&](Instruction *instr) {
+      if (!instr->hasDest()) return false;
+      const std::string &op = instr->getOp();
+      if (!isPure(op) && (op != "load" || writes)) return false;
+      if (instr->hasArgs()) {
+        for (const std::string &arg : instr->GetArgs()) {
+          if (in_loop.contains(arg)) return false;
+        }
+      }
+      in_loop.erase(instr->GetDest());
+      preheader->instrs.insert(BeforeTerminator(preheader), instr);
+      instr->parent = preheader;
+      return true;
+    });
+  }
+
+  // Turns
+  //
+  //   preheader -> header: test; br body exit
+  //   body ... latch: jmp header
+  //
+  // into
+  //
+  //   preheader: test; br entry exit
+  //   entry: jmp body
+  //   body ... latch: jmp header
+  //   header: test; br body exit
+  //
+  // The header, now only reached from the latch, merges into it later. The
+  // values it defines merge at the top of the body, the new header, and in
+  // the exit.
+  bool run() {
+    BasicBlock *header = loop.header, *preheader = loop.preheader;
+    if (!preheader || loop.latches.size() != 1) return false;
+    BasicBlock *latch = loop.latches[0];
+    if (latch == header || latch->instrs.empty() ||
+        latch->instrs.back()->getOp() != "jmp") {
+      return false;
+    }
+    Instruction *branch = header->instrs.empty() ? nullptr
+                                                 : header->instrs.back();
+    if (!branch || branch->getOp() != "br") return false;
+    std::vector<std::string> targets = branch->GetLabels();
+    BasicBlock *body = func.GetBasicBlock(targets[0]);
+    BasicBlock *exit = func.GetBasicBlock(targets[1]);
+    if (!loop.Contains(body)) std::swap(body, exit);
+    if (!loop.Contains(body) || loop.Contains(exit) ||
+        !onlyPred(body, header) || !onlyPred(exit, header) ||
+        (!body->instrs.empty() && isPhi(body->instrs.front()))) {
+      return false;
+    }
+    hoistInvariants();
+    int size = 0;
+    for (Instruction *instr : header->instrs) size += !isPhi(instr);
+    if (size > kRotateHeaderBudget) return false;
+
+    // The guard computes the header's values for the first iteration.
+    std::unordered_map<std::string, std::string> first;
+    std::vector<Instruction *> defined;
+    for (Instruction *instr : header->instrs) {
+      if (!instr->hasDest()) continue;
+      defined.push_back(instr);
+      if (!isPhi(instr)) continue;
+      std::vector<std::string> args = instr->GetArgs();
+      std::vector<std::string> labels = instr->GetLabels();
+      for (int i = 0; i < args.size(); ++i) {
+        if (labels[i] == preheader->name) first[instr->GetDest()] = args[i];
+      }
+      if (!first.contains(instr->GetDest())) return false;
+    }
+    auto initial = [&](const std::string &var) {
+      auto it = first.find(var);
+      return it == first.end() ? var : it->second;
+    };
+
+    // Where the header's values are used outside of it, the body sees the
+    // merged value and code after the loop the one in the exit. Uses
+    // reached both ways would need a merge of their own.
+    std::unordered_map<std::string, Instruction *> def_of;
+    for (Instruction *instr : defined) def_of[instr->GetDest()] = instr;
+    // A phi uses its args at the end of the block they come from.
+    std::vector<std::pair<nl::json *, bool>> uses;
+    for (BasicBlock *bb : func.basic_blocks) {
+      for (Instruction *instr : bb->instrs) {
+        if (!instr->hasArgs()) continue;
+        bool phi = isPhi(instr);
+        if (bb == header && !phi) continue;
+        std::vector<std::string> labels = instr->GetLabels();
+        nl::json &args = instr->instr["args"];
+        for (int i = 0; i < args.size(); ++i) {
+          if (!def_of.contains(args[i])) continue;
+          BasicBlock *at = phi ? func.GetBasicBlock(labels[i]) : bb;
+          if (at == header) continue;
+          if (loop.Contains(at) || dominates(body, at)) {
+            uses.push_back({&args[i], true});
+          } else if (dominates(exit, at)) {
+            uses.push_back({&args[i], false});
+          } else {
+            return false;
+          }
+        }
+      }
+    }
+
+    std::unordered_map<std::string, std::string> guard_values;
+    auto guardValue = [&](const std::string &var) {
+      auto it = guard_values.find(var);
+      return it == guard_values.end() ? initial(var) : it->second;
+    };
+    std::vector<nl::json> guard;
+    for (Instruction *instr : header->instrs) {
+      if (isPhi(instr)) continue;
+      nl::json json = instr->instr;
+      if (json.contains("args")) {
+        for (nl::json &arg : json["args"]) {
+          arg = guardValue(arg);
+          if (arg == "__undef") return false;
+        }
+      }
+      if (json.contains("dest")) {
+        std::string dest = fresh(json["dest"].get<std::string>() + ".guard");
+        guard_values[json["dest"]] = dest;
+        json["dest"] = dest;
+      }
+      guard.push_back(std::move(json));
+    }
+
+    BasicBlock *entry = ctx->CreateBasicBlock();
+    entry->name = fresh(body->name + ".preheader");
+    func.block_map[entry->name] = entry;
+    entry->instrs.push_back(ctx->CreateInstruction(
+        {{"op", "jmp"}, {"labels", nl::json::array({body->name})}}, entry));
+    // The guard's copy of the branch enters the loop through `entry`.
+    for (nl::json &name : guard.back()["labels"]) {
+      if (name == body->name) name = entry->name;
+    }
+    if (!FallsThrough(preheader)) preheader->instrs.pop_back();
+    for (nl::json &json : guard) {
+      preheader->instrs.push_back(
+          ctx->CreateInstruction(std::move(json), preheader));
+    }
+
+    // The exit is also reached from the guard now.
+    for (Instruction *phi : exit->instrs) {
+      if (!isPhi(phi)) break;
+      phi->instr["args"].push_back(guardValue(phi->GetArgs()[0]));
+      phi->instr["labels"].push_back(preheader->name);
+    }
+
+    // Merge the header's values where they're used at the top of the body
+    // and in the exit.
+    std::unordered_map<std::string, std::string> in_body, after;
+    for (auto [arg, into_body] : uses) {
+      std::string var = *arg;
+      auto &merged = into_body ? in_body : after;
+      if (!merged.contains(var)) {
+        BasicBlock *bb = into_body ? body : exit;
+        std::string dest = fresh(var + (into_body ? ".rot" : ".exit"));
+        nl::json phi = {
+            {"dest", dest},
+            {"op", "phi"},
+            {"type", def_of[var]->instr["type"]},
+            {"args", {guardValue(var), var}},
+            {"labels",
+             {into_body ? entry->name : preheader->name, header->name}}};
+        bb->instrs.push_front(ctx->CreateInstruction(std::move(phi), bb));
+        merged[var] = dest;
+      }
+      *arg = merged[var];
+    }
+
+    // The header's phis only take the value from the latch now, which is
+    // defined in the body, so that value can stand in for them.
+    std::unordered_map<std::string, std::string> from_latch;
+    std::erase_if(header->instrs, [&](Instruction *phi) {
+      if (!isPhi(phi)) return false;
+      std::vector<std::string> args = phi->GetArgs();
+      std::vector<std::string> labels = phi->GetLabels();
+      for (int i = 0; i < args.size(); ++i) {
+        if (labels[i] == latch->name) from_latch[phi->GetDest()] = args[i];
+      }
+      return true;
+    });
+    for (BasicBlock *bb : func.basic_blocks) {
+      for (Instruction *instr : bb->instrs) {
+        if (!instr->hasArgs()) continue;
+        for (nl::json &arg : instr->instr["args"]) {
+          if (auto it = from_latch.find(arg); it != from_latch.end()) {
+            arg = it->second;
+          }
+        }
+      }
+    }
+
+    auto pos = std::find(func.basic_blocks.begin(), func.basic_blocks.end(),
+                         preheader);
+    func.basic_blocks.insert(std::next(pos), entry);
+    return true;
+  }
+};
+
+}  // namespace
+
+void rotate(Context *ctx, Function &func) {
+  MemScope scope("rotate");
+  AnalysisCache analyses(func);
+  bool added = false;
+  for (const auto &loop : analyses.GetLoopInfo().loops) {
+    if (loop->preheader) continue;
+    EnsurePreheader(ctx, func, analyses.GetCFG(), *loop);
+    added = true;
+  }
+  if (added) analyses.Invalidate();
+
+  // Headers of the loops that were looked at already.
+  std::set<std::string> seen;
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    LoopInfo &info = analyses.GetLoopInfo();
+    for (const auto &loop : info.loops) {
+      if (!seen.insert(loop->header->name).second) continue;
+      Rotator rotator(ctx, func, analyses.GetCFG(), analyses.GetDomInfo(),
+                      *loop);
+      if (!rotator.run()) continue;
+      changed = true;
+      break;
+    }
+    analyses.Invalidate();
+  }
+  MergeBlocks(func);
+  func.all_instrs.clear();
+}
@@ -0,0 +1,268 @@
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <optional>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "basic_block.h"
+#include "cfg.h"
+#include "fold.h"
+#include "function.h"
+#include "instruction.h"
+#include "mem_stats.h"
+#include "transform.h"
+
+static bool isFoldable(const std::string &op) {
+  static const std::unordered_set<std::string> kFoldable = {
+      "add", "sub",  "mul",  "div",  "eq",  "lt",  "gt",  "le",
+      "ge",  "not",  "and",  "or",   "fadd", "fsub", "fmul", "fdiv",
+      "feq", "flt",  "fgt",  "fle",  "fge"};
+  return kFoldable.count(op);
+}
+
+namespace {
+
+// A lattice value: not known to be defined yet, a single int, bool or float
+// constant, or anything.
+struct Lattice {
+  enum Kind { kTop, kConst, kBottom } kind = kTop;
+  nl::json value;
+
+  static Lattice Const(nl::json value) { return {kConst, std::move(value)}; }
+  static Lattice Bottom() { return {kBottom, nullptr}; }
+
+  bool operator==(const Lattice &other) const {
+    return kind == other.kind && (kind != kConst || value == other.value);
+  }
+
+  void meet(const Lattice &other) {
+    if (other.kind == kTop || kind == kBottom) return;
+    if (kind == kTop) {
+      *this = other;
+    } else if (other.kind == kBottom || value != other.value) {
+      *this = Bottom();
+    }
+  }
+};
+
+struct SCCP {
+  Function &func;
+  CFG cfg;
+
+  // An argument of an instruction.
+  struct Use {
+    Instruction *instr;
+    int index;
+  };
+  using Edge = std::pair<BasicBlock *, BasicBlock *>;
+
+  std::unordered_map<std::string, Lattice> values;
+  std::unordered_map<std::string, std::vector<Use>> uses;
+  // The phi arguments passed along each edge.
+  std::map<Edge, std::vector<Use>> phi_args;
+  std::set<Edge> edges;
+  std::unordered_set<BasicBlock *> reached;
+
+  std::deque<Edge> flow;
+  // Uses of variables whose value changed.
+  std::deque<Use> ssa;
+
+  SCCP(Function &func) : func(func), cfg(BuildCFG(func)) {}
+
+  Lattice get(const std::string &var) {
+    auto it = values.find(var);
+    return it == values.end() ? Lattice() : it->second;
+  }
+
+  void set(Instruction *instr, const Lattice &value) {
+    Lattice &old = values[instr->GetDest()];
+    if (old == value) return;
+    old = value;
+    for (const Use &use : uses[instr->GetDest()]) ssa.push_back(use);
+  }
+
+  void visitPhi(Instruction *instr) {
+    BasicBlock *bb = instr->parent;
+    std::vector<std::string> args = instr->GetArgs();
+    std::vector<std::string> labels = instr->GetLabels();
+    Lattice value;
+    for (int i = 0; i < args.size(); ++i) {
+      BasicBlock *pred = func.GetBasicBlock(labels[i]);
+      // Undefined on this path, so any value will do.
+      if (args[i] == "__undef" || !edges.count({pred, bb})) continue;
+      value.meet(get(args[i]));
+    }
+    set(instr, value);
+  }
+
+  // One argument of a phi changed or its edge became executable. Values
+  // only ever go down, so meeting it with the phi's current value is enough.
+  void visitPhiArg(const Use &use) {
+    const std::string &arg =
+        use.instr->instr["args"][use.index].get_ref<const std::string &>();
+    if (arg == "__undef") return;
+    Lattice value = get(use.instr->GetDest());
+    value.meet(get(arg));
+    set(use.instr, value);
+  }
+
+  void visitBranch(Instruction *instr) {
+    BasicBlock *bb = instr->parent;
+    std::vector<std::string> labels = instr->GetLabels();
+    if (instr->getOp() == "jmp") {
+      flow.emplace_back(bb, func.GetBasicBlock(labels[0]));
+      return;
+    }
+    Lattice cond = get(instr->GetArgs()[0]);
+    if (cond.kind == Lattice::kTop) return;
+    if (cond.kind == Lattice::kConst) {
+      int taken = cond.value.get<bool>() ? 0 : 1;
+      flow.emplace_back(bb, func.GetBasicBlock(labels[taken]));
+      return;
+    }
+    for (const std::string &label : labels) {
+      flow.emplace_back(bb, func.GetBasicBlock(label));
+    }
+  }
+
+  void visit(Instruction *instr) {
+    if (!instr->hasOp()) return;
+    std::string op = instr->getOp();
+    if (op == "phi") return visitPhi(instr);
+    if (op == "br" || op == "jmp") return visitBranch(instr);
+    if (!instr->hasDest()) return;
+
+    if (op == "const") {
+      const nl::json &value = instr->instr["value"];
+      bool constant = value.is_number() || value.is_boolean();
+      return set(instr, constant ? Lattice::Const(value) : Lattice::Bottom());
+    }
+    if (op == "id") return set(instr, get(instr->GetArgs()[0]));
+    if (!isFoldable(op)) return set(instr, Lattice::Bottom());
+
+    std::vector<nl::json> operands;
+    for (const std::string &arg : instr->GetArgs()) {
+      Lattice value = get(arg);
+      if (value.kind == Lattice::kTop) return;
+      if (value.kind == Lattice::kBottom) return set(instr, value);
+      operands.push_back(value.value);
+    }
+    std::optional<nl::json> result = FoldConstant(op, operands);
+    set(instr, result ? Lattice::Const(*result) : Lattice::Bottom());
+  }
+
+  void reach(BasicBlock *from, BasicBlock *to) {
+    if (!edges.insert({from, to}).second) return;
+    if (reached.insert(to).second) {
+      for (Instruction *instr : to->instrs) visit(instr);
+      // Falling through to the next block is an edge too.
+      auto it = cfg.successors.find(to);
+      Instruction *last = to->instrs.empty() ? nullptr : to->instrs.back();
+      bool branches = last && last->hasOp() &&
+                      (last->getOp() == "br" || last->getOp() == "jmp");
+      if (!branches && it != cfg.successors.end()) {
+        for (BasicBlock *succ : it->second) flow.emplace_back(to, succ);
+      }
+      return;
+    }
+    // Only the phis see the new edge.
+    for (const Use &use : phi_args[{from, to}]) visitPhiArg(use);
+  }
+
+  void solve() {
+    for (int i = 0; i < func.args.size(); ++i) {
+      values[func.args[i]] = Lattice::Bottom();
+    }
+    for (BasicBlock *bb : func.basic_blocks) {
+      for (Instruction *instr : bb->instrs) {
+        if (!instr->hasArgs()) continue;
+        std::vector<std::string> args = instr->GetArgs();
+        bool phi = instr->getOp() == "phi";
+        std::vector<std::string> labels;
+        if (phi) labels = instr->GetLabels();
+        for (int i = 0; i < args.size(); ++i) {
+          uses[args[i]].push_back({instr, i});
+          if (phi) {
+            Edge edge = {func.GetBasicBlock(labels[i]), bb};
+            phi_args[edge].push_back({instr, i});
+          }
+        }
+      }
+    }
+
+    flow.emplace_back(nullptr, func.basic_blocks.front());
+    while (!flow.empty() || !ssa.empty()) {
+      if (!flow.empty()) {
+        auto [from, to] = flow.front();
+        flow.pop_front();
+        reach(from, to);
+        continue;
+      }
+      Use use = ssa.front();
+      ssa.pop_front();
+      BasicBlock *bb = use.instr->parent;
+      if (!reached.count(bb)) continue;
+      if (use.instr->getOp() != "phi") {
+        visit(use.instr);
+        continue;
+      }
+      std::string label = use.instr->instr["labels"][use.index];
+      if (edges.count({func.GetBasicBlock(label), bb})) visitPhiArg(use);
+    }
+  }
+
+  void rewrite() {
+    for (BasicBlock *bb : func.basic_blocks) {
+      if (!reached.count(bb)) continue;
+      bool rewritten = false;
+      for (Instruction *instr : bb->instrs) {
+        if (!instr->hasOp()) continue;
+        std::string op = instr->getOp();
+        if (op == "br") {
+          Lattice cond = get(instr->GetArgs()[0]);
+          if (cond.kind != Lattice::kConst) continue;
+          std::string target =
+              instr->GetLabels()[cond.value.get<bool>() ? 0 : 1];
+          instr->instr["op"] = "jmp";
+          instr->instr["labels"] = {target};
+          instr->instr.erase("args");
+          continue;
+        }
+        if (op == "const" || !instr->hasDest()) continue;
+        Lattice value = get(instr->GetDest());
+        if (value.kind != Lattice::kConst) continue;
+        rewritten |= op == "phi";
+        instr->instr["op"] = "const";
+        instr->instr["value"] = value.value;
+        instr->instr.erase("args");
+        instr->instr.erase("labels");
+      }
+      // Keep the remaining phis together at the top of the block.
+      if (rewritten) {
+        std::stable_partition(
+            bb->instrs.begin(), bb->instrs.end(), [](Instruction *instr) {
+              return !instr->hasOp() || instr->getOp() == "phi";
+            });
+      }
+    }
+
+    // Blocks that were never reached lost their last edge above, unless a
+    // branch on an undefined value still leads there.
+    RemoveUnreachableBlocks(func);
+  }
+};
+
+}  // namespace
+
+void sccp(Function &func) {
+  MemScope scope("sccp");
+  if (func.basic_blocks.empty()) return;
+  SCCP pass(func);
+  pass.solve();
+  pass.rewrite();
+}
@@ -0,0 +1,418 @@
+#include "scev.h"
+
+#include <algorithm>
+#include <limits>
+#include <sstream>
+#include <utility>
+
+#include "basic_block.h"
+#include "function.h"
+#include "instruction.h"
+#include "loop.h"
+#include "mem_stats.h"
+
+static int64_t wrap(uint64_t value) { return static_cast<int64_t>(value); }
+
+static std::string negate(const std::string &op) {
+  if (op == "lt") return "ge";
+  if (op == "le") return "gt";
+  if (op == "gt") return "le";
+  if (op == "ge") return "lt";
+  if (op == "eq") return "ne";
+  return "eq";
+}
+
+// The comparison with its operands swapped.
+static std::string swap(const std::string &op) {
+  if (op == "lt") return "gt";
+  if (op == "le") return "ge";
+  if (op == "gt") return "lt";
+  if (op == "ge") return "le";
+  return op;
+}
+
+// The first iteration k >= 0 where `start + k * step <op> bound` is false,
+// or nothing if there is none or the recurrence wraps before it.
+static std::optional<int64_t> exitIteration(const std::string &op,
+                                            __int128 start, __int128 step,
+                                            __int128 bound) {
+  constexpr __int128 kMin = std::numeric_limits<int64_t>::min();
+  constexpr __int128 kMax = std::numeric_limits<int64_t>::max();
+  __int128 k;
+  if (op == "lt" || op == "le") {
+    if (op == "lt" ? start >= bound : start > bound) return 0;
+    if (step <= 0) return std::nullopt;
+    k = op == "lt" ? (bound - start + step - 1) / step
+                   : (bound - start) / step + 1;
+  } else if (op == "gt" || op == "ge") {
+    if (op == "gt" ? start <= bound : start < bound) return 0;
+    if (step >= 0) return std::nullopt;
+    k = op == "gt" ? (start - bound - step - 1) / -step
+                   : (start - bound) / -step + 1;
+  } else if (op == "eq") {
+    if (start != bound) return 0;
+    if (step == 0) return std::nullopt;
+    return 1;
+  } else {
+    if (start == bound) return 0;
+    if (step == 0 || (bound - start) % step != 0) return std::nullopt;
+    k = (bound - start) / step;
+    if (k < 0) return std::nullopt;
+  }
+  __int128 last = start + k * step;
+  if (last < kMin || last > kMax || k > kMax) return std::nullopt;
+  return static_cast<int64_t>(k);
+}
+
+ScalarEvolution::ScalarEvolution(CFG &cfg, DomInfo &dom, LoopInfo &loops)
+    : function(*cfg.function), cfg(cfg), dom(dom), loops(loops) {
+  for (BasicBlock *bb : function.basic_blocks) {
+    for (Instruction *instr : bb->instrs) {
+      if (instr->hasDest()) defs[instr->GetDest()] = instr;
+    }
+  }
+}
+
+const SCEV *ScalarEvolution::unique(SCEV scev) {
+  std::ostringstream key;
+  key << scev.kind << " " << scev.value << " " << scev.name << " "
+      << scev.loop;
+  for (const SCEV *operand : scev.operands) key << " " << operand;
+  auto &slot = uniqued[key.str()];
+  if (!slot) slot = std::make_unique<SCEV>(std::move(scev));
+  return slot.get();
+}
+
+const SCEV *ScalarEvolution::GetConstant(int64_t value) {
+  return unique({.kind = SCEV::kConstant, .value = value});
+}
+
+const SCEV *ScalarEvolution::GetUnknown(const std::string &name) {
+  return unique({.kind = SCEV::kUnknown, .name = name});
+}
+
+const SCEV *ScalarEvolution::GetCouldNotCompute() {
+  return unique({.kind = SCEV::kCouldNotCompute});
+}
+
+bool ScalarEvolution::IsInvariant(const SCEV *scev, const Loop *loop) {
+  switch (scev->kind) {
+    case SCEV::kConstant:
+      return true;
+    case SCEV::kCouldNotCompute:
+      return false;
+    case SCEV::kUnknown: {
+      auto it = defs.find(scev->name);
+      return it == defs.end() || !loop->Contains(it->second->parent);
+    }
+    case SCEV::kAddRec:
+      if (loop->Contains(scev->loop)) return false;
+      break;
+    default:
+      break;
+  }
+  return std::all_of(
+      scev->operands.begin(), scev->operands.end(),
+      [&](const SCEV *operand) { return IsInvariant(operand, loop); });
+}
+
+const SCEV *ScalarEvolution::GetAdd(const SCEV *a, const SCEV *b) {
+  if (a->kind == SCEV::kCouldNotCompute || b->kind == SCEV::kCouldNotCompute) {
+    return GetCouldNotCompute();
+  }
+  if (a->kind == SCEV::kAddRec && b->kind == SCEV::kAddRec &&
+      a->loop == b->loop) {
+    return GetAddRec(GetAdd(a->GetStart(), b->GetStart()),
+                     GetAdd(a->GetStep(), b->GetStep()), a->loop);
+  }
+  for (int i = 0; i < 2; ++i, std::swap(a, b)) {
+    if (a->kind == SCEV::kAddRec && IsInvariant(b, a->loop)) {
+      return GetAddRec(GetAdd(a->GetStart(), b), a->GetStep(), a->loop);
+    }
+  }
+
+  // Constants go first, and are folded into each other.
+  if (b->IsConstant()) std::swap(a, b);
+  if (a->IsConstant()) {
+    if (b->IsConstant()) {
+      return GetConstant(wrap(static_cast<uint64_t>(a->value) +
+                              static_cast<uint64_t>(b->value)));
+    }
+    if (a->value == 0) return b;
+    if (b->kind == SCEV::kAdd && b->operands[0]->IsConstant()) {
+      return GetAdd(GetAdd(a, b->operands[0]), b->operands[1]);
+    }
+  }
+  return unique({.kind = SCEV::kAdd, .operands = {a, b}});
+}
+
+const SCEV *ScalarEvolution::GetMul(const SCEV *a, const SCEV *b) {
+  if (a->kind == SCEV::kCouldNotCompute || b->kind == SCEV::kCouldNotCompute) {
+    return GetCouldNotCompute();
+  }
+  for (int i = 0; i < 2; ++i, std::swap(a, b)) {
+    if (a->kind == SCEV::kAddRec && IsInvariant(b, a->loop)) {
+      return GetAddRec(GetMul(a->GetStart(), b), GetMul(a->GetStep(), b),
+                       a->loop);
+    }
+  }
+
+  if (b->IsConstant()) std::swap(a, b);
+  if (a->IsConstant()) {
+    if (b->IsConstant()) {
+      return GetConstant(wrap(static_cast<uint64_t>(a->value) *
+                              static_cast<uint64_t>(b->value)));
+    }
+    if (a->value == 0) return a;
+    if (a->value == 1) return b;
+    if (b->kind == SCEV::kAdd) {
+      return GetAdd(GetMul(a, b->operands[0]), GetMul(a, b->operands[1]));
+    }
+    if (b->kind == SCEV::kMul && b->operands[0]->IsConstant()) {
+      return GetMul(GetMul(a, b->operands[0]), b->operands[1]);
+    }
+  }
+  return unique({.kind = SCEV::kMul, .operands = {a, b}});
+}
+
+const SCEV *ScalarEvolution::GetSMax(const SCEV *a, const SCEV *b) {
+  if (a->kind == SCEV::kCouldNotCompute || b->kind == SCEV::kCouldNotCompute) {
+    return GetCouldNotCompute();
+  }
+  if (a == b) return a;
+  if (a->IsConstant() && b->IsConstant()) {
+    return a->value > b->value ? a : b;
+  }
+  return unique({.kind = SCEV::kSMax, .operands = {a, b}});
+}
+
+const SCEV *ScalarEvolution::GetAddRec(const SCEV *start, const SCEV *step,
+                                       const Loop *loop) {
+  if (step->IsConstant() && step->value == 0) return start;
+  return unique(
+      {.kind = SCEV::kAddRec, .operands = {start, step}, .loop = loop});
+}
+
+const SCEV *ScalarEvolution::EvaluateAtIteration(const SCEV *rec,
+                                                 const SCEV *iteration) {
+  if (rec->kind != SCEV::kAddRec) return rec;
+  return GetAdd(rec->GetStart(), GetMul(rec->GetStep(), iteration));
+}
+
+const SCEV *ScalarEvolution::Get(const std::string &var) {
+  if (auto it = values.find(var); it != values.end()) return it->second;
+  const SCEV *scev = compute(var);
+  values[var] = scev;
+  computed.push_back(var);
+  return scev;
+}
+
+// `sum` without one of the terms it adds up, if `term` is one of them.
+const SCEV *ScalarEvolution::withoutTerm(const SCEV *sum, const SCEV *term) {
+  if (sum == term) return GetConstant(0);
+  if (sum->kind != SCEV::kAdd) return nullptr;
+  if (const SCEV *rest = withoutTerm(sum->operands[0], term)) {
+    return GetAdd(rest, sum->operands[1]);
+  }
+  if (const SCEV *rest = withoutTerm(sum->operands[1], term)) {
+    return GetAdd(sum->operands[0], rest);
+  }
+  return nullptr;
+}
+
+const SCEV *ScalarEvolution::compute(const std::string &var) {
+  auto it = defs.find(var);
+  if (it == defs.end()) return GetUnknown(var);
+  Instruction *instr = it->second;
+  if (instr->instr["type"] != "int") return GetUnknown(var);
+  std::string op = instr->getOp();
+  if (op == "const") return GetConstant(instr->instr["value"].get<int64_t>());
+  if (op == "id") return Get(instr->GetArgs()[0]);
+  if (op == "add" || op == "sub" || op == "mul") {
+    std::vector<std::string> args = instr->GetArgs();
+    const SCEV *a = Get(args[0]), *b = Get(args[1]);
+    if (op == "add") return GetAdd(a, b);
+    if (op == "sub") return GetAdd(a, GetMul(GetConstant(-1), b));
+    return GetMul(a, b);
+  }
+  if (op != "phi") return GetUnknown(var);
+
+  // A header phi is a recurrence if the value coming around the loop is
+  // itself plus something invariant.
+  BasicBlock *bb = instr->parent;
+  Loop *loop = loops.GetLoop(bb);
+  std::vector<std::string> args = instr->GetArgs();
+  std::vector<std::string> labels = instr->GetLabels();
+  if (!loop || loop->header != bb || !loop->preheader ||
+      loop->latches.size() != 1 || args.size() != 2) {
+    return GetUnknown(var);
+  }
+  std::string init, back;
+  for (int i = 0; i < 2; ++i) {
+    if (labels[i] == loop->preheader->name) init = args[i];
+    if (labels[i] == loop->latches[0]->name) back = args[i];
+  }
+  if (init.empty() || back.empty() || init == "__undef") {
+    return GetUnknown(var);
+  }
+  const SCEV *start = Get(init);
+
+  // Look at the value coming around with the phi standing for itself.
+  const SCEV *self = GetUnknown(var);
+  values[var] = self;
+  computed.push_back(var);
+  size_t mark = computed.size() - 1;
+  const SCEV *step = withoutTerm(Get(back), self);
+  if (!step || !IsInvariant(step, loop)) return self;
+  // What was computed from the stand-in is stale now.
+  for (size_t i = mark; i < computed.size(); ++i) values.erase(computed[i]);
+  computed.resize(mark);
+  return GetAddRec(start, step, loop);
+}
+
+const SCEV *ScalarEvolution::GetBackedgeTakenCount(const Loop *loop) {
+  auto [it, inserted] = backedge_taken.emplace(loop, nullptr);
+  if (inserted) it->second = computeBackedgeTakenCount(loop);
+  return it->second;
+}
+
+std::optional<int64_t> ScalarEvolution::GetConstantTripCount(
+    const Loop *loop) {
+  const SCEV *count = GetBackedgeTakenCount(loop);
+  if (!count->IsConstant() ||
+      count->value == std::numeric_limits<int64_t>::max()) {
+    return std::nullopt;
+  }
+  return count->value + 1;
+}
+
+std::optional<LoopExitTest> ScalarEvolution::GetExitTest(const Loop *loop) {
+  // The exiting block has to run on every iteration, so that the n-th time
+  // it runs sees the n-th value of the recurrence.
+  BasicBlock *exiting = nullptr;
+  for (BasicBlock *bb : loop->blocks) {
+    const std::vector<BasicBlock *> &succs = cfg.successors[bb];
+    bool exits = succs.empty() ||
+                 std::any_of(succs.begin(), succs.end(), [&](BasicBlock *s) {
+                   return !loop->Contains(s);
+                 });
+    if (!exits) continue;
+    if (exiting) return std::nullopt;
+    exiting = bb;
+  }
+  if (!exiting || exiting->instrs.empty()) return std::nullopt;
+  for (BasicBlock *latch : loop->latches) {
+    const std::vector<BasicBlock *> &doms = dom.dom[latch];
+    if (std::find(doms.begin(), doms.end(), exiting) == doms.end()) {
+      return std::nullopt;
+    }
+  }
+  Instruction *branch = exiting->instrs.back();
+  if (branch->getOp() != "br") return std::nullopt;
+
+  auto cond = defs.find(branch->GetArgs()[0]);
+  if (cond == defs.end()) return std::nullopt;
+  LoopExitTest test = {.exiting = exiting, .op = cond->second->getOp()};
+  if (test.op != "lt" && test.op != "le" && test.op != "gt" &&
+      test.op != "ge" && test.op != "eq") {
+    return std::nullopt;
+  }
+  if (!loop->Contains(function.GetBasicBlock(branch->GetLabels()[0]))) {
+    test.op = negate(test.op);
+  }
+  std::vector<std::string> args = cond->second->GetArgs();
+  test.rec_var = args[0];
+  test.bound_var = args[1];
+  test.rec = Get(args[0]);
+  test.bound = Get(args[1]);
+  if (test.bound->kind == SCEV::kAddRec && test.bound->loop == loop) {
+    std::swap(test.rec, test.bound);
+    std::swap(test.rec_var, test.bound_var);
+    test.op = swap(test.op);
+  }
+  if (test.rec->kind != SCEV::kAddRec || test.rec->loop != loop ||
+      !IsInvariant(test.bound, loop) || !test.rec->GetStep()->IsConstant()) {
+    return std::nullopt;
+  }
+  return test;
+}
+
+const SCEV *ScalarEvolution::computeBackedgeTakenCount(const Loop *loop) {
+  std::optional<LoopExitTest> test = GetExitTest(loop);
+  if (!test) return GetCouldNotCompute();
+  const std::string &op = test->op;
+  const SCEV *start = test->rec->GetStart(), *bound = test->bound;
+  int64_t step = test->rec->GetStep()->value;
+
+  if (start->IsConstant() && bound->IsConstant()) {
+    std::optional<int64_t> k =
+        exitIteration(op, start->value, step, bound->value);
+    return k ? GetConstant(*k) : GetCouldNotCompute();
+  }
+  // Stepping by one can't jump over the bound, or wrap before reaching it.
+  const SCEV *minus_one = GetConstant(-1), *zero = GetConstant(0);
+  if (op == "lt" && step == 1) {
+    return GetSMax(GetAdd(bound, GetMul(minus_one, start)), zero);
+  }
+  if (op == "gt" && step == -1) {
+    return GetSMax(GetAdd(start, GetMul(minus_one, bound)), zero);
+  }
+  return GetCouldNotCompute();
+}
+
+std::string ScalarEvolution::ToString(const SCEV *scev) {
+  switch (scev->kind) {
+    case SCEV::kConstant:
+      return std::to_string(scev->value);
+    case SCEV::kUnknown:
+      return scev->name;
+    case SCEV::kAdd:
+      return "(" + ToString(scev->operands[0]) + " + " +
+             ToString(scev->operands[1]) + ")";
+    case SCEV::kMul:
+      return "(" + ToString(scev->operands[0]) + " * " +
+             ToString(scev->operands[1]) + ")";
+    case SCEV::kSMax:
+      return "smax(" + ToString(scev->operands[0]) + ", " +
+             ToString(scev->operands[1]) + ")";
+    case SCEV::kAddRec:
+      return "{" + ToString(scev->GetStart()) + ",+," +
+             ToString(scev->GetStep()) + "}<." + scev->loop->header->name +
+             ">";
+    case SCEV::kCouldNotCompute:
+      break;
+  }
+  return "could not compute";
+}
+
+void ScalarEvolution::dump(std::ostream &os) {
+  MemScope scope("ScalarEvolution");
+  os << "@" << function.name << ":";
+  if (loops.loops.empty()) {
+    os << " no loops\n";
+    return;
+  }
+  os << "\n";
+  std::vector<const Loop *> worklist(loops.top_level.rbegin(),
+                                     loops.top_level.rend());
+  while (!worklist.empty()) {
+    const Loop *loop = worklist.back();
+    worklist.pop_back();
+    std::string indent(2 * loop->depth, ' ');
+    os << indent << "loop ." << loop->header->name << "\n";
+    os << indent << "  backedge-taken count: "
+       << ToString(GetBackedgeTakenCount(loop)) << "\n";
+    for (BasicBlock *bb : loop->blocks) {
+      if (loops.GetLoop(bb) != loop) continue;
+      for (Instruction *instr : bb->instrs) {
+        if (!instr->hasDest()) continue;
+        const SCEV *scev = Get(instr->GetDest());
+        if (scev->kind != SCEV::kAddRec) continue;
+        os << indent << "  " << instr->GetDest() << ": " << ToString(scev)
+           << "\n";
+      }
+    }
+    worklist.insert(worklist.end(), loop->children.rbegin(),
+                    loop->children.rend());
+  }
+}
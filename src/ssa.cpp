@@ -10,6 +10,7 @@
 #include "dom.h"
 #include "function.h"
 #include "instruction.h"
+#include "mem_stats.h"
 
 static std::map<std::string, std::set<BasicBlock *>> GetDefBlockMap(
     Function &function) {
@@ -28,11 +29,15 @@ static PhiMap GetPhis(Function &function, DomInfo &dom_info) {
   PhiMap phis;
 
   for (auto [v, def_list] : GetDefBlockMap(function)) {
-    for (auto d = def_list.begin(); d != def_list.end(); ++d) {
-      for (BasicBlock *block : dom_info.df[*d]) {
+    // A phi is a new def, so blocks join the worklist as we go.
+    std::vector<BasicBlock *> worklist(def_list.begin(), def_list.end());
+    while (!worklist.empty()) {
+      BasicBlock *d = worklist.back();
+      worklist.pop_back();
+      for (BasicBlock *block : dom_info.df[d]) {
         if (phis[block].contains(v)) continue;
         phis[block].insert(v);
-        if (!def_list.contains(block)) def_list.insert(block);
+        if (def_list.insert(block).second) worklist.push_back(block);
       }
     }
   }
@@ -57,9 +62,22 @@ struct SSAConverter {
 
   std::map<BasicBlock *, std::map<std::string, std::string>> phi_dests;
 
+  // The Bril type of every original variable, for the phis we insert.
+  std::map<std::string, nl::json> types;
+
   SSAConverter(Context *ctx, CFG &cfg, Function &function, DomInfo &dom_info)
       : ctx(ctx), cfg(cfg), function(function), dom_info(dom_info) {
     phis = GetPhis(function, dom_info);
+    for (int i = 0; i < function.args.size(); ++i) {
+      types[function.args[i]] = function.arg_types[i];
+    }
+    for (BasicBlock *bb : function.basic_blocks) {
+      for (Instruction *instr : bb->instrs) {
+        if (instr->hasDest() && instr->instr.contains("type")) {
+          types[instr->GetDest()] = instr->instr["type"];
+        }
+      }
+    }
   }
 
   std::string pushFresh(const std::string &var) {
@@ -118,8 +136,7 @@ struct SSAConverter {
         nl::json phi;
         phi["op"] = "phi";
         phi["dest"] = phi_dests[block][dest];
-        // FIXME: DO NOT HARDCODE THIS!
-        phi["type"] = "int";
+        phi["type"] = types[dest];
         for (const auto &pair : pairs) {
           phi["labels"].push_back(pair.first->name);
           phi["args"].push_back(pair.second);
@@ -131,12 +148,17 @@ struct SSAConverter {
   }
 
   void ToSSA() {
+    // Arguments are defined on entry and keep their names.
+    for (const std::string &arg : function.args) {
+      stack[arg].push_back(arg);
+    }
     Rename(function.basic_blocks[0]);
     InsertPhis();
   }
 };
 
 void ToSSA(Context *ctx, Function &function, CFG &cfg, DomInfo &dom) {
+  MemScope scope("ToSSA");
   SSAConverter converter(ctx, cfg, function, dom);
   converter.ToSSA();
 }
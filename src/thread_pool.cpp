@@ -0,0 +1,102 @@
+#include "thread_pool.h"
+
+#include <utility>
+
+// The pool and queue the current thread works on, if any.
+static thread_local const ThreadPool *current_pool = nullptr;
+static thread_local int current_queue = 0;
+
+ThreadPool::ThreadPool(int threads) : queues(threads + 1) {
+  for (int i = 1; i <= threads; ++i) {
+    this->threads.emplace_back(&ThreadPool::work, this, i, false);
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stop = true;
+  }
+  wake.notify_all();
+  for (std::thread &thread : threads) thread.join();
+}
+
+void ThreadPool::Submit(std::function<void()> task) {
+  int index = current_pool == this
+                  ? current_queue
+                  : next.fetch_add(1, std::memory_order_relaxed) %
+                        queues.size();
+  {
+    std::lock_guard<std::mutex> lock(queues[index].mutex);
+    queues[index].tasks.push_back(std::move(task));
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    ++queued;
+    ++pending;
+  }
+  wake.notify_one();
+}
+
+void ThreadPool::Wait() {
+  const ThreadPool *prev_pool = current_pool;
+  int prev_queue = current_queue;
+  work(0, true);
+  current_pool = prev_pool;
+  current_queue = prev_queue;
+
+  std::lock_guard<std::mutex> lock(mutex);
+  if (error) std::rethrow_exception(std::exchange(error, nullptr));
+}
+
+bool ThreadPool::take(int self, std::function<void()> &task) {
+  // Newest first from our own queue, for locality, and oldest first from the
+  // others, which are the least likely to be wanted by their owners soon.
+  bool found = false;
+  for (int i = 0; i < queues.size() && !found; ++i) {
+    Queue &queue = queues[(self + i) % queues.size()];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (queue.tasks.empty()) continue;
+    if (i == 0) {
+      task = std::move(queue.tasks.back());
+      queue.tasks.pop_back();
+    } else {
+      task = std::move(queue.tasks.front());
+      queue.tasks.pop_front();
+    }
+    found = true;
+  }
+  if (!found) return false;
+  std::lock_guard<std::mutex> lock(mutex);
+  --queued;
+  return true;
+}
+
+void ThreadPool::work(int self, bool waiting) {
+  current_pool = this;
+  current_queue = self;
+  while (true) {
+    std::function<void()> task;
+    if (take(self, task)) {
+      std::exception_ptr thrown;
+      try {
+        task();
+      } catch (...) {
+        thrown = std::current_exception();
+      }
+      bool done;
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (thrown && !error) error = thrown;
+        done = --pending == 0;
+      }
+      if (done) wake.notify_all();
+      continue;
+    }
+    std::unique_lock<std::mutex> lock(mutex);
+    wake.wait(lock, [&] {
+      return stop || queued > 0 || (waiting && pending == 0);
+    });
+    if (stop || (waiting && pending == 0)) return;
+  }
+}
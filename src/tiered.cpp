@@ -0,0 +1,121 @@
+#include "tiered.h"
+
+#include <chrono>
+#include <cstdio>
+#include <exception>
+
+#include "basic_block.h"
+#include "cfg.h"
+#include "dom.h"
+#include "function.h"
+#include "instruction.h"
+#include "ssa.h"
+#include "transform.h"
+
+Tiering::Tiering(const nl::json &ir, uint64_t threshold)
+    : threshold(threshold) {
+  for (const nl::json &function : ir["functions"]) {
+    sources[function["name"].get<std::string>()] = &function;
+  }
+  compiler = std::thread(&Tiering::work, this);
+}
+
+Tiering::~Tiering() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stop = true;
+  }
+  wake.notify_one();
+  compiler.join();
+}
+
+void Tiering::update(Function *function, State &state) {
+  if (state.requested || state.calls + state.back_edges < threshold) return;
+  state.requested = true;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    queue.push_back(function->name);
+    log[function->name].requested_at = state.calls + state.back_edges;
+  }
+  wake.notify_one();
+}
+
+void Tiering::OnBackEdge(Function *function, uint64_t count) {
+  State &state = states[function];
+  state.back_edges = count;
+  update(function, state);
+}
+
+Function *Tiering::OnCall(Function *function, uint64_t count) {
+  State &state = states[function];
+  if (state.optimized) return function;
+  state.calls = count;
+  update(function, state);
+  if (!state.requested) return function;
+
+  std::lock_guard<std::mutex> lock(mutex);
+  auto it = ready.find(function->name);
+  if (it == ready.end()) return function;
+  Function *optimized = it->second;
+  ready.erase(it);
+  log[function->name].swapped_at = count;
+  // The interpreter is single-threaded, so nothing else holds the reference.
+  states[optimized].optimized = true;
+  return optimized;
+}
+
+void Tiering::work() {
+  std::unique_lock<std::mutex> lock(mutex);
+  while (true) {
+    wake.wait(lock, [this] { return stop || !queue.empty(); });
+    if (stop) return;
+    std::string name = queue.front();
+    queue.pop_front();
+    lock.unlock();
+
+    auto start = std::chrono::steady_clock::now();
+    Function *function = nullptr;
+    try {
+      function = Function::Create(&ctx, *sources.at(name));
+      CFG cfg = BuildCFG(*function);
+      DomInfo dom = ComputeDomInfo(cfg);
+      ToSSA(&ctx, *function, cfg, dom);
+      Optimize(&ctx, *function);
+    } catch (const std::exception &) {
+      // Keep running the unoptimized version.
+      function = nullptr;
+    }
+    std::chrono::duration<double, std::milli> elapsed =
+        std::chrono::steady_clock::now() - start;
+
+    lock.lock();
+    if (function) {
+      ready[name] = function;
+      log[name].compile_ms = elapsed.count();
+    } else {
+      log[name].failed = true;
+    }
+  }
+}
+
+void Tiering::DumpLog(std::ostream &os) {
+  std::lock_guard<std::mutex> lock(mutex);
+  for (const auto &[name, entry] : log) {
+    os << "tier-up @" << name << ": hot after " << entry.requested_at;
+    if (entry.failed) {
+      os << ", failed to optimize\n";
+      continue;
+    }
+    if (entry.compile_ms >= 0) {
+      char ms[32];
+      std::snprintf(ms, sizeof(ms), "%.3f", entry.compile_ms);
+      os << ", optimized in " << ms << " ms";
+    } else {
+      os << ", not optimized yet";
+    }
+    if (entry.swapped_at) {
+      os << ", swapped in at call " << entry.swapped_at;
+    }
+    os << "\n";
+  }
+}
@@ -0,0 +1,272 @@
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "basic_block.h"
+#include "cfg.h"
+#include "context.h"
+#include "function.h"
+#include "instruction.h"
+#include "mem_stats.h"
+#include "transform.h"
+
+// Ops a recursive call's result may be combined with on its way out, so
+// that the call is still a tail call to an accumulator, with the value the
+// accumulator starts at. They're associative and commutative, so the
+// values can be combined in the order the calls make them instead of the
+// order the returns do.
+static const std::unordered_map<std::string, nl::json> kIdentities = {
+    {"add", 0}, {"mul", 1}, {"and", true}, {"or", false}};
+
+static bool isPhi(Instruction *instr) {
+  return instr->hasOp() && instr->getOp() == "phi";
+}
+
+namespace {
+
+// A call of the function to itself whose result is returned right away,
+// possibly combined with a value first.
+struct TailCall {
+  BasicBlock *bb;
+  Instruction *call;
+  // The combining op and the value the result is combined with, if any.
+  std::string op, with;
+};
+
+struct TailRecursion {
+  Context *ctx;
+  Function &func;
+
+  // Every name in the function, to keep the new ones apart.
+  std::unordered_set<std::string> used;
+  // The instruction defining every SSA name but the arguments.
+  std::unordered_map<std::string, Instruction *> defs;
+  std::vector<TailCall> calls;
+  // The op every combining tail call uses, if they agree.
+  std::string op;
+
+  TailRecursion(Context *ctx, Function &func) : ctx(ctx), func(func) {
+    used.insert(func.args.begin(), func.args.end());
+    for (BasicBlock *bb : func.basic_blocks) {
+      used.insert(bb->name);
+      for (Instruction *instr : bb->instrs) {
+        if (!instr->hasDest()) continue;
+        used.insert(instr->GetDest());
+        defs[instr->GetDest()] = instr;
+      }
+    }
+  }
+
+  std::string fresh(const std::string &base) {
+    std::string name = base;
+    for (int i = 1; used.contains(name); ++i) {
+      name = base + "." + std::to_string(i);
+    }
+    used.insert(name);
+    return name;
+  }
+
+  Instruction *create(BasicBlock *bb, nl::json instr) {
+    return ctx->CreateInstruction(std::move(instr), bb);
+  }
+
+  bool isSelfCall(Instruction *instr) {
+    return instr->hasOp() && instr->getOp() == "call" &&
+           instr->instr["funcs"][0] == func.name &&
+           instr->GetArgs().size() == func.args.size();
+  }
+
+  // Looks for blocks that end in `r = call @func ...; ret r`, or in
+  // `r = call @func ...; s = op r v; ret s` with an op of kIdentities.
+  void findCalls() {
+    std::unordered_set<std::string> ops;
+    for (BasicBlock *bb : func.basic_blocks) {
+      int n = bb->instrs.size();
+      if (n < 2 || bb->instrs.back()->getOp() != "ret") continue;
+      Instruction *ret = bb->instrs.back();
+      std::string returned = ret->hasArgs() ? ret->GetArgs()[0] : "";
+      Instruction *last = bb->instrs[n - 2];
+      if (isSelfCall(last)) {
+        if (returned.empty() ? last->hasDest()
+                             : !last->hasDest() ||
+                                   last->GetDest() != returned) {
+          continue;
+        }
+        calls.push_back({bb, last});
+        continue;
+      }
+      if (n < 3 || returned.empty() || !isSelfCall(bb->instrs[n - 3])) {
+        continue;
+      }
+      Instruction *call = bb->instrs[n - 3];
+      if (!call->hasDest() || !last->hasDest() ||
+          last->GetDest() != returned ||
+          !kIdentities.contains(last->getOp())) {
+        continue;
+      }
+      std::vector<std::string> args = last->GetArgs();
+      std::string result = call->GetDest();
+      if (args.size() != 2 || (args[0] == result) == (args[1] == result)) {
+        continue;
+      }
+      calls.push_back({bb, call, last->getOp(),
+                       args[0] == result ? args[1] : args[0]});
+      ops.insert(last->getOp());
+    }
+    // Returns would have to be combined with different accumulators.
+    if (ops.size() > 1) {
+      std::erase_if(calls, [](const TailCall &call) {
+        return !call.op.empty();
+      });
+    } else if (ops.size() == 1) {
+      op = *ops.begin();
+    }
+  }
+
+  // Turns
+  //
+  //   entry: ...
+  //   bb: r = call @func x...; s = op r v; ret s
+  //   ...: ret w
+  //
+  // into
+  //
+  //   start: acc0 = identity; jmp entry
+  //   entry: a = phi arg start x bb; acc = phi acc0 start acc1 bb; ...
+  //   bb: acc1 = op acc v; jmp entry
+  //   ...: t = op acc w; ret t
+  //
+  // where `a` stands in for the argument everywhere but in its phi. Without
+  // a combining op there's no accumulator.
+  bool run() {
+    if (func.basic_blocks.empty()) return false;
+    BasicBlock *entry = func.basic_blocks.front();
+    if (!entry->instrs.empty() && isPhi(entry->instrs.front())) return false;
+    std::unordered_set<std::string> args(func.args.begin(), func.args.end());
+    for (BasicBlock *bb : func.basic_blocks) {
+      for (Instruction *instr : bb->instrs) {
+        if (instr->hasDest() && args.contains(instr->GetDest())) return false;
+      }
+    }
+    findCalls();
+    if (calls.empty()) return false;
+
+    std::unordered_map<std::string, std::string> phis;
+    for (const std::string &arg : func.args) phis[arg] = fresh(arg + ".tail");
+    for (BasicBlock *bb : func.basic_blocks) {
+      for (Instruction *instr : bb->instrs) {
+        if (!instr->hasArgs()) continue;
+        for (nl::json &arg : instr->instr["args"]) {
+          if (auto it = phis.find(arg); it != phis.end()) arg = it->second;
+        }
+      }
+    }
+    std::vector<BasicBlock *> preds = BuildCFG(func).predecessors[entry];
+
+    BasicBlock *start = ctx->CreateBasicBlock();
+    start->name = fresh(entry->name + ".start");
+    func.block_map[start->name] = start;
+    std::vector<nl::json> entry_phis;
+    for (int i = 0; i < func.args.size(); ++i) {
+      const std::string &arg = func.args[i];
+      entry_phis.push_back({{"dest", phis[arg]},
+                            {"op", "phi"},
+                            {"type", func.arg_types[i]},
+                            {"args", nl::json::array({arg})},
+                            {"labels", nl::json::array({start->name})}});
+    }
+    std::string acc;
+    if (!op.empty()) {
+      acc = fresh("acc");
+      std::string init = fresh("acc.init");
+      start->instrs.push_back(create(start, {{"dest", init},
+                                             {"op", "const"},
+                                             {"type", func.type},
+                                             {"value", kIdentities.at(op)}}));
+      entry_phis.push_back({{"dest", acc},
+                            {"op", "phi"},
+                            {"type", func.type},
+                            {"args", nl::json::array({init})},
+                            {"labels", nl::json::array({start->name})}});
+    }
+    start->instrs.push_back(create(
+        start, {{"op", "jmp"}, {"labels", nl::json::array({entry->name})}}));
+
+    // Other ways back into the entry keep the values.
+    for (BasicBlock *pred : preds) {
+      for (nl::json &phi : entry_phis) {
+        phi["args"].push_back(phi["dest"]);
+        phi["labels"].push_back(pred->name);
+      }
+    }
+
+    std::unordered_set<BasicBlock *> tail_blocks;
+    for (TailCall &tail : calls) {
+      BasicBlock *bb = tail.bb;
+      tail_blocks.insert(bb);
+      std::vector<std::string> call_args = tail.call->GetArgs();
+      auto pos = std::find(bb->instrs.begin(), bb->instrs.end(), tail.call);
+      bb->instrs.erase(pos, bb->instrs.end());
+      for (int i = 0; i < call_args.size(); ++i) {
+        entry_phis[i]["args"].push_back(call_args[i]);
+        entry_phis[i]["labels"].push_back(bb->name);
+      }
+      if (!acc.empty()) {
+        std::string next = acc;
+        if (!tail.op.empty()) {
+          // Found before the arguments were replaced.
+          std::string with = tail.with;
+          if (auto it = phis.find(with); it != phis.end()) with = it->second;
+          next = fresh(acc);
+          bb->instrs.push_back(create(bb, {{"dest", next},
+                                           {"op", op},
+                                           {"type", func.type},
+                                           {"args", {acc, with}}}));
+        }
+        entry_phis.back()["args"].push_back(next);
+        entry_phis.back()["labels"].push_back(bb->name);
+      }
+      bb->instrs.push_back(create(
+          bb, {{"op", "jmp"}, {"labels", nl::json::array({entry->name})}}));
+    }
+
+    // What is returned now has the accumulator to make up for.
+    if (!acc.empty()) {
+      for (BasicBlock *bb : func.basic_blocks) {
+        if (tail_blocks.contains(bb) || bb->instrs.empty()) continue;
+        Instruction *ret = bb->instrs.back();
+        if (ret->getOp() != "ret") continue;
+        // Returning the identity itself returns the accumulator.
+        Instruction *def = defs[ret->GetArgs()[0]];
+        if (def && def->getOp() == "const" &&
+            def->instr["value"] == kIdentities.at(op)) {
+          ret->instr["args"][0] = acc;
+          continue;
+        }
+        std::string result = fresh(acc + ".ret");
+        bb->instrs.insert(std::prev(bb->instrs.end()),
+                          create(bb, {{"dest", result},
+                                      {"op", op},
+                                      {"type", func.type},
+                                      {"args", {acc, ret->GetArgs()[0]}}}));
+        ret->instr["args"][0] = result;
+      }
+    }
+
+    for (auto it = entry_phis.rbegin(); it != entry_phis.rend(); ++it) {
+      entry->instrs.push_front(create(entry, std::move(*it)));
+    }
+    func.basic_blocks.insert(func.basic_blocks.begin(), start);
+    return true;
+  }
+};
+
+}  // namespace
+
+void tre(Context *ctx, Function &func) {
+  MemScope scope("tre");
+  TailRecursion(ctx, func).run();
+  func.all_instrs.clear();
+}
@@ -0,0 +1,523 @@
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <optional>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "basic_block.h"
+#include "cfg.h"
+#include "context.h"
+#include "function.h"
+#include "instruction.h"
+#include "loop.h"
+#include "loop_utils.h"
+#include "mem_stats.h"
+#include "scev.h"
+#include "transform.h"
+
+// A fully unrolled loop may take up this many instructions: its size times
+// its trip count.
+static constexpr int64_t kFullUnrollBudget = 512;
+// A partially unrolled loop may take up this many instructions, so loops
+// too big for the factor get fewer copies.
+static constexpr int64_t kPartialUnrollBudget = 128;
+
+static bool isPhi(Instruction *instr) {
+  return instr->hasOp() && instr->getOp() == "phi";
+}
+
+namespace {
+
+// The blocks and values of one copy of the loop body.
+struct Copy {
+  std::unordered_map<BasicBlock *, BasicBlock *> blocks;
+  std::unordered_map<std::string, std::string> values;
+
+  std::string value(const std::string &var) const {
+    auto it = values.find(var);
+    return it == values.end() ? var : it->second;
+  }
+};
+
+struct Unroller {
+  Context *ctx;
+  Function &func;
+  CFG &cfg;
+  ScalarEvolution &scev;
+  Loop &loop;
+
+  BasicBlock *latch = nullptr;
+  std::optional<LoopExitTest> test;
+  // Where the exiting block goes to stay in the loop, and to leave it.
+  std::string stay, exit;
+  // The header's phis, with the values they take on entry and from the
+  // latch.
+  std::vector<Instruction *> phis;
+  std::unordered_map<std::string, std::string> init, back;
+  // Values defined in the loop.
+  std::unordered_set<std::string> defined;
+  // Every name in the function, to keep the copies' names apart.
+  std::unordered_set<std::string> used;
+  // New blocks, in the order they go in after the preheader.
+  std::vector<BasicBlock *> created;
+
+  Unroller(Context *ctx, Function &func, CFG &cfg, ScalarEvolution &scev,
+           Loop &loop)
+      : ctx(ctx), func(func), cfg(cfg), scev(scev), loop(loop) {
+    used.insert(func.args.begin(), func.args.end());
+    for (BasicBlock *bb : func.basic_blocks) {
+      used.insert(bb->name);
+      for (Instruction *instr : bb->instrs) {
+        if (!instr->hasDest()) continue;
+        used.insert(instr->GetDest());
+        if (loop.Contains(bb)) defined.insert(instr->GetDest());
+      }
+    }
+  }
+
+  std::string fresh(const std::string &base) {
+    std::string name = base;
+    for (int i = 1; used.contains(name); ++i) {
+      name = base + "." + std::to_string(i);
+    }
+    used.insert(name);
+    return name;
+  }
+
+  BasicBlock *createBlock(const std::string &base) {
+    BasicBlock *bb = ctx->CreateBasicBlock();
+    bb->name = fresh(base);
+    func.block_map[bb->name] = bb;
+    created.push_back(bb);
+    return bb;
+  }
+
+  void append(BasicBlock *bb, nl::json instr) {
+    bb->instrs.push_back(ctx->CreateInstruction(std::move(instr), bb));
+  }
+
+  // Make the preheader jump to `target` instead of the header.
+  void enterAt(BasicBlock *target) {
+    BasicBlock *preheader = loop.preheader;
+    if (FallsThrough(preheader)) {
+      append(preheader,
+             {{"op", "jmp"}, {"labels", nl::json::array({target->name})}});
+    } else {
+      preheader->instrs.back()->instr["labels"] =
+          nl::json::array({target->name});
+    }
+  }
+
+  // Where a jump of `copy` to `name` goes: the copy of the block, unless
+  // it's outside the loop or the header.
+  std::string jumpTarget(const Copy &copy, const std::string &name) {
+    BasicBlock *bb = func.GetBasicBlock(name);
+    if (!loop.Contains(bb) || bb == loop.header) return name;
+    return copy.blocks.at(bb)->name;
+  }
+
+  // A copy of the loop's blocks where the header's phis are `entry`. Jumps
+  // to the header are left for the caller to point at the next copy, and
+  // so is the exiting branch.
+  Copy clone(const std::unordered_map<std::string, std::string> &entry) {
+    Copy copy;
+    copy.values = entry;
+    for (BasicBlock *bb : loop.blocks) {
+      copy.blocks[bb] = createBlock(bb->name);
+      for (Instruction *instr : bb->instrs) {
+        if (!instr->hasDest() || copy.values.contains(instr->GetDest())) {
+          continue;
+        }
+        copy.values[instr->GetDest()] = fresh(instr->GetDest());
+      }
+    }
+    // Phis name the header's copy as a predecessor.
+    auto label = [&](const std::string &name, bool is_jump) {
+      if (is_jump || name != loop.header->name) return jumpTarget(copy, name);
+      return copy.blocks[loop.header]->name;
+    };
+    for (BasicBlock *bb : loop.blocks) {
+      BasicBlock *clone = copy.blocks[bb];
+      for (Instruction *instr : bb->instrs) {
+        if (bb == loop.header && isPhi(instr)) continue;
+        nl::json json = instr->instr;
+        if (json.contains("dest")) json["dest"] = copy.value(json["dest"]);
+        if (json.contains("args")) {
+          for (nl::json &arg : json["args"]) arg = copy.value(arg);
+        }
+        if (json.contains("labels")) {
+          for (nl::json &name : json["labels"]) {
+            name = label(name, !isPhi(instr));
+          }
+        }
+        append(clone, std::move(json));
+      }
+      // The copies are laid out apart from the loop, so they can't fall
+      // through.
+      if (FallsThrough(bb)) {
+        append(clone, {{"op", "jmp"},
+                       {"labels", nl::json::array({label(
+                                      cfg.successors[bb][0]->name, true)})}});
+      }
+    }
+    return copy;
+  }
+
+  // Point the copy's back edge at `next` and make its exiting branch go to
+  // `target` only.
+  void link(const Copy &copy, const std::string &next,
+            const std::string &target) {
+    Instruction *branch = copy.blocks.at(test->exiting)->instrs.back();
+    branch->instr = {{"op", "jmp"}, {"labels", nl::json::array({target})}};
+    Instruction *back_edge = copy.blocks.at(latch)->instrs.back();
+    for (nl::json &name : back_edge->instr["labels"]) {
+      if (name == loop.header->name) name = next;
+    }
+  }
+
+  // Replace the loop with `trip_count` copies of its body in a row.
+  void unrollFully(int64_t trip_count) {
+    std::unordered_map<std::string, std::string> entry = init;
+    std::vector<Copy> copies;
+    for (int64_t i = 0; i < trip_count; ++i) {
+      copies.push_back(clone(entry));
+      for (Instruction *phi : phis) {
+        entry[phi->GetDest()] = copies.back().value(back[phi->GetDest()]);
+      }
+    }
+    for (int64_t i = 0; i < trip_count; ++i) {
+      const Copy &copy = copies[i];
+      if (i + 1 < trip_count) {
+        link(copy, copies[i + 1].blocks.at(loop.header)->name,
+             jumpTarget(copy, stay));
+      } else {
+        // The back edge of the last copy is never taken.
+        link(copy, loop.header->name, exit);
+      }
+    }
+
+    // Code after the loop sees the values of the last iteration.
+    const Copy &last = copies.back();
+    const std::string &exiting = test->exiting->name;
+    for (BasicBlock *bb : func.basic_blocks) {
+      if (loop.Contains(bb)) continue;
+      for (Instruction *instr : bb->instrs) {
+        if (instr->hasArgs()) {
+          for (nl::json &arg : instr->instr["args"]) {
+            if (defined.contains(arg)) arg = last.value(arg);
+          }
+        }
+        if (!isPhi(instr)) continue;
+        for (nl::json &name : instr->instr["labels"]) {
+          if (name == exiting) name = last.blocks.at(test->exiting)->name;
+        }
+      }
+    }
+    enterAt(copies.front().blocks.at(loop.header));
+  }
+
+  // Whether the values of the loop are only used after it by the phis of
+  // the exit.
+  bool exitsThroughPhis() {
+    for (BasicBlock *bb : func.basic_blocks) {
+      if (loop.Contains(bb)) continue;
+      bool exit_phis = bb->name == exit;
+      for (Instruction *instr : bb->instrs) {
+        exit_phis &= isPhi(instr);
+        if (!instr->hasArgs() || exit_phis) continue;
+        for (const std::string &arg : instr->GetArgs()) {
+          if (defined.contains(arg)) return false;
+        }
+      }
+    }
+    return true;
+  }
+
+  // Run the body `copies` times per trip around a new loop while the exit
+  // test is sure to pass that often, and leave the rest of the iterations
+  // to the original loop. Needs the test's recurrence to be a phi of the
+  // header, or the phi plus its step, and moving towards the bound.
+  bool unrollPartially(int copies) {
+    const std::string &op = test->op;
+    int64_t step = test->rec->GetStep()->value;
+    if (!((op == "lt" || op == "le") && step > 0) &&
+        !((op == "gt" || op == "ge") && step < 0)) {
+      return false;
+    }
+    if (defined.contains(test->bound_var)) return false;
+    // Only the phis the test's value is computed from, through copies and
+    // the step, are looked at: asking for the others can be slow on the
+    // long chains full unrolling leaves.
+    std::unordered_map<std::string, Instruction *> defs;
+    for (BasicBlock *bb : loop.blocks) {
+      for (Instruction *instr : bb->instrs) {
+        if (instr->hasDest()) defs[instr->GetDest()] = instr;
+      }
+    }
+    std::unordered_set<std::string> candidates = {test->rec_var};
+    std::vector<std::string> worklist = {test->rec_var};
+    while (!worklist.empty()) {
+      auto it = defs.find(worklist.back());
+      worklist.pop_back();
+      if (it == defs.end() || isPhi(it->second)) continue;
+      std::string op = it->second->getOp();
+      if (op != "id" && op != "add" && op != "sub") continue;
+      for (const std::string &arg : it->second->GetArgs()) {
+        if (candidates.insert(arg).second) worklist.push_back(arg);
+      }
+    }
+    Instruction *iv = nullptr;
+    int64_t offset = 0;
+    for (Instruction *phi : phis) {
+      if (!candidates.contains(phi->GetDest())) continue;
+      const SCEV *rec = scev.Get(phi->GetDest());
+      if (rec->kind != SCEV::kAddRec || rec->loop != &loop ||
+          rec->GetStep() != test->rec->GetStep()) {
+        continue;
+      }
+      const SCEV *diff =
+          scev.GetAdd(test->rec, scev.GetMul(scev.GetConstant(-1), rec));
+      if (diff->IsConstant() && (diff->value == 0 || diff->value == step)) {
+        iv = phi;
+        offset = diff->value;
+        break;
+      }
+    }
+    if (!iv) return false;
+
+    // A loop tested at the bottom runs its body before the test, so the
+    // original loop can't take over with no iterations left. The last
+    // copy's test then decides whether it runs, which needs what's used
+    // after the loop to come through the phis of the exit, and the main
+    // loop only has to make sure the other copies' tests pass.
+    bool keep_test = test->exiting == latch && exitsThroughPhis();
+
+    // The last copy the main loop vouches for tests iv + distance, so the
+    // main loop tests iv against bound - distance. Where that wraps the
+    // bound is too close to the end of the range to unroll, which a
+    // symbolic bound checks at run time.
+    int tested = keep_test ? copies - 1 : copies;
+    __int128 distance = offset + static_cast<__int128>(tested - 1) * step;
+    constexpr __int128 kMin = std::numeric_limits<int64_t>::min();
+    constexpr __int128 kMax = std::numeric_limits<int64_t>::max();
+    if (distance < kMin || distance > kMax) return false;
+    BasicBlock *preheader = loop.preheader;
+    auto insert = [&](nl::json instr) {
+      std::string dest = instr["dest"];
+      preheader->instrs.insert(
+          BeforeTerminator(preheader),
+          ctx->CreateInstruction(std::move(instr), preheader));
+      return dest;
+    };
+    std::string limit, safe;
+    if (test->bound->IsConstant()) {
+      __int128 value = test->bound->value - distance;
+      if (value < kMin || value > kMax) return false;
+      limit = insert({{"dest", fresh(test->bound_var + ".unroll")},
+                      {"op", "const"},
+                      {"type", "int"},
+                      {"value", static_cast<int64_t>(value)}});
+    } else {
+      std::string distance_var =
+          insert({{"dest", fresh(test->bound_var + ".distance")},
+                  {"op", "const"},
+                  {"type", "int"},
+                  {"value", static_cast<int64_t>(distance)}});
+      limit = insert({{"dest", fresh(test->bound_var + ".unroll")},
+                      {"op", "sub"},
+                      {"type", "int"},
+                      {"args", {test->bound_var, distance_var}}});
+      safe = insert({{"dest", fresh(test->bound_var + ".unroll.safe")},
+                     {"op", step > 0 ? "le" : "ge"},
+                     {"type", "bool"},
+                     {"args", {limit, test->bound_var}}});
+    }
+
+    BasicBlock *main = createBlock(loop.header->name + ".unrolled");
+    std::unordered_map<std::string, std::string> entry;
+    for (Instruction *phi : phis) {
+      entry[phi->GetDest()] = fresh(phi->GetDest() + ".unrolled");
+    }
+    std::vector<Copy> bodies;
+    for (int i = 0; i < copies; ++i) {
+      bodies.push_back(clone(entry));
+      for (Instruction *phi : phis) {
+        entry[phi->GetDest()] = bodies.back().value(back[phi->GetDest()]);
+      }
+    }
+    for (int i = 0; i + 1 < copies; ++i) {
+      link(bodies[i], bodies[i + 1].blocks.at(loop.header)->name,
+           jumpTarget(bodies[i], stay));
+    }
+    const Copy &last = bodies.back();
+    const std::string &first = bodies.front().blocks.at(loop.header)->name;
+    const std::string &last_latch = last.blocks.at(latch)->name;
+    for (Instruction *phi : phis) {
+      std::string dest = phi->GetDest();
+      append(main, {{"dest", bodies.front().value(dest)},
+                    {"op", "phi"},
+                    {"type", phi->instr["type"]},
+                    {"args", {init[dest], entry[dest]}},
+                    {"labels", {preheader->name, last_latch}}});
+    }
+    auto compare = [&](const std::string &value, const std::string &base) {
+      return nl::json{{"dest", fresh(loop.header->name + base)},
+                      {"op", op},
+                      {"type", "bool"},
+                      {"args", {value, limit}}};
+    };
+    enterAt(main);
+
+    if (!keep_test) {
+      link(last, main->name, jumpTarget(last, stay));
+      for (Instruction *phi : phis) {
+        std::string dest = phi->GetDest();
+        // The original loop picks up where the main one left off, or runs
+        // on its own when the limit would wrap.
+        phi->instr["args"] = {bodies.front().value(dest), back[dest]};
+        phi->instr["labels"] = {main->name, latch->name};
+        if (!safe.empty()) {
+          phi->instr["args"].push_back(init[dest]);
+          phi->instr["labels"].push_back(preheader->name);
+        }
+      }
+      nl::json go = compare(bodies.front().value(iv->GetDest()),
+                            ".unrolled.go");
+      std::string go_var = go["dest"];
+      append(main, std::move(go));
+      append(main, {{"op", "br"},
+                    {"args", {go_var}},
+                    {"labels", {first, loop.header->name}}});
+      if (!safe.empty()) {
+        preheader->instrs.back()->instr = {
+            {"op", "br"},
+            {"args", {safe}},
+            {"labels", {main->name, loop.header->name}}};
+      }
+      return true;
+    }
+
+    // The main loop is tested at the bottom too, and the last copy's test
+    // only decides whether the original loop runs once it's done.
+    BasicBlock *rest = createBlock(loop.header->name + ".rest");
+    BasicBlock *last_block = last.blocks.at(latch);
+    rest->instrs.push_back(last_block->instrs.back());
+    rest->instrs.back()->parent = rest;
+    last_block->instrs.pop_back();
+    nl::json go = compare(entry[iv->GetDest()], ".unrolled.go");
+    std::string go_var = go["dest"];
+    append(last_block, std::move(go));
+    append(last_block, {{"op", "br"},
+                        {"args", {go_var}},
+                        {"labels", {main->name, rest->name}}});
+    append(main, {{"op", "jmp"}, {"labels", nl::json::array({first})}});
+    for (Instruction *phi : phis) {
+      std::string dest = phi->GetDest();
+      phi->instr["args"] = {entry[dest], back[dest], init[dest]};
+      phi->instr["labels"] = {rest->name, latch->name, preheader->name};
+    }
+    for (Instruction *phi : func.GetBasicBlock(exit)->instrs) {
+      if (!isPhi(phi)) break;
+      std::vector<std::string> args = phi->GetArgs();
+      std::vector<std::string> labels = phi->GetLabels();
+      for (int i = 0; i < args.size(); ++i) {
+        if (labels[i] != latch->name) continue;
+        phi->instr["args"].push_back(last.value(args[i]));
+        phi->instr["labels"].push_back(rest->name);
+      }
+    }
+    std::string enter =
+        insert(compare(init[iv->GetDest()], ".unrolled.enter"));
+    if (!safe.empty()) {
+      enter = insert({{"dest", fresh(enter + ".safe")},
+                      {"op", "and"},
+                      {"type", "bool"},
+                      {"args", {safe, enter}}});
+    }
+    preheader->instrs.back()->instr = {
+        {"op", "br"},
+        {"args", {enter}},
+        {"labels", {main->name, loop.header->name}}};
+    return true;
+  }
+
+  bool run(int factor) {
+    if (!loop.children.empty() || !loop.preheader ||
+        loop.latches.size() != 1) {
+      return false;
+    }
+    latch = loop.latches[0];
+    for (Instruction *phi : loop.header->instrs) {
+      if (!isPhi(phi)) break;
+      std::vector<std::string> args = phi->GetArgs();
+      std::vector<std::string> labels = phi->GetLabels();
+      if (args.size() != 2) return false;
+      std::string dest = phi->GetDest();
+      for (int i = 0; i < 2; ++i) {
+        if (args[i] == "__undef") return false;
+        if (labels[i] == loop.preheader->name) init[dest] = args[i];
+        if (labels[i] == latch->name) back[dest] = args[i];
+      }
+      if (!init.contains(dest) || !back.contains(dest)) return false;
+      phis.push_back(phi);
+    }
+    test = scev.GetExitTest(&loop);
+    if (!test) return false;
+    std::vector<std::string> targets =
+        test->exiting->instrs.back()->GetLabels();
+    bool first_stays = loop.Contains(func.GetBasicBlock(targets[0]));
+    stay = targets[first_stays ? 0 : 1];
+    exit = targets[first_stays ? 1 : 0];
+
+    int64_t size = 0;
+    for (BasicBlock *bb : loop.blocks) size += bb->instrs.size();
+    std::optional<int64_t> trip_count = scev.GetConstantTripCount(&loop);
+    if (trip_count &&
+        *trip_count <= kFullUnrollBudget / std::max<int64_t>(size, 1)) {
+      unrollFully(*trip_count);
+    } else {
+      int copies = std::min<int64_t>(factor, kPartialUnrollBudget / size);
+      if (copies < 2 || (trip_count && *trip_count <= copies) ||
+          !unrollPartially(copies)) {
+        return false;
+      }
+    }
+    auto pos = std::find(func.basic_blocks.begin(), func.basic_blocks.end(),
+                         loop.preheader);
+    func.basic_blocks.insert(std::next(pos), created.begin(), created.end());
+    RemoveUnreachableBlocks(func);
+    MergeBlocks(func);
+    return true;
+  }
+};
+
+}  // namespace
+
+void unroll(Context *ctx, Function &func, int factor) {
+  MemScope scope("unroll");
+  AnalysisCache analyses(func);
+  // Headers of the loops that were looked at already, including those
+  // unrolling left behind.
+  std::set<std::string> seen;
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    LoopInfo &info = analyses.GetLoopInfo();
+    for (auto it = info.loops.rbegin(); it != info.loops.rend(); ++it) {
+      Loop &loop = **it;
+      if (!seen.insert(loop.header->name).second) continue;
+      Unroller unroller(ctx, func, analyses.GetCFG(),
+                        analyses.GetScalarEvolution(), loop);
+      if (!unroller.run(factor)) continue;
+      for (BasicBlock *bb : unroller.created) seen.insert(bb->name);
+      changed = true;
+      break;
+    }
+    analyses.Invalidate();
+  }
+  func.all_instrs.clear();
+}
@@ -0,0 +1,316 @@
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "basic_block.h"
+#include "cfg.h"
+#include "context.h"
+#include "dom.h"
+#include "function.h"
+#include "instruction.h"
+#include "loop.h"
+#include "loop_utils.h"
+#include "mem_stats.h"
+#include "transform.h"
+
+// A loop is copied whole to be unswitched, so only loops of up to this many
+// instructions are.
+static constexpr int64_t kUnswitchLoopBudget = 100;
+// Instructions unswitching may add to a function in all: every unswitched
+// branch doubles the loop around it, so the budget bounds the blowup when a
+// loop tests several flags.
+static constexpr int64_t kUnswitchFunctionBudget = 400;
+
+static bool isPhi(Instruction *instr) {
+  return instr->hasOp() && instr->getOp() == "phi";
+}
+
+namespace {
+
+struct Unswitcher {
+  Context *ctx;
+  Function &func;
+  CFG &cfg;
+  DomInfo &dom;
+  Loop &loop;
+
+  // The block defining every SSA name but the arguments.
+  std::unordered_map<std::string, BasicBlock *> def_block;
+  // Every name in the function, to keep the copy's names apart.
+  std::unordered_set<std::string> used;
+  // The copy of every block and value of the loop.
+  std::unordered_map<BasicBlock *, BasicBlock *> blocks;
+  std::unordered_map<std::string, std::string> values;
+  // New blocks, in the order they go in after the preheader.
+  std::vector<BasicBlock *> created;
+
+  Unswitcher(Context *ctx, Function &func, CFG &cfg, DomInfo &dom,
+             Loop &loop)
+      : ctx(ctx), func(func), cfg(cfg), dom(dom), loop(loop) {
+    used.insert(func.args.begin(), func.args.end());
+    for (BasicBlock *bb : func.basic_blocks) {
+      used.insert(bb->name);
+      for (Instruction *instr : bb->instrs) {
+        if (!instr->hasDest()) continue;
+        used.insert(instr->GetDest());
+        def_block[instr->GetDest()] = bb;
+      }
+    }
+  }
+
+  std::string fresh(const std::string &base) {
+    std::string name = base;
+    for (int i = 1; used.contains(name); ++i) {
+      name = base + "." + std::to_string(i);
+    }
+    used.insert(name);
+    return name;
+  }
+
+  BasicBlock *createBlock(const std::string &base) {
+    BasicBlock *bb = ctx->CreateBasicBlock();
+    bb->name = fresh(base);
+    func.block_map[bb->name] = bb;
+    created.push_back(bb);
+    return bb;
+  }
+
+  void append(BasicBlock *bb, nl::json instr) {
+    bb->instrs.push_back(ctx->CreateInstruction(std::move(instr), bb));
+  }
+
+  bool definedInLoop(const std::string &var) {
+    auto it = def_block.find(var);
+    return it != def_block.end() && loop.Contains(it->second);
+  }
+
+  bool dominates(BasicBlock *a, BasicBlock *b) {
+    const std::vector<BasicBlock *> &doms = dom.dom[b];
+    return std::find(doms.begin(), doms.end(), a) != doms.end();
+  }
+
+  std::string value(const std::string &var) const {
+    auto it = values.find(var);
+    return it == values.end() ? var : it->second;
+  }
+
+  std::string label(const std::string &name) {
+    BasicBlock *bb = func.GetBasicBlock(name);
+    return loop.Contains(bb) ? blocks.at(bb)->name : name;
+  }
+
+  // The first branch of the loop on a condition the loop doesn't change.
+  Instruction *findBranch() {
+    for (BasicBlock *bb : loop.blocks) {
+      if (bb->instrs.empty()) continue;
+      Instruction *branch = bb->instrs.back();
+      if (!branch->hasOp() || branch->getOp() != "br") continue;
+      std::vector<std::string> labels = branch->GetLabels();
+      std::string cond = branch->GetArgs()[0];
+      if (labels[0] == labels[1] || cond == "__undef" ||
+          definedInLoop(cond)) {
+        continue;
+      }
+      return branch;
+    }
+    return nullptr;
+  }
+
+  // Copy the blocks of the loop, with the branches and phis between them
+  // pointing at the copies.
+  void clone() {
+    for (BasicBlock *bb : loop.blocks) {
+      blocks[bb] = createBlock(bb->name + ".unswitched");
+      for (Instruction *instr : bb->instrs) {
+        if (!instr->hasDest()) continue;
+        values[instr->GetDest()] = fresh(instr->GetDest());
+      }
+    }
+    for (BasicBlock *bb : loop.blocks) {
+      BasicBlock *copy = blocks[bb];
+      for (Instruction *instr : bb->instrs) {
+        nl::json json = instr->instr;
+        if (json.contains("dest")) json["dest"] = value(json["dest"]);
+        if (json.contains("args")) {
+          for (nl::json &arg : json["args"]) arg = value(arg);
+        }
+        if (json.contains("labels")) {
+          for (nl::json &name : json["labels"]) name = label(name);
+        }
+        append(copy, std::move(json));
+      }
+      // The copy is laid out apart from the loop, so it can't fall through.
+      if (FallsThrough(bb)) {
+        append(copy,
+               {{"op", "jmp"},
+                {"labels",
+                 nl::json::array({label(cfg.successors[bb][0]->name)})}});
+      }
+    }
+  }
+
+  bool run(int64_t &budget) {
+    if (!loop.preheader) return false;
+    int64_t size = 0;
+    for (BasicBlock *bb : loop.blocks) size += bb->instrs.size();
+    if (size > kUnswitchLoopBudget || size > budget) return false;
+    Instruction *branch = findBranch();
+    if (!branch) return false;
+
+    // Values of the loop used after it, other than by the phis of the exit
+    // blocks, have to merge the two versions in the exit. That takes a
+    // single exit only reached from the loop, which they dominate.
+    std::unordered_set<std::string> escaping;
+    for (BasicBlock *bb : func.basic_blocks) {
+      if (loop.Contains(bb)) continue;
+      for (Instruction *instr : bb->instrs) {
+        if (!instr->hasArgs()) continue;
+        std::vector<std::string> args = instr->GetArgs();
+        for (int i = 0; i < args.size(); ++i) {
+          if (!definedInLoop(args[i])) continue;
+          if (isPhi(instr) &&
+              loop.Contains(func.GetBasicBlock(instr->GetLabels()[i]))) {
+            continue;
+          }
+          escaping.insert(args[i]);
+        }
+      }
+    }
+    BasicBlock *exit = nullptr;
+    if (!escaping.empty()) {
+      if (loop.exits.size() != 1) return false;
+      exit = loop.exits[0];
+      for (BasicBlock *pred : cfg.predecessors[exit]) {
+        if (!loop.Contains(pred)) return false;
+        for (const std::string &var : escaping) {
+          if (!dominates(def_block[var], pred)) return false;
+        }
+      }
+    }
+
+    BasicBlock *preheader = loop.preheader;
+    BasicBlock *taken = createBlock(preheader->name + ".then");
+    BasicBlock *not_taken = createBlock(preheader->name + ".else");
+    clone();
+    append(taken, {{"op", "jmp"},
+                   {"labels", nl::json::array({loop.header->name})}});
+    append(not_taken,
+           {{"op", "jmp"},
+            {"labels", nl::json::array({blocks[loop.header]->name})}});
+    for (Instruction *phi : loop.header->instrs) {
+      if (!isPhi(phi)) break;
+      for (nl::json &name : phi->instr["labels"]) {
+        if (name == preheader->name) name = taken->name;
+      }
+    }
+    for (Instruction *phi : blocks[loop.header]->instrs) {
+      if (!isPhi(phi)) break;
+      for (nl::json &name : phi->instr["labels"]) {
+        if (name == preheader->name) name = not_taken->name;
+      }
+    }
+
+    // Each version takes one side of the branch for good.
+    std::vector<std::string> targets = branch->GetLabels();
+    nl::json cond = branch->GetArgs()[0];
+    BasicBlock *copy = blocks[branch->parent];
+    branch->instr = {{"op", "jmp"}, {"labels", {targets[0]}}};
+    copy->instrs.back()->instr = {{"op", "jmp"},
+                                  {"labels", {label(targets[1])}}};
+    nl::json guard = {{"op", "br"},
+                      {"args", {cond}},
+                      {"labels", {taken->name, not_taken->name}}};
+    if (FallsThrough(preheader)) {
+      append(preheader, std::move(guard));
+    } else {
+      preheader->instrs.back()->instr = std::move(guard);
+    }
+
+    // The exits are reached from both versions now.
+    for (BasicBlock *bb : loop.exits) {
+      for (Instruction *phi : bb->instrs) {
+        if (!isPhi(phi)) break;
+        std::vector<std::string> args = phi->GetArgs();
+        std::vector<std::string> labels = phi->GetLabels();
+        for (int i = 0; i < args.size(); ++i) {
+          BasicBlock *pred = func.GetBasicBlock(labels[i]);
+          if (!loop.Contains(pred)) continue;
+          phi->instr["args"].push_back(value(args[i]));
+          phi->instr["labels"].push_back(blocks[pred]->name);
+        }
+      }
+    }
+    std::unordered_map<std::string, std::string> merged;
+    if (exit) {
+      auto pos = std::find_if_not(exit->instrs.begin(), exit->instrs.end(),
+                                  isPhi);
+      for (const std::string &var : escaping) {
+        nl::json args = nl::json::array(), labels = nl::json::array();
+        for (BasicBlock *pred : cfg.predecessors[exit]) {
+          args.push_back(var);
+          labels.push_back(pred->name);
+          args.push_back(value(var));
+          labels.push_back(blocks[pred]->name);
+        }
+        nl::json type;
+        for (Instruction *instr : def_block[var]->instrs) {
+          if (instr->hasDest() && instr->GetDest() == var) {
+            type = instr->instr["type"];
+          }
+        }
+        merged[var] = fresh(var + ".merged");
+        nl::json phi = {{"dest", merged[var]},
+                        {"op", "phi"},
+                        {"type", std::move(type)},
+                        {"args", std::move(args)},
+                        {"labels", std::move(labels)}};
+        pos = std::next(exit->instrs.insert(
+            pos, ctx->CreateInstruction(std::move(phi), exit)));
+      }
+      for (BasicBlock *bb : func.basic_blocks) {
+        if (loop.Contains(bb)) continue;
+        for (Instruction *instr : bb->instrs) {
+          if (!instr->hasArgs() || (bb == exit && isPhi(instr))) continue;
+          for (nl::json &arg : instr->instr["args"]) {
+            if (auto it = merged.find(arg); it != merged.end()) {
+              arg = it->second;
+            }
+          }
+        }
+      }
+    }
+
+    auto pos = std::find(func.basic_blocks.begin(), func.basic_blocks.end(),
+                         preheader);
+    func.basic_blocks.insert(std::next(pos), created.begin(), created.end());
+    RemoveUnreachableBlocks(func);
+    budget -= size;
+    return true;
+  }
+};
+
+}  // namespace
+
+void unswitch(Context *ctx, Function &func) {
+  MemScope scope("unswitch");
+  AnalysisCache analyses(func);
+  int64_t budget = kUnswitchFunctionBudget;
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    LoopInfo &info = analyses.GetLoopInfo();
+    // Outermost loops first, to take a branch as far out as it's invariant.
+    for (const auto &loop : info.loops) {
+      Unswitcher unswitcher(ctx, func, analyses.GetCFG(),
+                            analyses.GetDomInfo(), *loop);
+      if (!unswitcher.run(budget)) continue;
+      changed = true;
+      break;
+    }
+    analyses.Invalidate();
+  }
+  func.all_instrs.clear();
+}
@@ -0,0 +1,336 @@
+#include "vm.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <map>
+#include <stdexcept>
+
+#include "bytecode.h"
+#include "function.h"
+#include "interp.h"
+
+#if defined(__GNUC__) || defined(__clang__)
+#define BRANDY_COMPUTED_GOTO 1
+#endif
+
+// Enough for deep recursion without growing the stack.
+static constexpr size_t kStackSlots = 1 << 22;
+// Every Bril call recurses into execute, so keep some native stack too.
+static constexpr uintptr_t kNativeReserve = 1 << 20;
+
+VM::VM(const std::vector<Function *> &functions, std::ostream &out,
+       bool profile_pairs)
+    : out(out),
+      stack(new Slot[kStackSlots]),
+      stack_top(stack.get()),
+      stack_end(stack.get() + kStackSlots),
+      profile_pairs(profile_pairs) {
+  std::map<std::string, int> index;
+  for (int i = 0; i < functions.size(); ++i) index[functions[i]->name] = i;
+  for (Function *function : functions) {
+    auto &lowered = this->functions.emplace_back(
+        std::make_unique<VMFunction>());
+    // Profiling wants to see every base instruction.
+    LowerFunction(*function, index, *lowered, !profile_pairs);
+  }
+}
+
+VM::~VM() = default;
+
+void VM::Run(const std::vector<std::string> &args) {
+  VMFunction *main = nullptr;
+  for (auto &function : functions) {
+    if (function->name == "main") main = function.get();
+  }
+  if (!main) throw std::runtime_error("no @main function");
+  if (args.size() != main->num_params) {
+    throw std::runtime_error("@main expects " +
+                             std::to_string(main->num_params) +
+                             " arguments");
+  }
+
+  native_limit = NativeStackLimit(kNativeReserve);
+  Slot *frame = stack_top;
+  stack_top += main->num_slots;
+  for (int i = 0; i < args.size(); ++i) {
+    Value value = Value::Parse(args[i], main->param_types[i]);
+    if (value.kind == Value::Kind::Float) {
+      frame[i].f = value.f;
+    } else if (value.kind == Value::Kind::Bool) {
+      frame[i].i = value.b;
+    } else if (value.kind == Value::Kind::Char) {
+      frame[i].i = value.c;
+    } else {
+      frame[i].i = value.i;
+    }
+  }
+  if (profile_pairs) {
+    pair_counts.assign(kNumBaseOps * kNumBaseOps, 0);
+    execute<true>(*main, frame);
+  } else {
+    execute<false>(*main, frame);
+  }
+  stack_top = frame;
+
+  if (live_allocs != 0) {
+    throw std::runtime_error(
+        "Some memory locations have not been freed by end of execution.");
+  }
+}
+
+std::string VM::format(const VMFunction &fn, const Slot *fp,
+                       const VMInstr *ip) {
+  const int32_t *args = fn.pool.data() + ip->c;
+  std::string line;
+  for (int i = 0; i < ip->b; ++i) {
+    Slot value = fp[args[2 * i]];
+    if (i) line += " ";
+    switch (static_cast<Tag>(args[2 * i + 1])) {
+      case Tag::Int:
+        line += std::to_string(value.i);
+        break;
+      case Tag::Bool:
+        line += value.i ? "true" : "false";
+        break;
+      case Tag::Float:
+        line += Value::Float(value.f).ToString();
+        break;
+      case Tag::Char:
+        line += Value::Char(static_cast<char32_t>(value.i)).ToString();
+        break;
+      case Tag::Ptr:
+        line += std::to_string(reinterpret_cast<intptr_t>(value.p));
+        break;
+    }
+  }
+  return line;
+}
+
+// The semantics of every opcode, written once so that the superinstructions
+// can be stamped out of them. OP_x executes the instruction at `ip`, TAIL_x
+// continues with the next one; for control flow OP_x dispatches by itself and
+// TAIL_x is empty.
+#define DST fp[ip->dst]
+#define A fp[ip->a]
+#define B fp[ip->b]
+// Integers wrap around like two's complement 64-bit values.
+#define WRAP(expr) static_cast<int64_t>(expr)
+#define U(slot) static_cast<uint64_t>((slot).i)
+
+#define OP_Const DST = ip->imm
+#define OP_Mov DST = A
+#define OP_Add DST.i = WRAP(U(A) + U(B))
+#define OP_Sub DST.i = WRAP(U(A) - U(B))
+#define OP_Mul DST.i = WRAP(U(A) * U(B))
+#define OP_Div                                                       \
+  {                                                                  \
+    if (B.i == 0) throw std::runtime_error("division by zero");      \
+    DST.i = B.i == -1 ? WRAP(0 - U(A)) : A.i / B.i;                  \
+  }
+#define OP_Eq DST.i = A.i == B.i
+#define OP_Lt DST.i = A.i < B.i
+#define OP_Gt DST.i = A.i > B.i
+#define OP_Le DST.i = A.i <= B.i
+#define OP_Ge DST.i = A.i >= B.i
+#define OP_Not DST.i = !A.i
+#define OP_And DST.i = A.i && B.i
+#define OP_Or DST.i = A.i || B.i
+#define OP_Fadd DST.f = A.f + B.f
+#define OP_Fsub DST.f = A.f - B.f
+#define OP_Fmul DST.f = A.f * B.f
+#define OP_Fdiv DST.f = A.f / B.f
+#define OP_Feq DST.i = A.f == B.f
+#define OP_Flt DST.i = A.f < B.f
+#define OP_Fgt DST.i = A.f > B.f
+#define OP_Fle DST.i = A.f <= B.f
+#define OP_Fge DST.i = A.f >= B.f
+#define OP_Alloc                                                     \
+  {                                                                  \
+    if (A.i <= 0) {                                                  \
+      throw std::runtime_error("cannot allocate " +                  \
+                               std::to_string(A.i) + " entries");    \
+    }                                                                \
+    DST.p = new Slot[A.i]();                                         \
+    ++live_allocs;                                                   \
+  }
+#define OP_Free    \
+  {                \
+    delete[] A.p;  \
+    --live_allocs; \
+  }
+#define OP_Store *A.p = B
+#define OP_Load DST = *A.p
+#define OP_PtrAdd DST.p = A.p + B.i
+#define OP_Jmp JUMP(ip->b)
+#define OP_Br JUMP(A.i ? ip->b : ip->c)
+#define OP_Call                                                      \
+  {                                                                  \
+    VMFunction &callee = *functions[ip->a];                          \
+    Slot *callee_fp = stack_top;                                     \
+    char here;                                                       \
+    if (callee_fp + callee.num_slots > stack_end ||                  \
+        reinterpret_cast<uintptr_t>(&here) < native_limit) {         \
+      throw std::runtime_error("stack overflow");                    \
+    }                                                                \
+    const int32_t *args = fn.pool.data() + ip->c;                    \
+    for (int i = 0; i < ip->b; ++i) callee_fp[i] = fp[args[i]];      \
+    stack_top += callee.num_slots;                                   \
+    Slot result = execute<kProfile>(callee, callee_fp);              \
+    stack_top = callee_fp;                                           \
+    if (ip->dst >= 0) DST = result;                                  \
+  }
+#define OP_Ret return ip->a >= 0 ? A : Slot{0}
+#define OP_Print out << format(fn, fp, ip) << "\n"
+#define OP_Nop
+
+#define TAIL_Jmp
+#define TAIL_Br
+#define TAIL_Ret
+#define TAIL_DEFAULT NEXT()
+#define TAIL_Const TAIL_DEFAULT
+#define TAIL_Mov TAIL_DEFAULT
+#define TAIL_Add TAIL_DEFAULT
+#define TAIL_Sub TAIL_DEFAULT
+#define TAIL_Mul TAIL_DEFAULT
+#define TAIL_Div TAIL_DEFAULT
+#define TAIL_Eq TAIL_DEFAULT
+#define TAIL_Lt TAIL_DEFAULT
+#define TAIL_Gt TAIL_DEFAULT
+#define TAIL_Le TAIL_DEFAULT
+#define TAIL_Ge TAIL_DEFAULT
+#define TAIL_Not TAIL_DEFAULT
+#define TAIL_And TAIL_DEFAULT
+#define TAIL_Or TAIL_DEFAULT
+#define TAIL_Fadd TAIL_DEFAULT
+#define TAIL_Fsub TAIL_DEFAULT
+#define TAIL_Fmul TAIL_DEFAULT
+#define TAIL_Fdiv TAIL_DEFAULT
+#define TAIL_Feq TAIL_DEFAULT
+#define TAIL_Flt TAIL_DEFAULT
+#define TAIL_Fgt TAIL_DEFAULT
+#define TAIL_Fle TAIL_DEFAULT
+#define TAIL_Fge TAIL_DEFAULT
+#define TAIL_Alloc TAIL_DEFAULT
+#define TAIL_Free TAIL_DEFAULT
+#define TAIL_Store TAIL_DEFAULT
+#define TAIL_Load TAIL_DEFAULT
+#define TAIL_PtrAdd TAIL_DEFAULT
+#define TAIL_Call TAIL_DEFAULT
+#define TAIL_Print TAIL_DEFAULT
+#define TAIL_Nop TAIL_DEFAULT
+
+template <bool kProfile>
+Slot VM::execute(VMFunction &fn, Slot *fp) {
+#ifdef BRANDY_COMPUTED_GOTO
+  static const void *const kHandlers[] = {
+#define X(op) &&L_##op,
+      VM_OPS(X)
+#undef X
+#define SUPERINSTR(first, second) &&L_##first##_##second,
+#include "vm_superinstrs.def"
+#undef SUPERINSTR
+  };
+  if (fn.threaded != kHandlers) {
+    for (VMInstr &instr : fn.code) {
+      instr.handler = kHandlers[static_cast<int>(instr.op)];
+    }
+    fn.threaded = kHandlers;
+  }
+#define TARGET(op) L_##op
+#define GOTO_HANDLER() goto *ip->handler
+#else
+#define TARGET(op) case VMOp::op
+#define GOTO_HANDLER() goto dispatch
+#endif
+  // When profiling, count every pair of consecutively executed opcodes.
+#define DISPATCH()                                                     \
+  do {                                                                 \
+    if constexpr (kProfile) {                                          \
+      int op = static_cast<int>(ip->op);                               \
+      if (prev_op >= 0) pair_counts[prev_op * kNumBaseOps + op]++;     \
+      prev_op = op;                                                    \
+    }                                                                  \
+    GOTO_HANDLER();                                                    \
+  } while (0)
+#define NEXT() \
+  do {         \
+    ++ip;      \
+    DISPATCH(); \
+  } while (0)
+#define JUMP(pc)                \
+  do {                          \
+    ip = fn.code.data() + (pc); \
+    DISPATCH();                 \
+  } while (0)
+
+  [[maybe_unused]] int prev_op = -1;
+  const VMInstr *ip = fn.code.data();
+#ifdef BRANDY_COMPUTED_GOTO
+  DISPATCH();
+#else
+dispatch:
+  switch (ip->op) {
+#endif
+
+#define X(op) \
+  TARGET(op) : OP_##op; \
+  TAIL_##op;
+  VM_OPS(X)
+#undef X
+
+  // A superinstruction runs both halves without dispatching in between. The
+  // second half keeps its own VMInstr right behind the first.
+#define SUPERINSTR(first, second)   \
+  TARGET(first##_##second) : {      \
+    OP_##first;                     \
+    ++ip;                           \
+    OP_##second;                    \
+    TAIL_##second;                  \
+  }
+#include "vm_superinstrs.def"
+#undef SUPERINSTR
+
+#ifndef BRANDY_COMPUTED_GOTO
+  }
+#endif
+
+#undef TARGET
+#undef GOTO_HANDLER
+#undef DISPATCH
+#undef NEXT
+#undef JUMP
+  return Slot{0};
+}
+
+template Slot VM::execute<false>(VMFunction &fn, Slot *fp);
+template Slot VM::execute<true>(VMFunction &fn, Slot *fp);
+
+void VM::DumpPairProfile(std::ostream &os) const {
+  static const char *kNames[] = {
+#define X(op) #op,
+      VM_OPS(X)
+#undef X
+  };
+
+  uint64_t total = 0;
+  std::vector<std::pair<uint64_t, int>> pairs;
+  for (int i = 0; i < pair_counts.size(); ++i) {
+    total += pair_counts[i];
+    VMOp first = static_cast<VMOp>(i / kNumBaseOps);
+    // Control flow doesn't fall through into its successor.
+    if (first == VMOp::Jmp || first == VMOp::Br || first == VMOp::Ret) {
+      continue;
+    }
+    if (pair_counts[i]) pairs.emplace_back(pair_counts[i], i);
+  }
+  std::sort(pairs.rbegin(), pairs.rend());
+
+  os << "// Dynamic opcode pairs over " << total << " dispatches.\n";
+  for (int i = 0; i < pairs.size() && i < 16; ++i) {
+    auto [count, pair] = pairs[i];
+    char share[32];
+    std::snprintf(share, sizeof(share), "%.2f%%", 100.0 * count / total);
+    os << "SUPERINSTR(" << kNames[pair / kNumBaseOps] << ", "
+       << kNames[pair % kNumBaseOps] << ")  // " << share << "\n";
+  }
+}